@@ -0,0 +1,373 @@
+/// A dependency-free Fast Fourier Transform module.
+///
+/// 1D complex transforms of any length whose only prime factors are
+/// 2, 3 and 5 (mixed-radix, decimation in time), and 2D real-to-complex
+/// transforms built on them, multithreaded by rows and then by columns.
+
+#include "fft.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parallel.h"
+
+/// Smallest length >= n whose only prime factors are 2, 3 and 5.
+int FFTSize(int n) { ///
+  assert (n >= 0);
+  if (n <= 1) return 1;
+  for (;; n++) {
+    int m = n;
+    while (m % 2 == 0) m /= 2;
+    while (m % 3 == 0) m /= 3;
+    while (m % 5 == 0) m /= 5;
+    if (m == 1) return n;
+  }
+}
+
+
+/// 1D transforms
+
+// Maximum number of radix stages (4^16 > any int length)
+#define MAXFACTORS 32
+
+struct fftplan {
+  int n;
+  int factors[2*MAXFACTORS];  // pairs (radix p, remaining length m = n/p...)
+  FFTComplex* twiddle;        // exp(-2*pi*i*k/n) for k < n, then exp(+2*pi*i*k/n)
+};
+
+/// Create a plan for complex transforms of length n.
+FFTPlan FFTPlanCreate(int n) { ///
+  assert (n >= 1);
+  FFTPlan p = (FFTPlan)malloc(sizeof(*p));
+  if (p == NULL) return NULL;
+  p->n = n;
+  p->twiddle = (FFTComplex*)malloc(2 * n * sizeof(FFTComplex));
+  if (p->twiddle == NULL) {
+    free(p);
+    return NULL;
+  }
+  for (int k = 0; k < n; k++) {
+    double phase = -2.0 * M_PI * k / n;
+    p->twiddle[k].re = cos(phase);
+    p->twiddle[k].im = sin(phase);
+    p->twiddle[n+k].re = p->twiddle[k].re;   // inverse: conjugate
+    p->twiddle[n+k].im = -p->twiddle[k].im;
+  }
+  // Radix 4 stages first, then 2, 3 and 5
+  static const int radix[] = {4, 2, 3, 5};
+  int* f = p->factors;
+  int m = n;
+  for (int r = 0; r < 4; r++) {
+    while (m % radix[r] == 0 && m > 1) {
+      m /= radix[r];
+      *f++ = radix[r];
+      *f++ = m;
+    }
+  }
+  assert (m == 1);   // n must be 5-smooth
+  if (n == 1) {
+    f[0] = 1;
+    f[1] = 1;
+  }
+  return p;
+}
+
+/// Destroy the plan pointed to by (*pp) and set (*pp)=NULL.
+void FFTPlanDestroy(FFTPlan* pp) { ///
+  assert (pp != NULL);
+  if (*pp == NULL) return;
+  free((*pp)->twiddle);
+  free(*pp);
+  *pp = NULL;
+}
+
+static inline FFTComplex cmul(FFTComplex a, FFTComplex b) {
+  FFTComplex c = { a.re*b.re - a.im*b.im, a.re*b.im + a.im*b.re };
+  return c;
+}
+
+static void butterfly2(FFTComplex* out, int fstride, const FFTComplex* tw, int m) {
+  FFTComplex* out2 = out + m;
+  for (int k = 0; k < m; k++) {
+    FFTComplex t = cmul(out2[k], tw[k*fstride]);
+    out2[k].re = out[k].re - t.re;
+    out2[k].im = out[k].im - t.im;
+    out[k].re += t.re;
+    out[k].im += t.im;
+  }
+}
+
+static void butterfly4(FFTComplex* out, int fstride, const FFTComplex* tw, int inverse, int m) {
+  for (int k = 0; k < m; k++) {
+    FFTComplex s0 = cmul(out[k+m], tw[k*fstride]);
+    FFTComplex s1 = cmul(out[k+2*m], tw[2*k*fstride]);
+    FFTComplex s2 = cmul(out[k+3*m], tw[3*k*fstride]);
+    FFTComplex s5 = { out[k].re - s1.re, out[k].im - s1.im };
+    FFTComplex s3 = { s0.re + s2.re, s0.im + s2.im };
+    FFTComplex s4 = { s0.re - s2.re, s0.im - s2.im };
+    out[k].re += s1.re;
+    out[k].im += s1.im;
+    out[k+2*m].re = out[k].re - s3.re;
+    out[k+2*m].im = out[k].im - s3.im;
+    out[k].re += s3.re;
+    out[k].im += s3.im;
+    if (inverse) {   // s4 rodado de +i em vez de -i
+      out[k+m].re = s5.re - s4.im;
+      out[k+m].im = s5.im + s4.re;
+      out[k+3*m].re = s5.re + s4.im;
+      out[k+3*m].im = s5.im - s4.re;
+    } else {
+      out[k+m].re = s5.re + s4.im;
+      out[k+m].im = s5.im - s4.re;
+      out[k+3*m].re = s5.re - s4.im;
+      out[k+3*m].im = s5.im + s4.re;
+    }
+  }
+}
+
+// Generic butterfly, used for radix 3 and 5.
+static void butterflyGeneric(FFTComplex* out, int fstride, const FFTComplex* tw, int n, int m, int r) {
+  FFTComplex scratch[5];
+  for (int u = 0; u < m; u++) {
+    for (int q = 0; q < r; q++) scratch[q] = out[u + q*m];
+    for (int q1 = 0; q1 < r; q1++) {
+      int k = u + q1*m;
+      long t = 0;
+      FFTComplex acc = scratch[0];
+      for (int q = 1; q < r; q++) {
+        t += (long)fstride * k;
+        if (t >= n) t %= n;
+        FFTComplex v = cmul(scratch[q], tw[t]);
+        acc.re += v.re;
+        acc.im += v.im;
+      }
+      out[k] = acc;
+    }
+  }
+}
+
+// Recursive decimation in time: out[0..r*m) receives the transform of
+// in[0], in[fstride], in[2*fstride], ...
+static void work(const FFTPlan p, const FFTComplex* tw, int inverse,
+                 FFTComplex* out, const FFTComplex* in, int fstride, const int* factors) {
+  int r = factors[0];
+  int m = factors[1];
+  if (m == 1) {
+    for (int k = 0; k < r; k++) out[k] = in[k*fstride];
+  } else {
+    for (int k = 0; k < r; k++) {
+      work(p, tw, inverse, out + k*m, in + k*fstride, fstride*r, factors + 2);
+    }
+  }
+  switch (r) {
+    case 1: break;
+    case 2: butterfly2(out, fstride, tw, m); break;
+    case 4: butterfly4(out, fstride, tw, inverse, m); break;
+    default: butterflyGeneric(out, fstride, tw, p->n, m, r); break;
+  }
+}
+
+/// Forward transform (out-of-place, unnormalized).
+void FFTForward(FFTPlan p, const FFTComplex* in, FFTComplex* out) { ///
+  assert (p != NULL && in != NULL && out != NULL && in != out);
+  work(p, p->twiddle, 0, out, in, 1, p->factors);
+}
+
+/// Inverse transform (out-of-place, unnormalized).
+void FFTInverse(FFTPlan p, const FFTComplex* in, FFTComplex* out) { ///
+  assert (p != NULL && in != NULL && out != NULL && in != out);
+  work(p, p->twiddle + p->n, 1, out, in, 1, p->factors);
+}
+
+
+/// 2D real transforms
+
+// Columns are transformed in blocks of this many columns, gathered into a
+// contiguous buffer, so that the strided column accesses stay in cache.
+#define COLBLOCK 8
+
+struct fft2d {
+  int rows;
+  int cols;
+  int hcols;        // cols/2 + 1 (the rest of each row spectrum is redundant)
+  FFTPlan rowplan;
+  FFTPlan colplan;
+};
+
+/// Create a 2D real transform of rows x cols values.
+FFT2D FFT2DCreate(int rows, int cols) { ///
+  assert (rows >= 1 && cols >= 1);
+  FFT2D p = (FFT2D)malloc(sizeof(*p));
+  if (p == NULL) return NULL;
+  p->rows = rows;
+  p->cols = cols;
+  p->hcols = cols/2 + 1;
+  p->rowplan = FFTPlanCreate(cols);
+  p->colplan = FFTPlanCreate(rows);
+  if (p->rowplan == NULL || p->colplan == NULL) {
+    FFT2DDestroy(&p);
+  }
+  return p;
+}
+
+/// Destroy the transform pointed to by (*pp) and set (*pp)=NULL.
+void FFT2DDestroy(FFT2D* pp) { ///
+  assert (pp != NULL);
+  if (*pp == NULL) return;
+  FFTPlanDestroy(&(*pp)->rowplan);
+  FFTPlanDestroy(&(*pp)->colplan);
+  free(*pp);
+  *pp = NULL;
+}
+
+/// Number of complex values in the half spectrum: rows x (cols/2+1).
+long FFT2DSpectrumSize(FFT2D p) { ///
+  assert (p != NULL);
+  return (long)p->rows * p->hcols;
+}
+
+// Shared arguments of the parallel stages
+typedef struct {
+  FFT2D p;
+  const uint8_t* src;
+  int w, h, stride;
+  FFTComplex* spec;
+  double* out;
+  int inverse;
+  volatile int failed;   // set by any chunk that runs out of memory
+} Stage;
+
+// Forward row stage, for row pairs [begin, end).
+// Two real rows a, b are transformed at once as z = a + i*b, and their
+// half spectra separated using the symmetry of real transforms:
+//   A[k] = (Z[k] + conj(Z[n-k])) / 2,  B[k] = (Z[k] - conj(Z[n-k])) / 2i
+static void rowsForward(void* arg, int begin, int end) {
+  Stage* st = (Stage*)arg;
+  FFT2D p = st->p;
+  int n = p->cols;
+  FFTComplex* z = (FFTComplex*)malloc(2 * n * sizeof(FFTComplex));
+  if (z == NULL) { st->failed = 1; return; }
+  FFTComplex* Z = z + n;
+  for (int pair = begin; pair < end; pair++) {
+    int r0 = 2*pair;
+    int r1 = r0 + 1;
+    FFTComplex* A = st->spec + (long)r0 * p->hcols;
+    FFTComplex* B = A + p->hcols;
+    if (r0 >= st->h) {   // linhas de padding: espetro nulo
+      memset(A, 0, p->hcols * sizeof(FFTComplex));
+      if (r1 < p->rows) memset(B, 0, p->hcols * sizeof(FFTComplex));
+      continue;
+    }
+    const uint8_t* a = st->src + (long)r0 * st->stride;
+    const uint8_t* b = (r1 < st->h) ? a + st->stride : NULL;
+    for (int j = 0; j < n; j++) {
+      z[j].re = (j < st->w) ? a[j] : 0.0;
+      z[j].im = (j < st->w && b != NULL) ? b[j] : 0.0;
+    }
+    FFTForward(p->rowplan, z, Z);
+    for (int k = 0; k < p->hcols; k++) {
+      FFTComplex zk = Z[k];
+      FFTComplex zn = Z[(n - k) % n];
+      A[k].re = 0.5 * (zk.re + zn.re);
+      A[k].im = 0.5 * (zk.im - zn.im);
+      if (r1 < p->rows) {
+        B[k].re = 0.5 * (zk.im + zn.im);
+        B[k].im = -0.5 * (zk.re - zn.re);
+      }
+    }
+  }
+  free(z);
+}
+
+// Inverse row stage, for row pairs [begin, end): rebuilds the full
+// spectrum Z = A + i*B of each pair and gets both rows from one transform.
+static void rowsInverse(void* arg, int begin, int end) {
+  Stage* st = (Stage*)arg;
+  FFT2D p = st->p;
+  int n = p->cols;
+  double scale = 1.0 / ((double)p->rows * p->cols);
+  FFTComplex* Z = (FFTComplex*)malloc(2 * n * sizeof(FFTComplex));
+  if (Z == NULL) { st->failed = 1; return; }
+  FFTComplex* z = Z + n;
+  for (int pair = begin; pair < end; pair++) {
+    int r0 = 2*pair;
+    int r1 = r0 + 1;
+    const FFTComplex* A = st->spec + (long)r0 * p->hcols;
+    const FFTComplex* B = (r1 < p->rows) ? A + p->hcols : NULL;
+    for (int k = 0; k < n; k++) {
+      int conj = k >= p->hcols;   // metade redundante: A[k] = conj(A[n-k])
+      int kk = conj ? n - k : k;
+      double ar = A[kk].re;
+      double ai = conj ? -A[kk].im : A[kk].im;
+      double br = (B != NULL) ? B[kk].re : 0.0;
+      double bi = (B != NULL) ? (conj ? -B[kk].im : B[kk].im) : 0.0;
+      Z[k].re = ar - bi;
+      Z[k].im = ai + br;
+    }
+    FFTInverse(p->rowplan, Z, z);
+    double* o0 = st->out + (long)r0 * n;
+    for (int j = 0; j < n; j++) o0[j] = z[j].re * scale;
+    if (r1 < p->rows) {
+      double* o1 = o0 + n;
+      for (int j = 0; j < n; j++) o1[j] = z[j].im * scale;
+    }
+  }
+  free(Z);
+}
+
+// Column stage, for column blocks [begin, end).
+static void columns(void* arg, int begin, int end) {
+  Stage* st = (Stage*)arg;
+  FFT2D p = st->p;
+  int rows = p->rows;
+  FFTComplex* buf = (FFTComplex*)malloc((COLBLOCK + 1) * (long)rows * sizeof(FFTComplex));
+  if (buf == NULL) { st->failed = 1; return; }
+  FFTComplex* tmp = buf + (long)COLBLOCK * rows;
+  for (int blk = begin; blk < end; blk++) {
+    int c0 = blk * COLBLOCK;
+    int nc = (c0 + COLBLOCK <= p->hcols) ? COLBLOCK : p->hcols - c0;
+    // gather: buf[c*rows + r] = spec[r][c0+c]
+    for (int r = 0; r < rows; r++) {
+      const FFTComplex* row = st->spec + (long)r * p->hcols + c0;
+      for (int c = 0; c < nc; c++) buf[(long)c*rows + r] = row[c];
+    }
+    for (int c = 0; c < nc; c++) {
+      FFTComplex* col = buf + (long)c*rows;
+      if (st->inverse) {
+        FFTInverse(p->colplan, col, tmp);
+      } else {
+        FFTForward(p->colplan, col, tmp);
+      }
+      memcpy(col, tmp, rows * sizeof(FFTComplex));
+    }
+    // scatter
+    for (int r = 0; r < rows; r++) {
+      FFTComplex* row = st->spec + (long)r * p->hcols + c0;
+      for (int c = 0; c < nc; c++) row[c] = buf[(long)c*rows + r];
+    }
+  }
+  free(buf);
+}
+
+/// Forward transform of the w x h array of bytes src, zero-padded.
+int FFT2DForward(FFT2D p, const uint8_t* src, int w, int h, int stride, FFTComplex* spec) { ///
+  assert (p != NULL && src != NULL && spec != NULL);
+  assert (0 <= w && w <= p->cols && 0 <= h && h <= p->rows);
+  Stage st = { p, src, w, h, stride, spec, NULL, 0, 0 };
+  ParallelFor((p->rows + 1) / 2, 8, rowsForward, &st);
+  if (st.failed) return 0;
+  ParallelFor((p->hcols + COLBLOCK - 1) / COLBLOCK, 1, columns, &st);
+  return !st.failed;
+}
+
+/// Inverse transform of the half spectrum spec into the real array out.
+int FFT2DInverse(FFT2D p, FFTComplex* spec, double* out) { ///
+  assert (p != NULL && spec != NULL && out != NULL);
+  Stage st = { p, NULL, 0, 0, 0, spec, out, 1, 0 };
+  ParallelFor((p->hcols + COLBLOCK - 1) / COLBLOCK, 1, columns, &st);
+  if (st.failed) return 0;
+  ParallelFor((p->rows + 1) / 2, 8, rowsInverse, &st);
+  return !st.failed;
+}
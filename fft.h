@@ -0,0 +1,81 @@
+/// A dependency-free Fast Fourier Transform module.
+///
+/// 1D complex transforms of any length whose only prime factors are
+/// 2, 3 and 5 (mixed-radix, decimation in time), and 2D real-to-complex
+/// transforms built on them, multithreaded by rows and then by columns.
+///
+/// Use as follows:
+///
+/// int rows = FFTSize(h), cols = FFTSize(w);  // padded sizes
+/// FFT2D p = FFT2DCreate(rows, cols);
+/// FFTComplex* spec = malloc(FFT2DSpectrumSize(p) * sizeof(FFTComplex));
+/// FFT2DForward(p, pixels, w, h, w, spec);   // zero-padded to rows x cols
+/// ...                                       // operate on the spectrum
+/// FFT2DInverse(p, spec, out);               // out has rows*cols doubles
+/// FFT2DDestroy(&p);
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <inttypes.h>
+
+/// A complex number
+typedef struct {
+  double re;
+  double im;
+} FFTComplex;
+
+/// Smallest length >= n whose only prime factors are 2, 3 and 5.
+int FFTSize(int n) ;
+
+/// 1D transforms
+
+/// Type FFTPlan is a pointer to a precomputed 1D transform of fixed length.
+typedef struct fftplan *FFTPlan;
+
+/// Create a plan for complex transforms of length n.
+/// Requires: n >= 1 and the only prime factors of n are 2, 3 and 5.
+/// On failure (out of memory), returns NULL.
+FFTPlan FFTPlanCreate(int n) ;
+
+/// Destroy the plan pointed to by (*pp) and set (*pp)=NULL.
+void FFTPlanDestroy(FFTPlan* pp) ;
+
+/// Transform n = length of plan values from in to out (out-of-place).
+/// The forward transform uses exp(-2*pi*i*k*j/n) and is unnormalized;
+/// the inverse uses exp(+2*pi*i*k*j/n) and is also unnormalized, so
+/// FFTInverse(FFTForward(x)) = n*x.
+/// Requires: in and out do not overlap.
+void FFTForward(FFTPlan p, const FFTComplex* in, FFTComplex* out) ;
+void FFTInverse(FFTPlan p, const FFTComplex* in, FFTComplex* out) ;
+
+/// 2D real transforms
+
+/// Type FFT2D is a pointer to a precomputed rows x cols real 2D transform.
+typedef struct fft2d *FFT2D;
+
+/// Create a 2D real transform of rows x cols values.
+/// Requires: rows and cols are valid FFTPlan lengths.
+/// On failure (out of memory), returns NULL.
+FFT2D FFT2DCreate(int rows, int cols) ;
+
+/// Destroy the transform pointed to by (*pp) and set (*pp)=NULL.
+void FFT2DDestroy(FFT2D* pp) ;
+
+/// Number of complex values in the half spectrum: rows x (cols/2+1).
+/// The spectrum is stored row-major, (cols/2+1) values per row.
+long FFT2DSpectrumSize(FFT2D p) ;
+
+/// Forward transform of the w x h array of bytes src (row stride 'stride'),
+/// zero-padded to rows x cols, into the half spectrum spec.
+/// Requires: w <= cols, h <= rows.
+/// On failure (out of memory), returns 0.
+int FFT2DForward(FFT2D p, const uint8_t* src, int w, int h, int stride, FFTComplex* spec) ;
+
+/// Inverse transform of the half spectrum spec (which is overwritten)
+/// into the rows x cols real array out, normalized by 1/(rows*cols).
+/// On failure (out of memory), returns 0.
+int FFT2DInverse(FFT2D p, FFTComplex* spec, double* out) ;
+
+#endif
+
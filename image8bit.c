@@ -17,14 +17,29 @@
 // Date:
 //
 
+#define _GNU_SOURCE   // memfd_create
+
 #include "image8bit.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "fft.h"
 #include "instrumentation.h"
+#include "parallel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // The data structure
 //
@@ -51,6 +66,10 @@ struct image {
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  Image* pyramid; // cached 2x2 mean levels: pyramid[k-1] is level k (or NULL)
+  int nlevels;    // number of cached pyramid levels
+  int mapped;     // pixel is a private mapping of a memory file (see ImageShare)
+  int fd;         // that memory file, while it still holds the pixels, or -1
 };
 
 
@@ -74,10 +93,12 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+// (Each thread has its own, since loads and saves may run in background
+// threads: see ImageLoadAsync.)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -149,6 +170,8 @@ void ImageInit(void) { ///
   InstrName[1] = "ncomp";
   // Name other counters here...
   InstrName[2] = "atrib";  // atribuições
+  InstrName[3] = "pghit";  // acessos a tiles já em memória (imagens paginadas)
+  InstrName[4] = "pgmiss"; // tiles lidos do ficheiro
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -156,6 +179,8 @@ void ImageInit(void) { ///
 // Add more macros here...
 #define COMP InstrCount[1]
 #define ATRIB InstrCount[2]
+#define PGHIT InstrCount[3]
+#define PGMISS InstrCount[4]
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 
@@ -185,6 +210,10 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   newImage->width = width;
   newImage->height = height;
   newImage->maxval = maxval;
+  newImage->pyramid = NULL;   // a pirâmide só é calculada quando for precisa
+  newImage->nlevels = 0;
+  newImage->mapped = 0;
+  newImage->fd = -1;
   newImage->pixel = (uint8_t*)calloc(width * height, sizeof(uint8_t));  // estamos a alucar memória para o campo do pixel do objeto newImage.
                                                                         // calloc é usada para alocar memória para uma matriz de uint8_t com tamanho de largura * altura, e inicia-os a 0;
   ATRIB += 4;   // 4 atribuições anteriores
@@ -210,58 +239,589 @@ void ImageDestroy(Image* imgp) { ///
     return;
   }
   COMP += 1;
-  free((*imgp)->pixel);   // Desalocamos o espaço na memória do pixel
+  ImagePyramidDrop(*imgp);  // a pirâmide em cache pertence à imagem
+  errsave = errno;
+  if ((*imgp)->fd >= 0) close((*imgp)->fd);
+  if ((*imgp)->mapped) {
+    munmap((*imgp)->pixel, (size_t)(*imgp)->width * (*imgp)->height);
+  } else {
+    free((*imgp)->pixel);   // Desalocamos o espaço na memória do pixel
+  }
+  errno = errsave;
   free(*imgp);  // Desalocamos o espaço na memória da imagem
   *imgp = NULL;   // "Apagamos" a imagem
   ATRIB += 1;
 }
 
 
+/// Sharing pixels
+
+// Shared images keep their pixels in a private (copy-on-write) mapping of
+// an anonymous memory file.  The kernel keeps the file while some image
+// maps it, and copies a page (a block of rows) only when one of the images
+// writes to it, so an image and its shares use the memory of one copy plus
+// the blocks they changed.
+
+// Called before the pixels of img change: drops the cached pyramid, and
+// forgets the memory file, which no longer holds the pixels.
+static void pixelsChanged(Image img) {
+  if (img->pyramid != NULL) ImagePyramidDrop(img);
+  if (img->fd >= 0) {
+    close(img->fd);
+    img->fd = -1;
+  }
+}
+
+// Map the memory file fd privately, as pixels of img.
+static int mapPixels(Image img, int fd) {
+  size_t len = (size_t)img->width * img->height;
+  void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (!check( p != MAP_FAILED, "Falha ao alocar memória" )) return 0;
+  if (img->mapped) munmap(img->pixel, len); else free(img->pixel);
+  img->pixel = (uint8*)p;
+  img->mapped = 1;
+  return 1;
+}
+
+// Move the pixels of img to a new memory file, if not there already.
+static int toMemoryFile(Image img) {
+  if (img->fd >= 0) return 1;
+  size_t len = (size_t)img->width * img->height;
+  int fd = memfd_create("image8bit", MFD_CLOEXEC);
+  if (!check( fd >= 0, "Falha ao alocar memória" )) return 0;
+  size_t done = 0;
+  ssize_t r = 0;
+  while (done < len && (r = pwrite(fd, img->pixel + done, len - done, done)) > 0) {
+    done += (size_t)r;
+  }
+  if (!(check( done == len, "Falha ao alocar memória" ) && mapPixels(img, fd))) {
+    errsave = errno;
+    close(fd);
+    errno = errsave;
+    return 0;
+  }
+  PIXMEM += len;
+  img->fd = fd;
+  return 1;
+}
+
+/// Create a new image with the same contents as img, sharing the pixel
+/// memory until either image is changed (copy-on-write, in blocks of rows).
+/// Where memory files are not available, the pixels are copied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageShare(Image img) { ///
+  assert (img != NULL);
+  size_t len = (size_t)img->width * img->height;
+  Image share;
+  if (len > 0 && toMemoryFile(img) && (share = (Image)malloc(sizeof(*share))) != NULL) {
+    *share = *img;
+    share->pyramid = NULL;
+    share->nlevels = 0;
+    share->pixel = NULL;
+    share->mapped = 0;
+    share->fd = dup(img->fd);
+    if (share->fd >= 0 && mapPixels(share, share->fd)) return share;
+    if (share->fd >= 0) close(share->fd);
+    free(share);
+  }
+  // Sem ficheiros em memória: copiar
+  share = ImageCreate(img->width, img->height, img->maxval);
+  if (share == NULL) return NULL;
+  memcpy(share->pixel, img->pixel, (size_t)img->width * img->height);
+  PIXMEM += 2ul * img->width * img->height;
+  return share;
+}
+
+
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// The PGM parser works on a memory buffer holding the whole file, instead
+// of going through stdio one field at a time.  Both raw (P5) and plain (P2)
+// PGM are accepted.  A regular file is mapped in memory (see ImageLoadMany),
+// so a raw raster is copied only once, from the mapping straight into the
+// image.  Streams and pipes are read into a buffer with large reads (see
+// readStream and readFd), and a raw raster is then copied from the buffer
+// into the image: one extra copy, the price of not knowing the size.
+
+// Parser state: the unparsed part of the buffer.
+typedef struct {
+  const uint8* p;
+  const uint8* end;
+} Parser;
+
+static inline int isPGMSpace(int c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+// Skip whitespace and comments (from # to the end of the line).
+static void parseSpace(Parser* ps) {
+  while (ps->p < ps->end) {
+    if (isPGMSpace(*ps->p)) {
+      ps->p++;
+    } else if (*ps->p == '#') {
+      const uint8* nl = memchr(ps->p, '\n', ps->end - ps->p);
+      ps->p = (nl == NULL) ? ps->end : nl + 1;
+    } else {
+      break;
+    }
   }
-  return i;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+// Parse a non-negative decimal integer (no sign) after optional whitespace.
+// Returns 0 if there are no digits or the value overflows an int.
+static int parseInt(Parser* ps, int* v) {
+  parseSpace(ps);
+  const uint8* start = ps->p;
+  long n = 0;
+  while (ps->p < ps->end && (unsigned)(*ps->p - '0') < 10u) {
+    n = 10*n + (*ps->p - '0');
+    if (n > 0x7fffffffL) return 0;
+    ps->p++;
+  }
+  *v = (int)n;
+  return ps->p > start;
+}
+
+// Parse the w*h pixels of a plain (P2) raster into pix.
+// Values are separated by whitespace and must not exceed maxval.
+// With SSE2, 16 bytes are classified at a time (digit / whitespace / other)
+// and the tokens fully contained in them are converted directly from
+// the digit masks; tokens crossing a block boundary, or longer than 3
+// digits (leading zeros), go to the scalar path.
+static int parsePlainRaster(Parser* ps, uint8* pix, long npix, int maxval) {
+  long k = 0;
+  const uint8* p = ps->p;
+  const uint8* end = ps->end;
+  while (k < npix) {
+#ifdef __SSE2__
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i lim = _mm_set1_epi8((char)(0x80 + 10));
+    while (k < npix && p + 16 <= end) {
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      // dígito: (c - '0') < 10 sem sinal, comparado com sinal após somar 0x80
+      __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+      unsigned dig = (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(_mm_add_epi8(d, bias), lim));
+      __m128i ws = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+      unsigned spc = (unsigned)_mm_movemask_epi8(ws);
+      if ((dig | spc) != 0xFFFFu) break;   // outros carateres: caminho escalar
+      int used = 16;
+      while (dig != 0 && k < npix) {
+        int s = __builtin_ctz(dig);
+        int len = __builtin_ctz(~(dig >> s));   // comprimento da sequência de dígitos
+        // pode continuar no bloco seguinte, ou ter zeros à esquerda (0255):
+        // fica para o caminho escalar
+        if (s + len == 16 || len > 3) { used = s; break; }
+        const uint8* t = p + s;
+        int val = (len == 1) ? t[0]-'0' :
+                  (len == 2) ? (t[0]-'0')*10 + (t[1]-'0') :
+                               (t[0]-'0')*100 + (t[1]-'0')*10 + (t[2]-'0');
+        if (val > maxval) return check(0, "Invalid pixel value");
+        pix[k++] = (uint8)val;
+        dig &= ~(((1u << len) - 1) << s);
+        used = s + len;
+      }
+      if (dig == 0 && k < npix) used = 16;
+      if (used == 0) break;   // número a converter pelo caminho escalar
+      p += used;
+    }
+#endif
+    if (k >= npix) break;
+    // caminho escalar: um valor de cada vez
+    Parser sub = { p, end };
+    int val;
+    parseSpace(&sub);
+    if (!check(parseInt(&sub, &val), "Reading pixels")) return 0;
+    if (!check(val <= maxval, "Invalid pixel value")) return 0;
+    if (!check(sub.p == end || isPGMSpace(*sub.p), "Reading pixels")) return 0;
+    pix[k++] = (uint8)val;
+    p = sub.p;
+  }
+  ps->p = p;
+  return 1;
+}
+
+// Fields of a PGM header
+typedef struct {
+  int width;
+  int height;
+  int maxval;
+  int plain;   // 1 for P2 (ASCII raster), 0 for P5 (raw raster)
+} PGMHeader;
+
+// Parse a PGM header, up to and including the single whitespace character
+// that precedes the raster.
+// On failure, returns 0 and errCause is set.
+static int parseHeader(Parser* ps, PGMHeader* hd) {
+  hd->width = hd->height = 0;
+  return
+  check( ps->end - ps->p >= 2 && ps->p[0] == 'P' && (ps->p[1] == '5' || ps->p[1] == '2'),
+         "Invalid file format" ) &&
+  (hd->plain = (ps->p[1] == '2'), ps->p += 2, 1) &&
+  check( ps->p < ps->end && (isPGMSpace(*ps->p) || *ps->p == '#'), "Invalid file format" ) &&
+  check( parseInt(ps, &hd->width) && hd->width >= 0 , "Invalid width" ) &&
+  check( parseInt(ps, &hd->height) && hd->height >= 0 , "Invalid height" ) &&
+  check( parseInt(ps, &hd->maxval) && 0 < hd->maxval && hd->maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( ps->p < ps->end && isPGMSpace(*ps->p) , "Whitespace expected" ) &&
+  (ps->p++, 1);
+}
+
+// Parse one PGM image (header and raster) from the parser buffer.
+// On success, returns the new image and advances the parser past it.
+// On failure, returns NULL and errCause is set.
+static Image parsePGM(Parser* ps) {
+  PGMHeader hd;
+  Image img = NULL;
+
+  int success =
+  parseHeader(ps, &hd) &&
+  // Allocate image
+  (img = ImageCreate(hd.width, hd.height, (uint8)hd.maxval)) != NULL;
+  long npix = (long)hd.width*hd.height;
+  if (success && hd.plain) {
+    success = parsePlainRaster(ps, img->pixel, npix, hd.maxval);
+  } else if (success) {
+    success = check( ps->end - ps->p >= npix , "Reading pixels" );
+    if (success) {
+      memcpy(img->pixel, ps->p, (size_t)npix);
+      ps->p += npix;
+    }
+  }
+  PIXMEM += (unsigned long)npix;  // count pixel memory accesses
+
+  if (!success) {
+    ImageDestroy(&img);
+  }
+  return img;
+}
+
+// Read the rest of stream f into a new buffer (terminated by an extra 0
+// byte).  Regular files are read with a single fread of their size; other
+// streams (pipes) grow the buffer geometrically.
+// Returns NULL on failure, with errno/errCause set.
+static uint8* readStream(FILE* f, size_t* size) {
+  size_t cap = 1 << 16;
+  int sized = 0;   // tamanho conhecido: basta um fread
+  long pos, fsize;
+  if ((pos = ftell(f)) >= 0 && fseek(f, 0, SEEK_END) == 0 &&
+      (fsize = ftell(f)) >= pos && fseek(f, pos, SEEK_SET) == 0) {
+    cap = (size_t)(fsize - pos) + 1;
+    sized = 1;
+  }
+  errno = 0;
+  uint8* buf = (uint8*)malloc(cap);
+  if (!check(buf != NULL, "Falha ao alocar memória")) return NULL;
+  size_t n = 0;
+  for (;;) {
+    n += fread(buf + n, 1, cap - 1 - n, f);
+    if (n < cap - 1 || sized) break;   // fim do ficheiro (ou erro)
+    uint8* bigger = (uint8*)realloc(buf, 2*cap);
+    if (!check(bigger != NULL, "Falha ao alocar memória")) {
+      free(buf);
+      return NULL;
+    }
+    buf = bigger;
+    cap *= 2;
+  }
+  if (!check(!ferror(f), "Reading failed")) {
+    free(buf);
+    return NULL;
+  }
+  buf[n] = 0;
+  *size = n;
+  return buf;
+}
+
+// Pipes get a larger buffer than the default 64KiB (if allowed), so that
+// the processes on either side switch less often.
+#define PIPE_SIZE (1 << 20)
+
+// Read the rest of file descriptor fd into a new buffer (terminated by an
+// extra 0 byte), as readStream does.
+static uint8* readFd(int fd, size_t* size) {
+  size_t cap = 1 << 20;
+  int sized = 0;   // tamanho conhecido: lê até lá, sem realocar
+  struct stat st;
+  off_t pos;
+  if (fstat(fd, &st) == 0) {
+    if (S_ISREG(st.st_mode) && (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size >= pos) {
+      cap = (size_t)(st.st_size - pos) + 1;
+      sized = 1;
+    } else if (S_ISFIFO(st.st_mode)) {
+      fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+    }
+  }
+  uint8* buf = (uint8*)malloc(cap);
+  if (!check(buf != NULL, "Falha ao alocar memória")) return NULL;
+  size_t n = 0;
+  for (;;) {
+    if (n == cap - 1 && !sized) {
+      uint8* bigger = (uint8*)realloc(buf, 2*cap);
+      if (!check(bigger != NULL, "Falha ao alocar memória")) break;
+      buf = bigger;
+      cap *= 2;
+    }
+    ssize_t r = (n < cap - 1) ? read(fd, buf + n, cap - 1 - n) : 0;
+    if (r > 0) {
+      n += (size_t)r;
+    } else if (r == 0) {   // fim do ficheiro
+      buf[n] = 0;
+      *size = n;
+      return buf;
+    } else if (!check(errno == EINTR, "Reading failed")) {
+      break;
+    }
+  }
+  errsave = errno;
+  free(buf);
+  errno = errsave;
+  return NULL;
+}
+
+// Tiled container files (see ImageSaveTiled)
+static int isTiled(int fd);
+static Image loadTiledRegion(int fd, int x, int y, int w, int h, int whole);
+
+/// Parse a PGM image (raw P5 or plain P2) from a memory buffer.
+/// Parsing starts at buf and never reads past buf+size.
+/// If consumed != NULL, *consumed is set to the number of bytes parsed
+/// (so that another image following it can be parsed next).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errCause is set accordingly.
+Image ImageLoadMem(const void* buf, size_t size, size_t* consumed) { ///
+  assert (buf != NULL || size == 0);
+  Parser ps = { (const uint8*)buf, (const uint8*)buf + size };
+  Image img = parsePGM(&ps);
+  if (img != NULL && consumed != NULL) {
+    *consumed = (size_t)(ps.p - (const uint8*)buf);
+  }
+  return img;
+}
+
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) 8 bit PGM files are accepted, as well as
+/// tiled container files (see ImageSaveTiled).
+/// If the file holds several concatenated images, only the first is loaded.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
-  FILE* f = NULL;
   Image img = NULL;
+  int n = ImageLoadMany(filename, &img, 1);
+  return (n > 0) ? img : NULL;
+}
 
-  int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+// Parse the concatenated images of buffer buf (see ImageLoadMany).
+static int parseMany(const uint8* buf, size_t size, Image imgs[], int max) {
+  Parser ps = { buf, buf + size };
+  int n = 0;
+  int success;
+  do {
+    success = check( n < max , "Too many images in file" ) &&
+              (imgs[n] = parsePGM(&ps)) != NULL;
+    if (success) n++;
+    parseSpace(&ps);   // espaços entre imagens concatenadas
+    // só continua se o que resta começa outra imagem; o resto é ignorado
+  } while (success && max > 1 && ps.end - ps.p >= 2 && ps.p[0] == 'P' &&
+           (ps.p[1] == '5' || ps.p[1] == '2'));
+
+  if (!success) {
+    errsave = errno;
+    while (n > 0) ImageDestroy(&imgs[--n]);
+    errno = errsave;
+  }
+  return n;
+}
+
+/// Load all the PGM images concatenated in a file.
+/// Up to max images are stored in imgs[0], imgs[1], ...
+/// Bytes after the last image that do not start another PGM image (P5 or
+/// P2 magic number) are ignored, as ImageLoad ignores all after the first.
+/// A tiled container file (see ImageSaveTiled) loads as a single image.
+/// A regular file is mapped in memory and parsed in place, so its raw
+/// rasters are copied once, straight into the images.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadMany(const char* filename, Image imgs[], int max) { ///
+  assert (filename != NULL);
+  assert (imgs != NULL && max >= 1);
+  int fd;
+  int n = 0;
+  struct stat st;
+  void* map;
+
+  if (!check((fd = open(filename, O_RDONLY)) >= 0, "Open failed")) return 0;
+  if (isTiled(fd)) {   // contentor com tiles: uma só imagem
+    imgs[0] = loadTiledRegion(fd, 0, 0, 0, 0, 1);
+    n = (imgs[0] != NULL);
+  } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+             (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    n = parseMany((const uint8*)map, (size_t)st.st_size, imgs, max);
+    errsave = errno;
+    munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  } else {   // pipes, dispositivos, ficheiros vazios: lidos para um buffer
+    n = ImageLoadFd(fd, imgs, max);
+  }
+  errsave = errno;
+  close(fd);
+  errno = errsave;
+  return n;
+}
+
+/// Load all the PGM images in an open stream, from its current position
+/// to the end, as ImageLoadMany does (but tiled files are not accepted).
+/// The stream is not closed.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadFile(FILE* f, Image imgs[], int max) { ///
+  assert (f != NULL);
+  assert (imgs != NULL && max >= 1);
+  size_t size = 0;
+  uint8* buf = readStream(f, &size);
+  if (buf == NULL) return 0;
+  int n = parseMany(buf, size, imgs, max);
+  free(buf);
+  return n;
+}
+
+/// Load all the PGM images readable from file descriptor fd, from its
+/// current position to the end (for a pipe, until the writer closes it),
+/// as ImageLoadFile does.
+/// The data is read with large read() calls, straight into one buffer.
+/// The descriptor is not closed.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadFd(int fd, Image imgs[], int max) { ///
+  assert (fd >= 0);
+  assert (imgs != NULL && max >= 1);
+  size_t size = 0;
+  uint8* buf = readFd(fd, &size);
+  if (buf == NULL) return 0;
+  int n = parseMany(buf, size, imgs, max);
+  free(buf);
+  return n;
+}
+
+// Read len bytes at position pos of file descriptor fd into buf, with as
+// many preads as needed (pread may return less than asked for, e.g. at
+// most about 2 GiB per call on Linux).
+// Returns 1 if all the bytes were read, 0 on error or end of file.
+static int preadAll(int fd, void* buf, size_t len, off_t pos) {
+  uint8* p = (uint8*)buf;
+  while (len > 0) {
+    ssize_t r = pread(fd, p, len, pos);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    pos += r;
+    len -= (size_t)r;
+  }
+  return 1;
+}
+
+// Read and parse the header of the PGM file open in descriptor fd.
+// Reads a growing prefix of the file until the header fits in it.
+// On success, returns 1 and sets *hd and *offset (the position of the raster).
+// On failure, returns 0 and errno/errCause are set.
+static int readHeader(int fd, PGMHeader* hd, off_t* offset) {
+  size_t cap = 4096;
+  for (;;) {
+    uint8* buf = (uint8*)malloc(cap);
+    if (!check(buf != NULL, "Falha ao alocar memória")) return 0;
+    ssize_t n = pread(fd, buf, cap, 0);
+    if (!check(n >= 0, "Reading failed")) {
+      free(buf);
+      return 0;
+    }
+    Parser ps = { buf, buf + n };
+    int ok = parseHeader(&ps, hd);
+    *offset = (off_t)(ps.p - buf);
+    free(buf);
+    // um cabeçalho que chega ao fim do bloco lido pode estar truncado
+    if (ok && *offset < n) return 1;
+    if ((size_t)n < cap) return ok;   // o ficheiro acabou
+    if (!check(cap < (1 << 24), "Invalid file format")) return 0;  // comentários a mais
+    cap *= 4;
+  }
+}
+
+/// Load a rectangular region of a PGM file.
+/// The region is specified by the top left corner coords (x, y) and
+/// width w and height h, and must be inside the image stored in the file.
+/// For raw (P5) files, only the header and the rows of the region are read,
+/// with one pread per row (or one for the whole region, if it spans
+/// complete rows).  Plain (P2) files are loaded whole and then cropped.
+/// Tiled container files (see ImageSaveTiled) are also accepted: only the
+/// tiles that intersect the region are read and decoded.
+/// On success, a new w x h image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) { ///
+  assert (filename != NULL);
+  assert (w >= 0 && h >= 0);
+  int fd = -1;
+  PGMHeader hd;
+  off_t offset = 0;
+  Image img = NULL;
+
+  if (!check((fd = open(filename, O_RDONLY)) >= 0, "Open failed")) return NULL;
+  if (isTiled(fd)) {
+    img = loadTiledRegion(fd, x, y, w, h, 0);
+    errsave = errno;
+    close(fd);
+    errno = errsave;
+    return img;
+  }
+  int success =
+  readHeader(fd, &hd, &offset) &&
+  check( 0 <= x && 0 <= y && (long)x + w <= hd.width && (long)y + h <= hd.height, "Invalid region" );
+  if (success && hd.plain) {
+    // sem tamanho fixo por pixel não é possível saltar para a região
+    close(fd);
+    Image full = ImageLoad(filename);
+    if (full == NULL) return NULL;
+    img = ImageCrop(full, x, y, w, h);
+    ImageDestroy(&full);
+    return img;
+  }
+  success = success && (img = ImageCreate(w, h, (uint8)hd.maxval)) != NULL;
+  if (success && w > 0 && h > 0) {
+    off_t first = offset + (off_t)y*hd.width + x;
+    off_t span = (off_t)(h-1)*hd.width + w;   // bytes entre o 1º e o último pixel da região
+#if defined(POSIX_FADV_SEQUENTIAL)
+    // Se a região ocupa grande parte do ficheiro, a leitura antecipada do
+    // kernel ajuda; caso contrário, evitamos que leia o que não é preciso.
+    off_t fsize = offset + (off_t)hd.width*hd.height;
+    if (4*span >= fsize) {
+      posix_fadvise(fd, first, span, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(fd, first, span, POSIX_FADV_WILLNEED);
+    } else {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+#endif
+    if (w == hd.width) {
+      // linhas completas: a região é contígua no ficheiro
+      success = check( preadAll(fd, img->pixel, (size_t)w*h, first), "Reading pixels" );
+    } else {
+      for (int j = 0; j < h && success; j++) {
+        success = check( preadAll(fd, img->pixel + (size_t)j*w, w, first + (off_t)j*hd.width),
+                         "Reading pixels" );
+      }
+    }
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -269,7 +829,115 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
+  if (fd >= 0) close(fd);
+  return img;
+}
+
+// Area averaging of a batch of rows, one output row per factor source
+// rows (the last may have fewer), split among threads.
+typedef struct {
+  const uint8* rows;  // source rows
+  int sw;             // width
+  int nrows;          // number of source rows
+  int factor;
+  uint8* out;         // output rows
+  volatile int failed;   // set by any chunk that runs out of memory
+} ScaleJob;
+
+static void decimateRow(const uint8* row, int sw, int rows, int fx, uint16_t* col, uint8* out);
+
+static void scaleRows(void* arg, int begin, int end) {
+  ScaleJob* job = (ScaleJob*)arg;
+  const int f = job->factor;
+  const int dw = (job->sw + f - 1) / f;
+  uint16_t* col = (uint16_t*)malloc(job->sw * sizeof(uint16_t));
+  if (col == NULL) { job->failed = 1; return; }
+  for (int y = begin; y < end; y++) {
+    int rows = (job->nrows - y*f < f) ? job->nrows - y*f : f;
+    decimateRow(job->rows + (size_t)y*f*job->sw, job->sw, rows, f, col,
+                job->out + (size_t)y*dw);
+  }
+  free(col);
+}
+
+// Reduce a whole image by factor (see ImageLoadScaled).
+static Image scaleImage(Image img, int factor) {
+  int f = factor;
+  Image dst = ImageCreate((img->width + f - 1) / f, (img->height + f - 1) / f, img->maxval);
+  if (dst == NULL || dst->width == 0 || dst->height == 0) return dst;
+  ScaleJob job = { img->pixel, img->width, img->height, f, dst->pixel, 0 };
+  ParallelFor(dst->height, 1 + (1 << 16) / (f*img->width + 1), scaleRows, &job);
+  if (!check( !job.failed, "Falha ao alocar memória" )) ImageDestroy(&dst);
+  return dst;
+}
+
+// Source bytes read per batch by ImageLoadScaled
+#define SCALE_BATCH (4 << 20)
+
+/// Load a PGM file reduced by an integer factor, for previews.
+/// Each output pixel is the mean of a block of factor x factor pixels
+/// (smaller at the right and bottom edges), so the result has
+/// ceil(width/factor) x ceil(height/factor) pixels.
+/// Raw (P5) files are read in batches of rows, averaged as they come,
+/// so only the result and one batch are ever in memory.
+/// Plain (P2) and tiled files are loaded whole and then reduced.
+/// Requires: 1 <= factor <= 255.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadScaled(const char* filename, int factor) { ///
+  assert (filename != NULL);
+  assert (1 <= factor && factor <= 255);
+  int fd = -1;
+  PGMHeader hd;
+  off_t offset = 0;
+  Image img = NULL;
+  uint8* batch = NULL;
+
+  if (!check((fd = open(filename, O_RDONLY)) >= 0, "Open failed")) return NULL;
+  int whole = isTiled(fd);
+  int success = whole || readHeader(fd, &hd, &offset);
+  if (success && (whole || hd.plain)) {
+    // sem leitura por linhas: carregar tudo e reduzir
+    Image full = whole ? loadTiledRegion(fd, 0, 0, 0, 0, 1) : NULL;
+    close(fd);
+    if (!whole) full = ImageLoad(filename);
+    if (full == NULL) return NULL;
+    img = scaleImage(full, factor);
+    ImageDestroy(&full);
+    return img;
+  }
+  const int f = factor;
+  const int w = hd.width;
+  // Lote: várias linhas de saída (factor linhas de origem cada)
+  int out = (int)(SCALE_BATCH / ((size_t)f*w + 1));
+  if (out < 1) out = 1;
+  success = success &&
+  (img = ImageCreate((w + f - 1) / f, (hd.height + f - 1) / f, (uint8)hd.maxval)) != NULL &&
+  check( (batch = (uint8*)malloc((size_t)out*f*w + 1)) != NULL, "Falha ao alocar memória" );
+#if defined(POSIX_FADV_SEQUENTIAL)
+  if (success) posix_fadvise(fd, offset, (off_t)w*hd.height, POSIX_FADV_SEQUENTIAL);
+#endif
+  for (int y = 0; success && w > 0 && y < hd.height; y += out*f) {
+    int rows = (hd.height - y < out*f) ? hd.height - y : out*f;
+    size_t len = (size_t)rows*w;
+    success = check( preadAll(fd, batch, len, offset + (off_t)y*w), "Reading pixels" );
+    if (success) {
+      ScaleJob job = { batch, w, rows, f, img->pixel + (size_t)(y/f)*img->width, 0 };
+      ParallelFor((rows + f - 1) / f, 1 + (1 << 16) / ((size_t)f*w + 1), scaleRows, &job);
+      success = check( !job.failed, "Falha ao alocar memória" );
+    }
+    PIXMEM += (unsigned long)len;  // count pixel memory accesses
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  free(batch);
+  close(fd);
   return img;
 }
 
@@ -279,95 +947,683 @@ Image ImageLoad(const char* filename) { ///
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  ImageSaveFile(img, f);
 
   // Cleanup
   if (f != NULL) fclose(f);
   return success;
 }
 
+/// Save image in PGM format to an open stream, at its current position.
+/// The stream is not closed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFile(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
 
-/// Information queries
-
-/// These functions do not modify the image and never fail.
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
+  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  return success;
+}
 
-/// Get image width
-int ImageWidth(Image img) { ///
+/// Save image in PGM format to file descriptor fd, at its current position.
+/// Header and pixels go out in a single writev() call (more, only if the
+/// descriptor takes less at a time, as pipes do).
+/// The descriptor is not closed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFd(Image img, int fd) { ///
   assert (img != NULL);
-  return img->width;
+  assert (fd >= 0);
+  char header[64];
+  int hlen = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n",
+                      img->width, img->height, img->maxval);
+  struct iovec iov[2] = {
+    { header, (size_t)hlen },
+    { img->pixel, (size_t)img->width * img->height },
+  };
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+
+  struct iovec* v = iov;
+  int nv = 2;
+  while (nv > 0) {
+    ssize_t r = writev(fd, v, nv);
+    if (r < 0) {
+      if (!check(errno == EINTR, "Writing pixels failed")) return 0;
+      continue;
+    }
+    // Avançar sobre o que já foi escrito
+    while (nv > 0 && (size_t)r >= v->iov_len) {
+      r -= (ssize_t)v->iov_len;
+      v++;
+      nv--;
+    }
+    if (nv > 0) {
+      v->iov_base = (char*)v->iov_base + r;
+      v->iov_len -= (size_t)r;
+    }
+  }
+  PIXMEM += (unsigned long)img->width * img->height;
+  return 1;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+
+/// Tiled container files
+
+// Layout of a tiled file (all integers little-endian):
+//   "I8TILED\n"                     magic (8 bytes)
+//   width, height, maxval, tile     4 x uint32
+//   offset[0..ntiles]               (ntiles+1) x uint64, tile t is stored in
+//                                   bytes [offset[t], offset[t+1]) of the file
+//   tile data
+// Tiles are tile x tile pixels (smaller on the right/bottom margins), in
+// raster order.  Each tile starts with a mode byte: TILE_RAW (pixels follow
+// as is) or TILE_DRLE (delta + run-length coded, see tileEncode).
+
+static const char TILED_MAGIC[8] = "I8TILED\n";
+#define TILED_HEADER 24
+#define TILED_MAXTILE 32768   // tile*tile cabe num int
+#define TILE_RAW 0
+#define TILE_DRLE 1
+
+static void put32(uint8* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (uint8)(v >> (8*i));
+}
+static void put64(uint8* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (uint8)(v >> (8*i));
+}
+static uint32_t get32(const uint8* p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t get64(const uint8* p) {
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+// Worst case size of an encoded tile of n pixels.
+static size_t tileBound(size_t n) {
+  return 1 + n + n/128 + 1;
 }
 
-/// Pixel statsS
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) { ///
-  assert (img != NULL);
-  // Insert your code here!  
-  for (int y = 0; y < (img->height); y++) {    // percorremos todos os pixeis da imagem
-    for (int x = 0; x < (img->width); x++) {
-      int currentpixel = ImageGetPixel(img, x, y);
-      if (currentpixel < *min) {    // verificamos se o currentpixel é menor que o antigo min
-        *min = currentpixel;
-      } else if (currentpixel > *max) {   // verificamos se o currentpixel é maior que antigo max
-        *max = currentpixel;
+// Encode the tw x th tile at src (row stride 'stride') into out.
+// Each pixel is replaced by its difference (mod 256) to the left neighbour
+// (the first of each row, to the pixel above), which turns uniform and
+// smooth areas into runs of equal bytes, and the differences are then
+// run-length coded: a control byte c < 128 is followed by c+1 literal
+// bytes, c >= 128 by one byte repeated c-126 times.
+// Falls back to TILE_RAW if that is not shorter.  Returns the encoded size.
+static size_t tileEncode(const uint8* src, int stride, int tw, int th, uint8* out, uint8* delta) {
+  size_t n = (size_t)tw*th;
+  for (int y = 0; y < th; y++) {
+    const uint8* row = src + (size_t)y*stride;
+    uint8* d = delta + (size_t)y*tw;
+    d[0] = (uint8)(row[0] - (y > 0 ? row[-stride] : 0));
+    for (int x = 1; x < tw; x++) d[x] = (uint8)(row[x] - row[x-1]);
+  }
+  uint8* o = out + 1;
+  size_t i = 0;
+  size_t lit = 0;   // literais pendentes, a terminar em delta[i-1]
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < 129 && delta[i+run] == delta[i]) run++;
+    if (run >= 3 || lit == 128) {
+      if (lit > 0) {   // despejar literais pendentes
+        *o++ = (uint8)(lit - 1);
+        memcpy(o, delta + i - lit, lit);
+        o += lit;
+        lit = 0;
       }
     }
+    if (run >= 3) {
+      *o++ = (uint8)(run + 126);
+      *o++ = delta[i];
+      i += run;
+    } else {
+      lit++;
+      i++;
+    }
   }
+  if (lit > 0) {
+    *o++ = (uint8)(lit - 1);
+    memcpy(o, delta + i - lit, lit);
+    o += lit;
+  }
+  size_t size = (size_t)(o - out);
+  if (size >= 1 + n) {   // não compensa
+    out[0] = TILE_RAW;
+    for (int y = 0; y < th; y++) memcpy(out + 1 + (size_t)y*tw, src + (size_t)y*stride, tw);
+    return 1 + n;
+  }
+  out[0] = TILE_DRLE;
+  return size;
 }
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
-  assert (img != NULL);
-  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+// Decode an encoded tile of size bytes into the tw x th buffer dst.
+// Returns 0 if the data is corrupt.
+static int tileDecode(const uint8* in, size_t size, int tw, int th, uint8* dst) {
+  size_t n = (size_t)tw*th;
+  if (size < 1) return 0;
+  if (in[0] == TILE_RAW) {
+    if (size != 1 + n) return 0;
+    memcpy(dst, in + 1, n);
+    return 1;
+  }
+  if (in[0] != TILE_DRLE) return 0;
+  const uint8* p = in + 1;
+  const uint8* end = in + size;
+  size_t k = 0;
+  while (p < end && k < n) {
+    unsigned c = *p++;
+    if (c < 128) {
+      size_t len = c + 1;
+      if (len > n - k || len > (size_t)(end - p)) return 0;
+      memcpy(dst + k, p, len);
+      p += len;
+      k += len;
+    } else {
+      size_t len = c - 126;
+      if (len > n - k || p >= end) return 0;
+      memset(dst + k, *p++, len);
+      k += len;
+    }
+  }
+  if (k != n || p != end) return 0;
+  // integrar as diferenças
+  for (int y = 0; y < th; y++) {
+    uint8* row = dst + (size_t)y*tw;
+    row[0] = (uint8)(row[0] + (y > 0 ? row[-tw] : 0));
+    for (int x = 1; x < tw; x++) row[x] = (uint8)(row[x] + row[x-1]);
+  }
+  return 1;
 }
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  // Insert your code here!
-  return (0 <= x && x + w <= img->width) && (0 <= y && y + h <= img->height);
+// Shared arguments of the parallel tile encoder/decoder
+typedef struct {
+  Image img;        // image being saved / loaded
+  int tile;         // tile size
+  int tx0, ty0;     // first tile (column, row) of the batch / region
+  int ntx;          // tiles per row of the batch / region
+  uint8** data;     // encoded tiles of the batch
+  size_t* size;     // their sizes (loading: tw, th, size of each tile)
+  int rx, ry;       // loading: region origin in the stored image
+  volatile int failed;
+} TileJob;
+
+static void encodeTiles(void* arg, int begin, int end) {
+  TileJob* job = (TileJob*)arg;
+  Image img = job->img;
+  int T = job->tile;
+  uint8* delta = (uint8*)malloc((size_t)T*T);
+  if (delta == NULL) { job->failed = 1; return; }
+  for (int t = begin; t < end; t++) {
+    int x0 = (job->tx0 + t) * T;
+    int y0 = job->ty0 * T;
+    int tw = (x0 + T <= img->width) ? T : img->width - x0;
+    int th = (y0 + T <= img->height) ? T : img->height - y0;
+    job->size[t] = tileEncode(img->pixel + (size_t)y0*img->width + x0, img->width,
+                              tw, th, job->data[t], delta);
+  }
+  free(delta);
 }
 
-/// Pixel get & set operations
+/// Save image to a tiled container file.
+/// The image is split in tile x tile tiles (e.g. 256), each compressed
+/// independently (tiles are encoded in parallel), and an index of tile
+/// offsets is stored in the header, so that regions can be loaded later by
+/// decoding only the tiles they touch (see ImageLoadTiled, ImageLoadRegion).
+/// Requires: 1 <= tile <= 32768.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveTiled(Image img, const char* filename, int tile) { ///
+  assert (img != NULL);
+  assert (1 <= tile && tile <= TILED_MAXTILE);
+  int ntx = (img->width + tile - 1) / tile;
+  int nty = (img->height + tile - 1) / tile;
+  long ntiles = (long)ntx*nty;
+  // uma imagem vazia não tem tiles: ainda assim, nada de malloc(0)
+  size_t nbuf = (ntx > 0) ? (size_t)ntx : 1;
+  FILE* f = NULL;
+  uint8 head[TILED_HEADER];
+  uint8* index = (uint8*)malloc(8*(ntiles + 1));
+  uint8* pool = (uint8*)malloc(nbuf * tileBound((size_t)tile*tile));
+  uint8** data = (uint8**)malloc(nbuf * sizeof(uint8*));
+  size_t* size = (size_t*)malloc(nbuf * sizeof(size_t));
+  memcpy(head, TILED_MAGIC, 8);
+  put32(head + 8, (uint32_t)img->width);
+  put32(head + 12, (uint32_t)img->height);
+  put32(head + 16, (uint32_t)img->maxval);
+  put32(head + 20, (uint32_t)tile);
 
-/// These are the primitive operations to access and modify a single pixel
-/// in the image.
-/// These are very simple, but fundamental operations, which may be used to 
-/// implement more complex operations.
+  int success =
+  check( index != NULL && pool != NULL && data != NULL && size != NULL, "Falha ao alocar memória" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fwrite(head, 1, TILED_HEADER, f) == TILED_HEADER, "Writing header failed" ) &&
+  // o índice é reescrito no fim, quando os tamanhos forem conhecidos
+  check( fwrite(index, 1, 8*(ntiles + 1), f) == (size_t)(8*(ntiles + 1)), "Writing header failed" );
+  uint64_t offset = TILED_HEADER + 8*(ntiles + 1);
+  // uma linha de tiles de cada vez, para limitar a memória usada
+  for (int ty = 0; success && ty < nty; ty++) {
+    for (int t = 0; t < ntx; t++) data[t] = pool + t * tileBound((size_t)tile*tile);
+    TileJob job = { img, tile, 0, ty, ntx, data, size, 0, 0, 0 };
+    ParallelFor(ntx, 1, encodeTiles, &job);
+    success = check( !job.failed, "Falha ao alocar memória" );
+    for (int t = 0; success && t < ntx; t++) {
+      put64(index + 8*((long)ty*ntx + t), offset);
+      offset += size[t];
+      success = check( fwrite(data[t], 1, size[t], f) == size[t], "Writing pixels failed" );
+    }
+  }
+  if (success) {
+    put64(index + 8*ntiles, offset);
+    success =
+    check( fseek(f, TILED_HEADER, SEEK_SET) == 0, "Writing header failed" ) &&
+    check( fwrite(index, 1, 8*(ntiles + 1), f) == (size_t)(8*(ntiles + 1)), "Writing header failed" );
+  }
+  PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  assert(img != NULL);
-  int index;
-  // Insert your code here!
-  index = y * img->width + x;   // calcula o índice do primeiro pixel na linha y da imagem
-  assert (0 <= index && index < img->width*img->height);   // asseguramos que o index é menor que o número total de pixeis da imagem, considerando o pixel (0,0)
-  return index;
+  // Cleanup
+  if (f != NULL && fclose(f) != 0) success = check(0, "Writing pixels failed");
+  free(size);
+  free(data);
+  free(pool);
+  free(index);
+  return success;
+}
+
+static void decodeTiles(void* arg, int begin, int end) {
+  TileJob* job = (TileJob*)arg;
+  Image img = job->img;
+  int T = job->tile;
+  uint8* buf = (uint8*)malloc((size_t)T*T);
+  if (buf == NULL) { job->failed = 1; return; }
+  for (int t = begin; t < end && !job->failed; t++) {
+    // tile na imagem guardada e sua interseção com a região
+    int x0 = (job->tx0 + t % job->ntx) * T;
+    int y0 = (job->ty0 + t / job->ntx) * T;
+    int tw = (int)job->size[3*t];
+    int th = (int)job->size[3*t+1];
+    if (!tileDecode(job->data[t], job->size[3*t+2], tw, th, buf)) {
+      job->failed = 2;
+      break;
+    }
+    int ax = (x0 > job->rx) ? x0 : job->rx;
+    int ay = (y0 > job->ry) ? y0 : job->ry;
+    int bx = (x0 + tw < job->rx + img->width) ? x0 + tw : job->rx + img->width;
+    int by = (y0 + th < job->ry + img->height) ? y0 + th : job->ry + img->height;
+    for (int y = ay; y < by; y++) {
+      memcpy(img->pixel + (size_t)(y - job->ry)*img->width + (ax - job->rx),
+             buf + (size_t)(y - y0)*tw + (ax - x0), bx - ax);
+    }
+  }
+  free(buf);
+}
+
+// Check if the file open in fd is a tiled container.
+static int isTiled(int fd) {
+  char magic[8];
+  return pread(fd, magic, 8, 0) == 8 && memcmp(magic, TILED_MAGIC, 8) == 0;
+}
+
+// Read and check the header of the tiled file open in descriptor fd:
+// the sizes must be in range, and the whole index must be in the file,
+// so that the sizes computed from them cannot overflow.
+// On failure, returns 0 and errno/errCause are set.
+static int readTiledHeader(int fd, int* W, int* H, int* maxval, int* T) {
+  uint8 head[TILED_HEADER];
+  struct stat st;
+  int success =
+  check( preadAll(fd, head, TILED_HEADER, 0), "Invalid file format" ) &&
+  check( memcmp(head, TILED_MAGIC, 8) == 0, "Invalid file format" ) &&
+  check( get32(head + 8) <= 0x7fffffffu && get32(head + 12) <= 0x7fffffffu, "Invalid width" ) &&
+  (*W = (int)get32(head + 8), *H = (int)get32(head + 12), 1) &&
+  (*maxval = (int)get32(head + 16), *T = (int)get32(head + 20), 1) &&
+  check( 0 < *maxval && *maxval <= (int)PixMax, "Invalid maxval" ) &&
+  check( 1 <= *T && *T <= TILED_MAXTILE, "Invalid file format" ) &&
+  check( fstat(fd, &st) == 0, "Reading failed" );
+  if (success) {
+    uint64_t ntiles = (uint64_t)((*W + *T - 1) / *T) * ((*H + *T - 1) / *T);
+    success = check( (uint64_t)st.st_size >= TILED_HEADER + 8 &&
+                     ntiles <= ((uint64_t)st.st_size - TILED_HEADER) / 8 - 1, "Invalid file format" );
+  }
+  return success;
+}
+
+// Load region (x,y,w,h) of the tiled file open in descriptor fd.
+// Only the index entries and the tiles that intersect the region are read,
+// and the tiles are decoded in parallel.
+static Image loadTiledRegion(int fd, int x, int y, int w, int h, int whole) {
+  Image img = NULL;
+  uint8* index = NULL;
+  uint8** data = NULL;
+  size_t* dims = NULL;
+  int W = 0, H = 0, maxval = 0, T = 0;
+  long ntiles = 0;
+
+  int success = readTiledHeader(fd, &W, &H, &maxval, &T);
+  if (success && whole) {
+    x = y = 0;
+    w = W;
+    h = H;
+  }
+  success = success &&
+  check( 0 <= x && 0 <= y && w >= 0 && h >= 0 && (long)x + w <= W && (long)y + h <= H, "Invalid region" ) &&
+  (img = ImageCreate(w, h, (uint8)maxval)) != NULL;
+  if (success && w > 0 && h > 0) {
+    int ntx = (W + T - 1) / T;
+    int tx0 = x / T, tx1 = (x + w - 1) / T;
+    int ty0 = y / T, ty1 = (y + h - 1) / T;
+    int rtx = tx1 - tx0 + 1;
+    ntiles = (long)rtx * (ty1 - ty0 + 1);
+    index = (uint8*)malloc(8 * ((size_t)rtx + 1));
+    data = (uint8**)calloc(ntiles, sizeof(uint8*));
+    dims = (size_t*)malloc(3 * ntiles * sizeof(size_t));   // (tw, th, bytes)
+    success = check( index != NULL && data != NULL && dims != NULL, "Falha ao alocar memória" );
+    for (int ty = ty0; success && ty <= ty1; ty++) {
+      // entradas do índice dos tiles desta linha que tocam a região
+      off_t ipos = TILED_HEADER + 8 * ((off_t)ty*ntx + tx0);
+      success = check( preadAll(fd, index, 8 * ((size_t)rtx + 1), ipos), "Invalid file format" );
+      for (int t = 0; success && t < rtx; t++) {
+        long k = (long)(ty - ty0)*rtx + t;
+        uint64_t from = get64(index + 8*t);
+        uint64_t bytes = get64(index + 8*(t+1)) - from;
+        int tw = ((long)(tx0 + t + 1) * T <= W) ? T : W - (tx0 + t) * T;
+        int th = ((long)(ty + 1) * T <= H) ? T : H - ty * T;
+        success = check( from <= get64(index + 8*(t+1)) && bytes <= tileBound((size_t)tw*th),
+                         "Invalid file format" ) &&
+                  check( (data[k] = (uint8*)malloc(bytes + 1)) != NULL, "Falha ao alocar memória" ) &&
+                  check( preadAll(fd, data[k], bytes, (off_t)from), "Reading pixels" );
+        dims[3*k] = (size_t)tw;
+        dims[3*k+1] = (size_t)th;
+        dims[3*k+2] = (size_t)bytes;
+      }
+    }
+    if (success) {
+      TileJob job = { img, T, tx0, ty0, rtx, data, dims, x, y, 0 };
+      ParallelFor((int)ntiles, 1, decodeTiles, &job);
+      success = check( job.failed == 0, job.failed == 1 ? "Falha ao alocar memória" : "Corrupt tile" );
+    }
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  for (long k = 0; data != NULL && k < ntiles; k++) free(data[k]);
+  free(data);
+  free(dims);
+  free(index);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Load an image from a tiled container file (see ImageSaveTiled).
+/// The tiles are decoded in parallel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadTiled(const char* filename) { ///
+  assert (filename != NULL);
+  int fd = open(filename, O_RDONLY);
+  if (!check(fd >= 0, "Open failed")) return NULL;
+  Image img = loadTiledRegion(fd, 0, 0, 0, 0, 1);
+  errsave = errno;
+  close(fd);
+  errno = errsave;
+  return img;
+}
+
+
+/// Asynchronous I/O
+
+// A background load or save runs in its own thread.  The thread records
+// the error cause, errno and instrumentation counts of the operation, and
+// the Wait function copies them to the calling thread, so that
+// ImageErrMsg(), errno and the counters behave as if the operation had run
+// there.
+struct imageio {
+  pthread_t thread;
+  char* filename;
+  int max;          // carregamento: máximo de imagens
+  Image imgs[0x40]; // carregamento: imagens lidas (no máximo 64)
+  int count;        // carregamento: número de imagens; gravação: sucesso
+  Image img;        // gravação: cópia (partilhada) dos pixeis a gravar
+  char* err;        // errCause no fim da operação
+  int errnum;       // errno no fim da operação
+  unsigned long counts[NUMCOUNTERS];   // contadores da thread no fim da operação
+};
+
+// Record the outcome of the operation of io, at the end of its thread.
+static void ioDone(ImageIO io) {
+  io->err = errCause;
+  io->errnum = errno;
+  for (int c = 0; c < NUMCOUNTERS; c++) io->counts[c] = InstrCount[c];
+}
+
+// Copy the outcome of the operation of io to the calling thread.
+static void ioResult(ImageIO io) {
+  errCause = io->err;
+  errno = io->errnum;
+  for (int c = 0; c < NUMCOUNTERS; c++) InstrCount[c] += io->counts[c];
+}
+
+// Function called by the background threads around each load and save
+static ImageIOHook ioHook = NULL;
+
+/// Set hook as the function called by the background threads when each
+/// load or save starts and ends (see ImageIOHook); NULL removes it.
+/// Must be set before starting any background load or save.
+void ImageSetIOHook(ImageIOHook hook) { ///
+  ioHook = hook;
+}
+
+static void* loadThread(void* arg) {
+  ImageIO io = (ImageIO)arg;
+  if (ioHook != NULL) ioHook("load", io->filename, 1, NULL, 0);
+  io->count = ImageLoadMany(io->filename, io->imgs, io->max);
+  if (ioHook != NULL) ioHook("load", io->filename, 0, io->imgs, io->count);
+  ioDone(io);
+  return NULL;
+}
+
+// Create a new temporary file for filename, in the same directory, and
+// store its name in tmp (with room for 32 more characters).
+// The file is created with mode 0666 less the umask, as fopen would, so
+// that it keeps those permissions when renamed (mkstemp would use 0600).
+// Returns the open descriptor, or -1 on failure.
+static int tempFile(const char* filename, char* tmp) {
+  static unsigned int serial = 0;   // nomes distintos entre threads
+  int fd = -1;
+  for (int tries = 0; fd < 0 && tries < 100; tries++) {
+    sprintf(tmp, "%s.%ld.%u", filename, (long)getpid(), __sync_fetch_and_add(&serial, 1));
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno != EEXIST) break;
+  }
+  return fd;
+}
+
+// Write to a temporary file in the same directory, then rename it over
+// the destination, so that readers never see a partially written image.
+static void* saveThread(void* arg) {
+  ImageIO io = (ImageIO)arg;
+  if (ioHook != NULL) ioHook("save", io->filename, 1, NULL, 0);
+  char* tmp = (char*)malloc(strlen(io->filename) + 32);
+  int fd = -1;
+  io->count =
+  check( tmp != NULL, "Falha ao alocar memória" ) &&
+  check( (fd = tempFile(io->filename, tmp)) >= 0, "Open failed" ) &&
+  (close(fd), ImageSave(io->img, tmp)) &&
+  check( rename(tmp, io->filename) == 0, "Rename failed" );
+  errsave = errno;
+  if (!io->count && fd >= 0) unlink(tmp);
+  free(tmp);
+  errno = errsave;
+  if (ioHook != NULL) ioHook("save", io->filename, 0, &io->img, io->count ? 1 : 0);
+  ImageDestroy(&io->img);
+  ioDone(io);
+  return NULL;
+}
+
+static ImageIO ioStart(const char* filename, void* (*fn)(void*), Image img, int max) {
+  ImageIO io = (ImageIO)calloc(1, sizeof(*io));
+  if (io == NULL) return NULL;
+  io->filename = strdup(filename);
+  io->img = img;
+  io->max = max;
+  if (io->filename == NULL || pthread_create(&io->thread, NULL, fn, io) != 0) {
+    free(io->filename);
+    free(io);
+    return NULL;
+  }
+  return io;
+}
+
+/// Start loading the PGM images of a file in a background thread
+/// (see ImageLoadMany).  At most max images (max <= 64) are loaded.
+/// Returns a handle to be passed to ImageLoadWait, or NULL if the
+/// background thread could not be started (the caller may then load
+/// synchronously).
+ImageIO ImageLoadAsync(const char* filename, int max) { ///
+  assert (filename != NULL);
+  assert (1 <= max && max <= 0x40);
+  return ioStart(filename, loadThread, NULL, max);
+}
+
+/// Wait for a background load started by ImageLoadAsync and release *req.
+/// Stores the images in imgs[0], imgs[1], ... and returns their number, as
+/// ImageLoadMany does.  On failure, returns 0 and errno/errCause are set.
+/// Ensures: (*req)==NULL.
+int ImageLoadWait(ImageIO* req, Image imgs[]) { ///
+  assert (req != NULL && *req != NULL);
+  ImageIO io = *req;
+  pthread_join(io->thread, NULL);
+  for (int i = 0; i < io->count; i++) imgs[i] = io->imgs[i];
+  int count = io->count;
+  ioResult(io);
+  free(io->filename);
+  free(io);
+  *req = NULL;
+  return count;
+}
+
+/// Start saving img to a PGM file in a background thread.
+/// The pixels are copied first (copy-on-write, see ImageShare), so img
+/// may be modified or destroyed right away.  The file is written under a temporary name and renamed
+/// when complete, so it never appears partially written.
+/// Returns a handle to be passed to ImageSaveWait, or NULL if the copy or
+/// the background thread could not be made (the caller may then save
+/// synchronously).
+ImageIO ImageSaveAsync(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  Image copy = ImageShare(img);
+  if (copy == NULL) return NULL;
+  ImageIO io = ioStart(filename, saveThread, copy, 0);
+  if (io == NULL) ImageDestroy(&copy);
+  return io;
+}
+
+/// Wait for a background save started by ImageSaveAsync and release *req.
+/// Returns nonzero on success.
+/// On failure, returns 0 and errno/errCause are set.
+/// Ensures: (*req)==NULL.
+int ImageSaveWait(ImageIO* req) { ///
+  assert (req != NULL && *req != NULL);
+  ImageIO io = *req;
+  pthread_join(io->thread, NULL);
+  int success = io->count;
+  ioResult(io);
+  free(io->filename);
+  free(io);
+  *req = NULL;
+  return success;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Pixel statsS
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+void ImageStats(Image img, uint8* min, uint8* max) { ///
+  assert (img != NULL);
+  // Insert your code here!  
+  for (int y = 0; y < (img->height); y++) {    // percorremos todos os pixeis da imagem
+    for (int x = 0; x < (img->width); x++) {
+      int currentpixel = ImageGetPixel(img, x, y);
+      if (currentpixel < *min) {    // verificamos se o currentpixel é menor que o antigo min
+        *min = currentpixel;
+      } else if (currentpixel > *max) {   // verificamos se o currentpixel é maior que antigo max
+        *max = currentpixel;
+      }
+    }
+  }
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  // Insert your code here!
+  return (0 <= x && x + w <= img->width) && (0 <= y && y + h <= img->height);
+}
+
+/// Pixel get & set operations
+
+/// These are the primitive operations to access and modify a single pixel
+/// in the image.
+/// These are very simple, but fundamental operations, which may be used to 
+/// implement more complex operations.
+
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel. 
+// The returned index must satisfy (0 <= index < img->width*img->height)
+static inline int G(Image img, int x, int y) {
+  assert(img != NULL);
+  int index;
+  // Insert your code here!
+  index = y * img->width + x;   // calcula o índice do primeiro pixel na linha y da imagem
+  assert (0 <= index && index < img->width*img->height);   // asseguramos que o index é menor que o número total de pixeis da imagem, considerando o pixel (0,0)
+  return index;
 }
 
 /// Get the pixel (level) at position (x,y).
@@ -383,6 +1639,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
+  if (img->pyramid != NULL || img->fd >= 0) pixelsChanged(img);
   img->pixel[G(img, x, y)] = level;
   ATRIB += 1;
 } 
@@ -478,27 +1735,27 @@ void ImageBrighten(Image img, double factor) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
-  int nimage_height = img->width;
-  int nimage_width = img->height;
-  int nimage_maxval = img->maxval;
-  Image nimage = ImageCreate(nimage_height, nimage_width, nimage_maxval);  // criamos uma nova imagem com os mesmos dados da outra
+  const int w = img->width;
+  const int h = img->height;
+  Image nimage = ImageCreate(h, w, img->maxval);  // a imagem rodada tem as dimensões trocadas
+  if (nimage == NULL) return NULL;
 
-  for (int y=0;y<nimage_height;y++){    // percorremos a nova imagem  
-    for (int x=0;x<nimage_width;x++){
-      // para ocorrer rotação, definimos os pixeis da nova imagem ao contrário, ou seja y,x em vez de x,y
-      // pois ao ocorrer rotação antihorária, as coordenadas trocam-se
-      // no entanto fornecemos o valor do pixel da imagem original
-      // na coordenada x damos o valor espelhado horizontalmente (width - 1 - j) pois a rotação é -90º
-      // na coordenada y damos o valor original pois se a rotação é -90º, a coordenada é a mesma
-      ImageSetPixel(nimage, y, x, ImageGetPixel(img, nimage_width -1 - x , y));                                   
+  // O pixel (x,y) da nova imagem é o pixel (w-1-y, x) da original: uma
+  // transposição, feita em blocos de ROTBLOCK x ROTBLOCK para que as linhas
+  // lidas e escritas de cada bloco caibam na cache
+  enum { ROTBLOCK = 64 };
+  for (int by = 0; by < w; by += ROTBLOCK) {
+    for (int bx = 0; bx < h; bx += ROTBLOCK) {
+      int ey = (by + ROTBLOCK < w) ? by + ROTBLOCK : w;
+      int ex = (bx + ROTBLOCK < h) ? bx + ROTBLOCK : h;
+      for (int y = by; y < ey; y++) {
+        uint8* d = nimage->pixel + (size_t)y*h;
+        const uint8* s = img->pixel + (w - 1 - y);
+        for (int x = bx; x < ex; x++) d[x] = s[(size_t)x*w];
+      }
     }
   }
-  if (nimage == NULL) {
-    errCause = "Falha ao alterar a imagem nova";    // caso o processo de criação da imagem não tenha corrido bem
-    errno = EIO;   // Ocorreu um problema no output
-    return NULL;
-  }
+  PIXMEM += 2ul*w*h;  // uma leitura e uma escrita por pixel
   return nimage;
 }
 
@@ -566,8 +1823,416 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
 }
 
 
+
+/// Resizing
+
+// Output sample i of a resampling direction is the weighted sum of the
+// source samples start[i] .. start[i]+taps-1, with weights w[i*taps + t]
+// in fixed point with RESIZE_BITS fractional bits, adding up to 1.
+#define RESIZE_BITS 14
+#define RESIZE_ONE (1 << RESIZE_BITS)
+
+typedef struct {
+  int taps;
+  int* start;
+  int16_t* w;
+} Weights;
+
+// Compute the weights that resample n source samples to m samples.
+// Returns 0 on failure (out of memory).
+static int makeWeights(Weights* wt, int n, int m, int mode) {
+  double scale = (double)n / m;
+  int taps = (mode == RESIZE_NEAREST) ? 1 :
+             (mode == RESIZE_BILINEAR) ? 2 : (int)ceil(scale) + 1;
+  if (taps > n) taps = n;
+  wt->taps = taps;
+  wt->start = (int*)malloc(m * sizeof(int));
+  wt->w = (int16_t*)malloc((size_t)m * taps * sizeof(int16_t));
+  double* f = (double*)malloc(taps * sizeof(double));
+  if (!check( wt->start != NULL && wt->w != NULL && f != NULL, "Falha ao alocar memória" )) {
+    free(wt->start);
+    free(wt->w);
+    free(f);
+    wt->start = NULL;
+    wt->w = NULL;
+    return 0;
+  }
+  for (int i = 0; i < m; i++) {
+    // Amostras de origem (j) e pesos (a) antes de ajustar à janela
+    double a0 = i*scale, a1 = (i+1)*scale;   // intervalo coberto (área)
+    double s = (i + 0.5)*scale - 0.5;         // centro (bilinear)
+    int lo = (mode == RESIZE_NEAREST) ? (int)((i + 0.5)*scale) :
+             (mode == RESIZE_BILINEAR) ? (int)floor(s) : (int)floor(a0);
+    int start = lo < 0 ? 0 : (lo > n - taps ? n - taps : lo);
+    for (int t = 0; t < taps; t++) f[t] = 0.0;
+    for (int t = 0; t < taps; t++) {
+      int j = lo + t;
+      double a;
+      if (mode == RESIZE_NEAREST) {
+        a = 1.0;
+      } else if (mode == RESIZE_BILINEAR) {
+        a = (t == 0) ? 1.0 - (s - lo) : s - lo;
+      } else {
+        double b0 = (j > a0) ? j : a0, b1 = (j+1 < a1) ? j+1 : a1;
+        a = (b1 > b0) ? (b1 - b0) / scale : 0.0;
+      }
+      j = j < 0 ? 0 : (j > n-1 ? n-1 : j);
+      f[j - start] += a;
+    }
+    // Pesos em vírgula fixa, com soma exatamente RESIZE_ONE
+    int16_t* w = wt->w + (size_t)i*taps;
+    int sum = 0, big = 0;
+    for (int t = 0; t < taps; t++) {
+      w[t] = (int16_t)lround(f[t] * RESIZE_ONE);
+      sum += w[t];
+      if (w[t] > w[big]) big = t;
+    }
+    w[big] += RESIZE_ONE - sum;
+    wt->start[i] = start;
+  }
+  free(f);
+  return 1;
+}
+
+typedef struct {
+  Image src;
+  Image dst;
+  Weights wx;
+  Weights wy;
+  volatile int failed;   // set by any chunk that runs out of memory
+} ResizeJob;
+
+// Resize output rows [begin, end): first combine the source rows of each
+// output row into tmp (vertical pass, 6 fractional bits kept), then
+// combine the columns of tmp (horizontal pass).
+static void resizeRows(void* arg, int begin, int end) {
+  ResizeJob* job = (ResizeJob*)arg;
+  const int sw = job->src->width;
+  const int dw = job->dst->width;
+  const Weights* wx = &job->wx;
+  const Weights* wy = &job->wy;
+  uint16_t* tmp = (uint16_t*)malloc(sw * sizeof(uint16_t));
+  if (tmp == NULL) { job->failed = 1; return; }
+  for (int y = begin; y < end; y++) {
+    const uint8* row = job->src->pixel + (size_t)wy->start[y]*sw;
+    const int16_t* w = wy->w + (size_t)y*wy->taps;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << 7);
+    for (; x + 8 <= sw; x += 8) {
+      __m128i acc0 = zero, acc1 = zero;
+      int t = 0;
+      for (; t < wy->taps; t += 2) {
+        // Duas linhas de cada vez: pares (p0, p1) x (w0, w1) com madd
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + (size_t)t*sw + x)), zero);
+        __m128i b = zero;
+        int w1 = 0;
+        if (t + 1 < wy->taps) {
+          b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + (size_t)(t+1)*sw + x)), zero);
+          w1 = w[t+1];
+        }
+        __m128i wv = _mm_set1_epi32((w1 << 16) | (uint16_t)w[t]);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wv));
+      }
+      acc0 = _mm_srai_epi32(_mm_add_epi32(acc0, half), 8);
+      acc1 = _mm_srai_epi32(_mm_add_epi32(acc1, half), 8);
+      _mm_storeu_si128((__m128i*)(tmp + x), _mm_packs_epi32(acc0, acc1));
+    }
+#endif
+    for (; x < sw; x++) {
+      int acc = 0;
+      for (int t = 0; t < wy->taps; t++) acc += w[t] * row[(size_t)t*sw + x];
+      tmp[x] = (uint16_t)((acc + (1 << 7)) >> 8);
+    }
+    uint8* out = job->dst->pixel + (size_t)y*dw;
+    for (int i = 0; i < dw; i++) {
+      const uint16_t* p = tmp + wx->start[i];
+      const int16_t* v = wx->w + (size_t)i*wx->taps;
+      int acc = 0;
+      for (int t = 0; t < wx->taps; t++) acc += v[t] * p[t];
+      out[i] = (uint8)((acc + (1 << 19)) >> 20);
+    }
+  }
+  free(tmp);
+}
+
+// Decimation by integer factors fx x fy: each output pixel is the rounded
+// mean of a block of source pixels.
+typedef struct {
+  Image src;
+  Image dst;
+  int fx;
+  int fy;
+  volatile int failed;   // set by any chunk that runs out of memory
+} DecimateJob;
+
+static void halve(const uint8* src, int sw, uint8* dst, int dw, int dh);
+
+// Area-average rows source rows (each sw pixels, consecutive in memory)
+// into one output row of ceil(sw/fx) pixels: each output pixel is the
+// rounded mean of the block of pixels under it (narrower at the right end).
+// col is scratch space for sw column sums.
+// Requires: rows <= 257 and rows*fx < 2^16 (the sums fit in 16 bits).
+static void decimateRow(const uint8* row, int sw, int rows, int fx, uint16_t* col, uint8* out) {
+  for (int x = 0; x < sw; x++) col[x] = row[x];
+  for (int r = 1; r < rows; r++) {
+    row += sw;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= sw; x += 16) {
+      __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+      __m128i c0 = _mm_loadu_si128((const __m128i*)(col + x));
+      __m128i c1 = _mm_loadu_si128((const __m128i*)(col + x + 8));
+      _mm_storeu_si128((__m128i*)(col + x), _mm_add_epi16(c0, _mm_unpacklo_epi8(p, zero)));
+      _mm_storeu_si128((__m128i*)(col + x + 8), _mm_add_epi16(c1, _mm_unpackhi_epi8(p, zero)));
+    }
+#endif
+    for (; x < sw; x++) col[x] += row[x];
+  }
+  // Divisão exata por n: (v * inv) >> 40, para v <= 255*n e n < 2^16
+  const uint32_t n = (uint32_t)rows*fx;
+  const uint64_t inv = ((1ull << 40) + n - 1) / n;
+  const int dw = sw / fx;
+  const uint16_t* c = col;
+  for (int i = 0; i < dw; i++, c += fx) {
+    uint32_t sum = n/2;
+    for (int k = 0; k < fx; k++) sum += c[k];
+    out[i] = (uint8)((sum * inv) >> 40);
+  }
+  if (dw*fx < sw) {   // bloco incompleto na ponta direita
+    uint32_t m = (uint32_t)rows*(sw - dw*fx);
+    uint32_t sum = m/2;
+    for (int k = 0; k < sw - dw*fx; k++) sum += c[k];
+    out[dw] = (uint8)(sum / m);
+  }
+}
+
+static void decimateRows(void* arg, int begin, int end) {
+  DecimateJob* job = (DecimateJob*)arg;
+  const int sw = job->src->width;
+  const int dw = job->dst->width;
+  const int fx = job->fx, fy = job->fy;
+  if (fx == 2 && fy == 2) {   // o caso mais comum já tem um kernel SIMD
+    halve(job->src->pixel + (size_t)2*begin*sw, sw,
+          job->dst->pixel + (size_t)begin*dw, dw, end - begin);
+    return;
+  }
+  uint16_t* col = (uint16_t*)malloc(sw * sizeof(uint16_t));
+  if (col == NULL) { job->failed = 1; return; }
+  for (int y = begin; y < end; y++) {
+    decimateRow(job->src->pixel + (size_t)y*fy*sw, sw, fy, fx, col,
+                job->dst->pixel + (size_t)y*dw);
+  }
+  free(col);
+}
+
+/// Resize an image to w x h pixels.
+/// mode selects how the output pixels are computed:
+///   RESIZE_NEAREST : the nearest source pixel;
+///   RESIZE_BILINEAR : bilinear interpolation of the 4 nearest source pixels;
+///   RESIZE_AREA : mean of the source pixels under the output pixel, each
+///     weighted by the area it covers (the best choice to reduce images).
+/// Requires: w > 0, h > 0 and img is not empty.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int mode) { ///
+  assert (img != NULL);
+  assert (w > 0 && h > 0);
+  assert (img->width > 0 && img->height > 0);
+  assert (mode == RESIZE_NEAREST || mode == RESIZE_BILINEAR || mode == RESIZE_AREA);
+  Image dst = ImageCreate(w, h, img->maxval);
+  if (dst == NULL) return NULL;
+  PIXMEM += (unsigned long)img->width*img->height + (unsigned long)w*h;
+  // Linhas por tarefa: o bastante para amortizar a criação das threads
+  int grain = 1 + (1 << 16) / (img->width + 1);
+
+  if (mode == RESIZE_AREA && img->width % w == 0 && img->height % h == 0 &&
+      img->height / h <= 257 && (img->width / w) * (img->height / h) < (1 << 16)) {
+    DecimateJob job = { img, dst, img->width / w, img->height / h, 0 };
+    ParallelFor(h, grain, decimateRows, &job);
+    if (!check( !job.failed, "Falha ao alocar memória" )) ImageDestroy(&dst);
+    return dst;
+  }
+  ResizeJob job = { img, dst, { 0, NULL, NULL }, { 0, NULL, NULL }, 0 };
+  int success =
+  makeWeights(&job.wx, img->width, w, mode) &&
+  makeWeights(&job.wy, img->height, h, mode);
+  if (success) {
+    ParallelFor(h, grain, resizeRows, &job);
+    success = check( !job.failed, "Falha ao alocar memória" );
+  }
+  free(job.wx.start);
+  free(job.wx.w);
+  free(job.wy.start);
+  free(job.wy.w);
+  if (!success) ImageDestroy(&dst);
+  return dst;
+}
+
+
+/// Affine warps
+
+// Source coordinates are stepped along each output row in fixed point,
+// with WARP_BITS fractional bits (in 64 bits, for any image size).
+#define WARP_BITS 32
+#define WARP_ONE ((int64_t)1 << WARP_BITS)
+
+// Output tiles of WARP_TILE x WARP_TILE pixels: the source pixels that
+// a tile reads lie in a small area, whatever the angle.
+#define WARP_TILE 64
+
+typedef struct {
+  Image src;
+  Image dst;
+  double inv[6];   // maps output (x,y) to source coordinates
+  int interp;
+} WarpJob;
+
+// Warp the tile rows [begin, end) of the output (each WARP_TILE rows).
+static void warpRows(void* arg, int begin, int end) {
+  WarpJob* job = (WarpJob*)arg;
+  const int sw = job->src->width, sh = job->src->height;
+  const int dw = job->dst->width, dh = job->dst->height;
+  const uint8* src = job->src->pixel;
+  const double* m = job->inv;
+  // Passos por pixel de saída, em vírgula fixa
+  const int64_t stepx = llround(m[0] * WARP_ONE);
+  const int64_t stepy = llround(m[3] * WARP_ONE);
+  const int64_t half = WARP_ONE / 2;
+  for (int ty = begin*WARP_TILE; ty < end*WARP_TILE && ty < dh; ty += WARP_TILE) {
+    for (int tx = 0; tx < dw; tx += WARP_TILE) {
+      int ey = (ty + WARP_TILE < dh) ? ty + WARP_TILE : dh;
+      int ex = (tx + WARP_TILE < dw) ? tx + WARP_TILE : dw;
+      for (int y = ty; y < ey; y++) {
+        uint8* d = job->dst->pixel + (size_t)y*dw;
+        // Coordenadas de origem do primeiro pixel da linha do bloco
+        int64_t sx = llround((m[0]*tx + m[1]*y + m[2]) * WARP_ONE);
+        int64_t sy = llround((m[3]*tx + m[4]*y + m[5]) * WARP_ONE);
+        if (job->interp == WARP_NEAREST) {
+          for (int x = tx; x < ex; x++, sx += stepx, sy += stepy) {
+            int64_t ix = (sx + half) >> WARP_BITS, iy = (sy + half) >> WARP_BITS;
+            d[x] = ((uint64_t)ix < (uint64_t)sw && (uint64_t)iy < (uint64_t)sh) ?
+                   src[(size_t)iy*sw + ix] : 0;
+          }
+        } else {
+          for (int x = tx; x < ex; x++, sx += stepx, sy += stepy) {
+            // Fora da imagem (o pixel mais próximo não existe): preto
+            int64_t nx = (sx + half) >> WARP_BITS, ny = (sy + half) >> WARP_BITS;
+            if ((uint64_t)nx >= (uint64_t)sw || (uint64_t)ny >= (uint64_t)sh) {
+              d[x] = 0;
+              continue;
+            }
+            int64_t ix = sx >> WARP_BITS, iy = sy >> WARP_BITS;
+            // Pesos com 11 bits: a soma ponderada cabe em 32 bits sem sinal
+            uint32_t fx = (uint32_t)(sx >> (WARP_BITS - 11)) & 2047;
+            uint32_t fy = (uint32_t)(sy >> (WARP_BITS - 11)) & 2047;
+            // Vizinhos limitados à imagem, junto às margens
+            int x0 = ix < 0 ? 0 : (int)ix, x1 = ix + 1 >= sw ? sw - 1 : (int)ix + 1;
+            int y0 = iy < 0 ? 0 : (int)iy, y1 = iy + 1 >= sh ? sh - 1 : (int)iy + 1;
+            const uint8* r0 = src + (size_t)y0*sw;
+            const uint8* r1 = src + (size_t)y1*sw;
+            uint32_t top = r0[x0]*(2048 - fx) + r0[x1]*fx;
+            uint32_t bot = r1[x0]*(2048 - fx) + r1[x1]*fx;
+            d[x] = (uint8)((top*(2048 - fy) + bot*fy + (1u << 21)) >> 22);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Is m (within rounding) the matrix of an exact 90 degree counter-clockwise
+// rotation of a square image of side n onto itself?
+static int isRotate90(const double m[6], int n) {
+  const double exact[6] = { 0.0, 1.0, 0.0, -1.0, 0.0, n - 1.0 };
+  for (int i = 0; i < 6; i++) {
+    if (fabs(m[i] - exact[i]) > 1e-9) return 0;
+  }
+  return 1;
+}
+
+/// Apply an affine transformation to an image.
+/// matrix = {a, b, c, d, e, f} maps each pixel (x,y) of img to position
+///   (a*x + b*y + c, d*x + e*y + f)
+/// of the result, which has the same size as img.  (For example, a rotation
+/// by t radians counter-clockwise about the center (cx,cy) has
+/// a = e = cos t, b = -d = sin t, c = cx - a*cx - b*cy, f = cy - d*cx - e*cy.)
+/// Each output pixel samples img at the corresponding position using
+/// interp: WARP_NEAREST (nearest pixel) or WARP_BILINEAR (bilinear
+/// interpolation).  Output pixels that come from outside img are black.
+/// The exact 90 degree rotation of a square image is done by ImageRotate.
+/// Requires: the matrix is invertible (a*e - b*d != 0).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double matrix[6], int interp) { ///
+  assert (img != NULL);
+  assert (matrix != NULL);
+  assert (interp == WARP_NEAREST || interp == WARP_BILINEAR);
+  const double* m = matrix;
+  double det = m[0]*m[4] - m[1]*m[3];
+  assert (det != 0.0);
+  if (img->width == img->height && isRotate90(m, img->width)) {
+    return ImageRotate(img);
+  }
+  Image dst = ImageCreate(img->width, img->height, img->maxval);
+  if (dst == NULL) return NULL;
+  // Inversa: de coordenadas de saída para coordenadas de origem
+  WarpJob job = { img, dst, {
+      m[4]/det, -m[1]/det, (m[1]*m[5] - m[4]*m[2])/det,
+      -m[3]/det, m[0]/det, (m[3]*m[2] - m[0]*m[5])/det },
+    interp };
+  int tiles = (dst->height + WARP_TILE - 1) / WARP_TILE;
+  ParallelFor(tiles, 1, warpRows, &job);
+  PIXMEM += (unsigned long)dst->width*dst->height * (interp == WARP_NEAREST ? 2 : 5);
+  return dst;
+}
+
 /// Operations on two images
 
+// p1[i] = (a*p2[i] + (255-a)*p1[i] + 127) / 255 for n pixels, where a is
+// alpha[i], or alpha[0] for all pixels if uniform.
+// The numerator t fits in 16 bits, and t/255 = (t*0x8081) >> 23 for every
+// 16-bit t, so SSE2 does 8 pixels per multiply-high (pmulhuw).
+static void blendRow(uint8* p1, const uint8* p2, const uint8* alpha, int n, int uniform) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i v255 = _mm_set1_epi16(255);
+  const __m128i v127 = _mm_set1_epi16(127);
+  const __m128i magic = _mm_set1_epi16((short)0x8081);
+  const __m128i ua = _mm_set1_epi8((char)alpha[0]);
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = uniform ? ua : _mm_loadu_si128((const __m128i*)(alpha + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(p1 + i));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(p2 + i));
+    __m128i r[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+      __m128i x1 = h ? _mm_unpackhi_epi8(v1, zero) : _mm_unpacklo_epi8(v1, zero);
+      __m128i x2 = h ? _mm_unpackhi_epi8(v2, zero) : _mm_unpacklo_epi8(v2, zero);
+      __m128i t = _mm_add_epi16(_mm_mullo_epi16(a16, x2),
+                                _mm_mullo_epi16(_mm_sub_epi16(v255, a16), x1));
+      t = _mm_add_epi16(t, v127);
+      r[h] = _mm_srli_epi16(_mm_mulhi_epu16(t, magic), 7);
+    }
+    _mm_storeu_si128((__m128i*)(p1 + i), _mm_packus_epi16(r[0], r[1]));
+  }
+#endif
+  for (; i < n; i++) {
+    unsigned a = uniform ? alpha[0] : alpha[i];
+    p1[i] = (uint8)((a*p2[i] + (255 - a)*p1[i] + 127) / 255);
+  }
+}
+
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -599,24 +2264,49 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (alpha >= 0.0 && alpha <= 1.0);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
   // Insert your code here!
-  for (int i = 0; i < img2->height; i++) {   // percorremos a imagem
-    for (int j = 0; j < img2->width; j++) {
-      if ((i+y) < img1->height && (j+x) < img1->width) {   // verificamos se as coordenadas da img1 e da img2 somadas estão dentro dos limites
-        uint8 pixel1 = ImageGetPixel(img1, j+x, i+y);   // j+x e i+y pois estamos a selecionar o pixel da img1 correspondente ao da img2
-        uint8 pixel2 = ImageGetPixel(img2, j, i);  // vamos buscar o pixel na img2
-        uint8 newpixel = (uint8)(((1.0 - alpha) * pixel1 + alpha * pixel2)+0.5);   // Se alpha for 0.0, o resultado será idêntico a pixel1, se alpha for 1.0, o resultado será idêntico a pixel2, e para valores intermediários de alpha, o resultado será uma combinação ponderada dos dois pixels.
-        if (newpixel > 255) {   // overflow aturate
-          newpixel = 255;
-        } else if (newpixel < 0){   // underflow
-          newpixel = 0;
-        }
-        ImageSetPixel(img1, j+x, i+y, newpixel);  // mudamos o pixel, temos j+x e i+y tendo em consideração a posição da img2 na img1
+  const int w = img2->width;
+  pixelsChanged(img1);
+  double a255 = alpha * 255.0;
+  if (a255 == (int)a255) {
+    // alpha = a/255: a fórmula inteira dá exatamente o mesmo arredondamento
+    const uint8 a = (uint8)a255;
+    for (int i = 0; i < img2->height; i++) {
+      blendRow(img1->pixel + (size_t)(y + i)*img1->width + x, img2->pixel + (size_t)i*w, &a, w, 1);
+    }
+  } else {
+    for (int i = 0; i < img2->height; i++) {   // percorremos a imagem
+      uint8* p1 = img1->pixel + (size_t)(y + i)*img1->width + x;
+      const uint8* p2 = img2->pixel + (size_t)i*w;
+      for (int j = 0; j < w; j++) {
+        // Se alpha for 0.0, o resultado será idêntico a pixel1, se alpha for 1.0, o resultado será idêntico a pixel2
+        p1[j] = (uint8)(((1.0 - alpha) * p1[j] + alpha * p2[j]) + 0.5);
       }
     }
   }
+  PIXMEM += 3ul*w*img2->height;  // duas leituras e uma escrita por pixel
 }
 
-
+/// Blend an image into a larger image through an alpha mask.
+/// Blend img2 into position (x, y) of img1, where each pixel is weighted
+/// by the corresponding level a of mask (0 keeps img1, 255 gives img2):
+///   p1 = (a*p2 + (255-a)*p1 + 127) / 255   (integer division).
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (mask != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert (mask->width == img2->width && mask->height == img2->height);
+  const int w = img2->width;
+  pixelsChanged(img1);
+  for (int i = 0; i < img2->height; i++) {
+    blendRow(img1->pixel + (size_t)(y + i)*img1->width + x, img2->pixel + (size_t)i*w,
+             mask->pixel + (size_t)i*w, w, 0);
+  }
+  PIXMEM += 4ul*w*img2->height;  // três leituras e uma escrita por pixel
+}
 
 
 /// Compare an image to a subimage of a larger image.
@@ -643,91 +2333,671 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
 }
 
 
-/// Locate a subimage inside another image.
-/// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
-/// If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  void InstrReset();
-  // Insert your code here!
-  for(int i=0; i<img1->height-img2->height; i++){    // percorremos a imagem
-    for(int j=0; j<img1->width-img2->width; j++){
-      if(ImageMatchSubImage(img1,j,i,img2)) {   // Comparamos a img1 com a subimage img2
-        if(px != NULL){
-          *px = j;   // *px toma a posição da coordenada x
-        }
-        if(py != NULL){
-          *py = i;   // *py toma a posição da coordenada y
-        }
-        InstrPrint();
-        return 1;   
-      }
+/// Image pyramids
+
+// Maximum number of pyramid levels used by the coarse-to-fine locate.
+// Level k has blocks of 2^k x 2^k pixels, so 5 levels means 32x32 blocks.
+#define PYR_MAXLEVELS 5
+
+// Reduce a (2dw)x(2dh) raster src with row stride sw to dw x dh raster dst,
+// each output pixel being the rounded mean of a 2x2 block.
+static void halve(const uint8* src, int sw, uint8* dst, int dw, int dh) {
+  for (int y = 0; y < dh; y++) {
+    const uint8* r0 = src + (size_t)(2*y)*sw;
+    const uint8* r1 = r0 + sw;
+    uint8* d = dst + (size_t)y*dw;
+    int x = 0;
+#ifdef __SSE2__
+    // 8 blocos de cada vez: cada par de bytes é lido como um uint16
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 8 <= dw; x += 8) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(r0 + 2*x));
+      __m128i b = _mm_loadu_si128((const __m128i*)(r1 + 2*x));
+      __m128i sa = _mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8));
+      __m128i sb = _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8));
+      __m128i m = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sa, sb), two), 2);
+      _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(m, m));
+    }
+#endif
+    for (; x < dw; x++) {
+      d[x] = (uint8)((r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) >> 2);
     }
   }
-  InstrPrint();
-  return 0;
+  PIXMEM += (unsigned long)(5*dw*dh);  // 4 leituras e 1 escrita por bloco
 }
 
+/// Discard the cached pyramid of img, if any.
+/// Called automatically whenever the pixels of img change.
+void ImagePyramidDrop(Image img) { ///
+  assert (img != NULL);
+  for (int k = 0; k < img->nlevels; k++) {
+    ImageDestroy(&img->pyramid[k]);
+  }
+  free(img->pyramid);
+  img->pyramid = NULL;
+  img->nlevels = 0;
+}
 
-/// Filtering
+/// Build (and cache in img) a pyramid with up to levels reduced levels.
+/// Level k is (width>>k)x(height>>k) and each of its pixels is the rounded
+/// mean of a 2x2 block of level k-1 (level 0 is img itself).
+/// Incomplete blocks on the right/bottom margins are discarded.
+/// Levels already cached are reused.
+/// On success, returns the number of levels available (may be < levels,
+/// if the image is too small).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImagePyramidBuild(Image img, int levels) { ///
+  assert (img != NULL);
+  assert (levels >= 0);
+  // não faz sentido criar níveis com largura ou altura 0
+  while (levels > 0 && ((img->width >> levels) == 0 || (img->height >> levels) == 0)) {
+    levels--;
+  }
+  if (levels <= img->nlevels) return levels;
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+  Image* pyr = (Image*)realloc(img->pyramid, levels * sizeof(Image));
+  if (!check(pyr != NULL, "Falha ao alocar memória")) return -1;
+  img->pyramid = pyr;
+  for (int k = img->nlevels + 1; k <= levels; k++) {
+    Image prev = (k == 1) ? img : pyr[k-2];
+    Image lvl = ImageCreate(img->width >> k, img->height >> k, img->maxval);
+    if (lvl == NULL) return -1;   // os níveis anteriores continuam válidos
+    halve(prev->pixel, prev->width, lvl->pixel, lvl->width, lvl->height);
+    pyr[k-1] = lvl;
+    img->nlevels = k;
+  }
+  return levels;
+}
 
-void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
-  
-  InstrReset();
+/// Get level k of the cached pyramid of img (level 0 is img itself).
+/// Requires: 0 <= k <= number of levels built by ImagePyramidBuild.
+/// The returned image belongs to img and must not be destroyed or modified.
+Image ImagePyramidLevel(Image img, int k) { ///
+  assert (img != NULL);
+  assert (0 <= k && k <= img->nlevels);
+  return (k == 0) ? img : img->pyramid[k-1];
+}
 
-  Image imgToBlur = ImageCreate(img->width, img->height,img->maxval);   // criamos uma imagem temporaria
+// Template side of the coarse-to-fine search.
+// Since a candidate position (x,y) is not aligned with the 2^k blocks of
+// img1, the template is reduced once for every phase (px,py) in [0,2^k)^2:
+// grid[k][py*2^k+px] holds the level k reduction of img2 cropped at (px,py).
+// A match at (x,y) requires that every aligned block of img1 inside the
+// window has the same reduced value as the corresponding template block.
+typedef struct {
+  int levels;
+  uint8** grid[PYR_MAXLEVELS+1];
+} TemplatePyramid;
 
-  for(int i=0; i<img->height; i++){   // percorremos a imagem original
-    for(int j=0; j<img->width; j++){
-      double soma=0;
-      double count=0;
-      double media=0;
- 
-      for (int x=(j-dx); x<=(j+dx); x++) {   // percorremos o retangulo dentro da "área afetada pelo blur"
-        for (int y=(i-dy); y<=(i+dy); y++) {
-          if (ImageValidPos(img,x,y)) {   // se a posição for valida:
-            count++;                      // +1 para o count pois temos +1 pixel
-            soma += ImageGetPixel(img,x,y);  // e na soma somamos o valor do pixel
-            COMP += 1; // comparação na linha 680
-            ATRIB += 1;
-          }
+static void templatePyramidFree(TemplatePyramid* tp) {
+  for (int k = 1; k <= tp->levels; k++) {
+    if (tp->grid[k] == NULL) continue;
+    for (int p = 0; p < (1 << (2*k)); p++) free(tp->grid[k][p]);
+    free(tp->grid[k]);
+  }
+}
+
+static int templatePyramidBuild(TemplatePyramid* tp, Image tmpl, int levels) {
+  int w = tmpl->width;
+  int h = tmpl->height;
+  memset(tp, 0, sizeof(*tp));
+  tp->levels = levels;
+  tp->grid[0] = (uint8**)malloc(sizeof(uint8*));
+  if (!check(tp->grid[0] != NULL, "Falha ao alocar memória")) return 0;
+  tp->grid[0][0] = tmpl->pixel;
+  for (int k = 1; k <= levels; k++) {
+    int s = 1 << k;
+    int hs = s >> 1;
+    tp->grid[k] = (uint8**)calloc(s*s, sizeof(uint8*));
+    if (!check(tp->grid[k] != NULL, "Falha ao alocar memória")) return 0;
+    for (int py = 0; py < s; py++) {
+      for (int px = 0; px < s; px++) {
+        int gw = (w - px) >> k;
+        int gh = (h - py) >> k;
+        uint8* g = (uint8*)malloc((size_t)gw*gh + 1);
+        if (!check(g != NULL, "Falha ao alocar memória")) return 0;
+        tp->grid[k][py*s + px] = g;
+        // o bloco (px + i*s) é formado por blocos do nível k-1 com fase px % hs
+        int ppx = px % hs;
+        int ppy = py % hs;
+        int pw = (w - ppx) >> (k-1);
+        const uint8* src = tp->grid[k-1][ppy*hs + ppx];
+        src += (size_t)((py - ppy) / hs) * pw + (px - ppx) / hs;
+        halve(src, pw, g, gw, gh);
+      }
+    }
+  }
+  return 1;
+}
+
+// Test the necessary condition for a match of tp at (x,y), using pyramid
+// level k of img1.  Returns 0 if the candidate can be rejected.
+static int pyramidAccepts(Image img1, int x, int y, Image tmpl,
+                          const TemplatePyramid* tp, int k) {
+  int s = 1 << k;
+  int px = (s - x % s) % s;   // distância até ao primeiro bloco alinhado
+  int py = (s - y % s) % s;
+  int gw = (tmpl->width - px) >> k;
+  int gh = (tmpl->height - py) >> k;
+  Image lvl = ImagePyramidLevel(img1, k);
+  const uint8* g = tp->grid[k][py*s + px];
+  const uint8* l = lvl->pixel + (size_t)((y + py) >> k) * lvl->width + ((x + px) >> k);
+  for (int j = 0; j < gh; j++) {
+    COMP += 1;
+    PIXMEM += (unsigned long)(2*gw);
+    if (memcmp(l, g, gw) != 0) return 0;
+    l += lvl->width;
+    g += gw;
+  }
+  return 1;
+}
+
+// Coarse-to-fine version of ImageLocateSubImage.
+// Visits candidates in the same order as the exhaustive search and confirms
+// every surviving candidate with ImageMatchSubImage, so the result is the same.
+// Returns -1 if the pyramids could not be built (errCause is set).
+static int locatePyramid(Image img1, int* px, int* py, Image img2, int levels) {
+  levels = ImagePyramidBuild(img1, levels);
+  if (levels <= 0) return -1;
+  TemplatePyramid tp;
+  if (!templatePyramidBuild(&tp, img2, levels)) {
+    templatePyramidFree(&tp);
+    return -1;
+  }
+  int found = 0;
+  for (int i = 0; i <= img1->height-img2->height && !found; i++) {
+    for (int j = 0; j <= img1->width-img2->width; j++) {
+      int k = levels;
+      while (k > 0 && pyramidAccepts(img1, j, i, img2, &tp, k)) k--;
+      if (k == 0 && ImageMatchSubImage(img1, j, i, img2)) {
+        if (px != NULL) *px = j;
+        if (py != NULL) *py = i;
+        found = 1;
+        break;
+      }
+    }
+  }
+  templatePyramidFree(&tp);
+  return found;
+}
+
+/// Locate a subimage inside another image.
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  // Insert your code here!
+  // Com blocos de 2^k, qualquer janela com lado >= 2^(k+1)-1 contém pelo
+  // menos um bloco alinhado completo: escolhemos o nível mais grosseiro possível.
+  int levels = 0;
+  int side = img2->width < img2->height ? img2->width : img2->height;
+  while (levels < PYR_MAXLEVELS && (2 << (levels+1)) - 1 <= side) levels++;
+  if (levels > 0) {
+    int found = locatePyramid(img1, px, py, img2, levels);
+    if (found >= 0) return found;
+    // sem memória para as pirâmides: fazemos a pesquisa exaustiva
+  }
+  for(int i=0; i<=img1->height-img2->height; i++){    // percorremos a imagem
+    for(int j=0; j<=img1->width-img2->width; j++){
+      if(ImageMatchSubImage(img1,j,i,img2)) {   // Comparamos a img1 com a subimage img2
+        if(px != NULL){
+          *px = j;   // *px toma a posição da coordenada x
+        }
+        if(py != NULL){
+          *py = i;   // *py toma a posição da coordenada y
         }
+        return 1;   
       }
-      ATRIB += (2*dx + 1) * (2*dy + 1);  // atribuições ao x e y
+    }
+  }
+  return 0;
+}
 
-      if (count != 0) {   // se count for diferente de 0, calculamos a média
-        media = (soma/count)+0.5;   // com 0.5 para o arredondamento às unidades
-        ATRIB += 2; // duas atribuições e uma soma
-        COMP += 1; // comparação na linha 688
-      } else {
-        media = 0;  // caso seja 0 a média também é 0
-        ATRIB += 1; // atribuição, media = 0
+
+/// Approximate matching
+
+// Sum of absolute differences between n bytes of a and b.
+static unsigned long sadRow(const uint8* a, const uint8* b, int n) {
+  unsigned long sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));   // psadbw
+  }
+  sum = (unsigned long)_mm_cvtsi128_si64(acc) +
+        (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+  for (; i < n; i++) {
+    sum += (unsigned long)abs(a[i] - b[i]);
+  }
+  return sum;
+}
+
+// Dot product of n bytes of a and b.
+static uint64_t dotRow(const uint8* a, const uint8* b, int n) {
+  uint64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    // cada lane de 32 bits soma no máximo 2*255*255 por iteração:
+    // esvaziamos o acumulador a cada 4096 iterações para não haver overflow
+    __m128i acc = _mm_setzero_si128();
+    for (int it = 0; it < 4096 && i + 16 <= n; it++, i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)));
+    }
+    uint32_t lane[4];
+    _mm_storeu_si128((__m128i*)lane, acc);
+    sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+  }
+#endif
+  for (; i < n; i++) {
+    sum += (uint64_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+// Build the integral image of img (squares ? pixel^2 : pixel).
+// The result has (width+1)*(height+1) entries, with a zero first row/column:
+// the sum over the rectangle (x,y,w,h) is
+//   I[(y+h)*(W+1)+x+w] - I[y*(W+1)+x+w] - I[(y+h)*(W+1)+x] + I[y*(W+1)+x].
+// Returns NULL on allocation failure (errCause is set).
+static uint64_t* integralImage(Image img, int squares) {
+  int w = img->width;
+  int h = img->height;
+  uint64_t* sum = (uint64_t*)calloc((size_t)(w+1)*(h+1), sizeof(uint64_t));
+  if (!check(sum != NULL, "Falha ao alocar memória")) return NULL;
+  for (int y = 0; y < h; y++) {
+    const uint8* row = img->pixel + (size_t)y*w;
+    uint64_t* prev = sum + (size_t)y*(w+1);
+    uint64_t* cur = prev + (w+1);
+    uint64_t acc = 0;   // soma da linha até x
+    for (int x = 0; x < w; x++) {
+      acc += squares ? (uint64_t)row[x]*row[x] : row[x];
+      cur[x+1] = prev[x+1] + acc;
+    }
+  }
+  PIXMEM += (unsigned long)w*h;
+  return sum;
+}
+
+// Sum of the integral image I (of a W-wide image) over rectangle (x,y,w,h).
+static inline uint64_t integralRect(const uint64_t* I, int W, int x, int y, int w, int h) {
+  size_t s = (size_t)W + 1;
+  return I[(y+h)*s + x+w] - I[y*s + x+w] - I[(y+h)*s + x] + I[y*s + x];
+}
+
+// SAD search: visits every position and stops accumulating rows of a
+// candidate as soon as its partial sum reaches the best sum so far.
+static void locateBestSAD(Image img1, Image img2, int* px, int* py, double* score) {
+  int w = img2->width;
+  int h = img2->height;
+  unsigned long best = (unsigned long)-1;
+  for (int y = 0; y + h <= img1->height; y++) {
+    for (int x = 0; x + w <= img1->width; x++) {
+      const uint8* a = img1->pixel + (size_t)y*img1->width + x;
+      const uint8* b = img2->pixel;
+      unsigned long sum = 0;
+      int j;
+      for (j = 0; j < h && sum < best; j++) {
+        sum += sadRow(a, b, w);
+        a += img1->width;
+        b += w;
       }
-      // não podemos alterar a imagem original pois isso ia alterar os valores dos pixeis na altura de percorrer o retangulo da "área afetada pelo blur"
-      ImageSetPixel(imgToBlur,j,i,(uint8)media);   // definimos o pixel com o valor da média, na imagem temporaria
-      ATRIB += 1; // atribuição (uint8)media)
+      PIXMEM += (unsigned long)(2*w*j);
+      COMP += 1;
+      if (j == h && sum < best) {
+        best = sum;
+        *px = x;
+        *py = y;
+        if (best == 0) break;   // não há melhor do que isto
+      }
+    }
+    if (best == 0) break;
+  }
+  *score = (double)best;
+}
+
+// Data shared by the spatial and FFT versions of the NCC search.
+// Window sums and sums of squares come from integral images of img1,
+// so only the cross term needs a pass over the pixels.
+typedef struct {
+  Image img1;
+  Image img2;
+  uint64_t* isum;
+  uint64_t* isq;
+  uint64_t tsum;
+  double tvar;   // n * variância do template
+  double n;      // número de pixeis do template
+} NCCSearch;
+
+// n * variance of the window of img1 at (x,y).
+static inline double nccWindowVar(const NCCSearch* s, int x, int y) {
+  int w = s->img2->width;
+  int h = s->img2->height;
+  uint64_t wsum = integralRect(s->isum, s->img1->width, x, y, w, h);
+  uint64_t wsq = integralRect(s->isq, s->img1->width, x, y, w, h);
+  return (double)wsq - (double)wsum*wsum/s->n;
+}
+
+// NCC of the window at (x,y), given its cross term with the template.
+static inline double nccFromCross(const NCCSearch* s, int x, int y, double cross, double wvar) {
+  if (wvar <= 0.0 || s->tvar <= 0.0) {
+    // correlação indefinida: só duas regiões uniformes são semelhantes
+    return (wvar <= 0.0 && s->tvar <= 0.0) ? 1.0 : 0.0;
+  }
+  int w = s->img2->width;
+  int h = s->img2->height;
+  uint64_t wsum = integralRect(s->isum, s->img1->width, x, y, w, h);
+  return (cross - (double)wsum*s->tsum/s->n) / sqrt(wvar*s->tvar);
+}
+
+// Exact NCC of the window at (x,y).
+static double nccAt(const NCCSearch* s, int x, int y) {
+  int w = s->img2->width;
+  int h = s->img2->height;
+  double wvar = nccWindowVar(s, x, y);
+  uint64_t cross = 0;
+  if (wvar > 0.0 && s->tvar > 0.0) {
+    const uint8* a = s->img1->pixel + (size_t)y*s->img1->width + x;
+    for (int j = 0; j < h; j++) {
+      cross += dotRow(a, s->img2->pixel + (size_t)j*w, w);
+      a += s->img1->width;
     }
+    PIXMEM += (unsigned long)(2*w*h);
   }
-  for(int i=0; i<imgToBlur->height; i++){   // percorremos a imagem temporaria
-    for(int j=0; j<imgToBlur->width; j++){
-      ImageSetPixel(img,j,i,ImageGetPixel(imgToBlur,j,i));   // mudamos os valores na imagem original
+  COMP += 1;
+  return nccFromCross(s, x, y, (double)cross, wvar);
+}
+
+// Spatial NCC search over every position.
+static void locateBestNCCSpatial(const NCCSearch* s, int* px, int* py, double* score) {
+  double best = -2.0;
+  for (int y = 0; y + s->img2->height <= s->img1->height; y++) {
+    for (int x = 0; x + s->img2->width <= s->img1->width; x++) {
+      double ncc = nccAt(s, x, y);
+      if (ncc > best) {
+        best = ncc;
+        *px = x;
+        *py = y;
+      }
     }
   }
-  ATRIB += img->height * img->width; // atribuições no loop principal
-  ATRIB += imgToBlur->height * imgToBlur->width; // atribuições no loop ao i e j
-  ImageDestroy(&imgToBlur);  // destruimos a imagem temporaria
+  *score = best;
+}
 
-  InstrPrint();
+// Relative cost of one FFT butterfly operation versus one spatial
+// multiply-accumulate, used to choose between the NCC search methods.
+#define FFT_COST 40.0
+
+// FFT NCC search.
+// The cross terms of all positions come from one correlation in the
+// frequency domain:  corr = IFFT( FFT(img1) * conj(FFT(img2)) ).
+// Rounding errors are bounded by err = FFT_EPS * log2(PQ) * |img1| * |img2|,
+// so every position whose approximate NCC could reach the best one is
+// recomputed exactly (in raster order, as the spatial search does), which
+// yields exactly the same position and score.
+#define FFT_EPS 1e-12
+static int locateBestNCCFFT(const NCCSearch* s, int* px, int* py, double* score) {
+  Image img1 = s->img1;
+  Image img2 = s->img2;
+  int P = FFTSize(img1->width);
+  int Q = FFTSize(img1->height);
+  FFT2D plan = FFT2DCreate(Q, P);
+  long nspec = (plan == NULL) ? 0 : FFT2DSpectrumSize(plan);
+  FFTComplex* spec1 = (plan == NULL) ? NULL : (FFTComplex*)malloc(nspec * sizeof(FFTComplex));
+  FFTComplex* spec2 = (spec1 == NULL) ? NULL : (FFTComplex*)malloc(nspec * sizeof(FFTComplex));
+  double* corr = (spec2 == NULL) ? NULL : (double*)malloc((size_t)P*Q * sizeof(double));
+  int success =
+    check( corr != NULL, "Falha ao alocar memória" ) &&
+    check( FFT2DForward(plan, img1->pixel, img1->width, img1->height, img1->width, spec1) &&
+           FFT2DForward(plan, img2->pixel, img2->width, img2->height, img2->width, spec2),
+           "Falha ao alocar memória" );
+  if (success) {
+    for (long k = 0; k < nspec; k++) {   // spec1 *= conj(spec2)
+      FFTComplex a = spec1[k];
+      FFTComplex b = spec2[k];
+      spec1[k].re = a.re*b.re + a.im*b.im;
+      spec1[k].im = a.im*b.re - a.re*b.im;
+    }
+    success = check( FFT2DInverse(plan, spec1, corr), "Falha ao alocar memória" );
+  }
+  PIXMEM += (unsigned long)img1->width*img1->height + (unsigned long)img2->width*img2->height;
+  if (success) {
+    int nx = img1->width - img2->width + 1;
+    int ny = img1->height - img2->height + 1;
+    double norm1 = sqrt((double)integralRect(s->isq, img1->width, 0, 0, img1->width, img1->height));
+    double norm2 = sqrt(s->tvar + (double)s->tsum*s->tsum/s->n);
+    double err = FFT_EPS * log2((double)P*Q + 1.0) * norm1 * norm2 + 1e-9;
+    // 1ª passagem: maior limite inferior da NCC
+    double lower = -2.0;
+    for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        double wvar = nccWindowVar(s, x, y);
+        double ncc = nccFromCross(s, x, y, corr[(size_t)y*P + x], wvar);
+        double tol = (wvar > 0.0 && s->tvar > 0.0) ? err / sqrt(wvar*s->tvar) : 0.0;
+        if (ncc - tol > lower) lower = ncc - tol;
+      }
+    }
+    // 2ª passagem: confirmação exata dos candidatos
+    double best = -2.0;
+    for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        double wvar = nccWindowVar(s, x, y);
+        double ncc = nccFromCross(s, x, y, corr[(size_t)y*P + x], wvar);
+        double tol = (wvar > 0.0 && s->tvar > 0.0) ? err / sqrt(wvar*s->tvar) : 0.0;
+        if (ncc + tol < lower) continue;
+        ncc = nccAt(s, x, y);
+        if (ncc > best) {
+          best = ncc;
+          *px = x;
+          *py = y;
+        }
+      }
+    }
+    *score = best;
+  }
+  free(corr);
+  free(spec2);
+  free(spec1);
+  FFT2DDestroy(&plan);
+  return success;
+}
+
+// NCC search: chooses the spatial or the FFT method by their estimated
+// cost, (positions * template pixels) versus FFT_COST * PQ * log2(PQ),
+// unless metric forces one of them.
+static int locateBestNCC(Image img1, Image img2, int metric, int* px, int* py, double* score) {
+  NCCSearch s;
+  s.img1 = img1;
+  s.img2 = img2;
+  s.n = (double)img2->width*img2->height;
+  s.isum = integralImage(img1, 0);
+  s.isq = (s.isum == NULL) ? NULL : integralImage(img1, 1);
+  if (s.isq == NULL) {
+    free(s.isum);
+    return 0;
+  }
+  uint64_t tsq = 0;
+  s.tsum = 0;
+  for (size_t i = 0; i < (size_t)img2->width*img2->height; i++) {
+    s.tsum += img2->pixel[i];
+    tsq += (uint64_t)img2->pixel[i]*img2->pixel[i];
+  }
+  s.tvar = (double)tsq - (double)s.tsum*s.tsum/s.n;
+
+  double positions = (double)(img1->width - img2->width + 1) * (img1->height - img2->height + 1);
+  double pq = (double)FFTSize(img1->width) * FFTSize(img1->height);
+  int success = 1;
+  int fft = (metric == MATCH_NCC) ? positions * s.n > FFT_COST * pq * log2(pq + 1.0)
+                                   : metric == MATCH_NCC_FFT;
+  if (fft) {
+    success = locateBestNCCFFT(&s, px, py, score);
+  } else {
+    locateBestNCCSpatial(&s, px, py, score);
+  }
+  free(s.isum);
+  free(s.isq);
+  return success;
+}
+
+/// Find the position where img2 best matches a subimage of img1.
+/// metric selects the similarity measure:
+///   MATCH_SAD : sum of absolute differences (lower is better, 0 is exact);
+///   MATCH_NCC : normalized cross-correlation (higher is better, in [-1, 1]).
+///     Where the window or the template is uniform, the NCC is undefined and
+///     taken as 1 if both are uniform, 0 otherwise.
+/// Every position where img2 fits inside img1 is considered; ties are
+/// resolved in favour of the first position in raster order.
+/// MATCH_NCC_SPATIAL and MATCH_NCC_FFT give the same result as MATCH_NCC,
+/// but always by the spatial or by the FFT method.
+/// On success, returns 1 and sets (*px, *py) to the best position and
+/// *score to its metric value.
+/// If img2 does not fit inside img1, returns 0 and leaves the outputs untouched.
+/// On failure (out of memory), returns 0 and errno/errCause are set accordingly.
+int ImageLocateBest(Image img1, Image img2, int metric, int* px, int* py, double* score) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (MATCH_SAD <= metric && metric <= MATCH_NCC_FFT);
+  assert (px != NULL && py != NULL && score != NULL);
+  if (!check(img2->width <= img1->width && img2->height <= img1->height &&
+             img2->width > 0 && img2->height > 0, "Template does not fit")) {
+    return 0;
+  }
+  if (metric == MATCH_SAD) {
+    locateBestSAD(img1, img2, px, py, score);
+    return 1;
+  }
+  return locateBestNCC(img1, img2, metric, px, py, score);
+}
+
+
+/// Filtering
+
+// ImageBlur keeps, for the current output row y, the sums of each column
+// over the source rows [y-dy, y+dy] (clipped), and slides a horizontal
+// window over these sums, so each output pixel costs a few additions,
+// whatever dx and dy.  Results are written straight into the image: the
+// source rows still needed after being overwritten (the last dy+1) are kept
+// in a ring of row copies.  The image is split in horizontal bands, one per
+// thread; the dy rows above and below each band are saved before any band
+// starts, since they belong to (and are overwritten by) the neighbours.
+
+// Shared state of a blur
+typedef struct {
+  Image img;
+  int dx, dy;
+  int nbands;
+  uint8* margins;     // dy linhas acima e dy abaixo de cada banda
+  uint8* scratch;     // anel de dy+1 linhas e somas das colunas, por banda
+  size_t bandsize;    // bytes de scratch por banda
+} BlurJob;
+
+// Source row r of band [b0, b1), when the output rows before y are written.
+static const uint8* blurSource(const BlurJob* job, const uint8* above, const uint8* below,
+                               const uint8* ring, int b0, int b1, int y, int r) {
+  const int w = job->img->width;
+  if (r < b0) return above + (size_t)(r - (b0 - job->dy))*w;
+  if (r >= b1) return below + (size_t)(r - b1)*w;
+  if (r >= y) return job->img->pixel + (size_t)r*w;
+  return ring + (size_t)(r % (job->dy + 1))*w;
+}
+
+// Blur bands [begin, end)
+static void blurBands(void* arg, int begin, int end) {
+  BlurJob* job = (BlurJob*)arg;
+  const int w = job->img->width, h = job->img->height;
+  const int dx = job->dx, dy = job->dy;
+  for (int b = begin; b < end; b++) {
+    const int b0 = (int)((long)h * b / job->nbands);
+    const int b1 = (int)((long)h * (b+1) / job->nbands);
+    const uint8* above = job->margins + (size_t)b*2*dy*w;
+    const uint8* below = above + (size_t)dy*w;
+    uint8* ring = job->scratch + (size_t)b*job->bandsize;
+    uint32_t* col = (uint32_t*)(ring + (size_t)(dy + 1)*w);
+    memset(col, 0, (size_t)w * sizeof(uint32_t));
+    for (int r = (b0 - dy > 0) ? b0 - dy : 0; r <= b0 + dy && r < h; r++) {
+      const uint8* p = blurSource(job, above, below, ring, b0, b1, b0, r);
+      for (int x = 0; x < w; x++) col[x] += p[x];
+    }
+    for (int y = b0; y < b1; y++) {
+      // a janela desce uma linha: entra y+dy, sai y-dy-1
+      if (y > b0 && y + dy < h) {
+        const uint8* p = blurSource(job, above, below, ring, b0, b1, y, y + dy);
+        for (int x = 0; x < w; x++) col[x] += p[x];
+      }
+      if (y > b0 && y - dy - 1 >= 0) {
+        const uint8* p = blurSource(job, above, below, ring, b0, b1, y, y - dy - 1);
+        for (int x = 0; x < w; x++) col[x] -= p[x];
+      }
+      // a linha y ainda é precisa como origem: guardamos uma cópia no anel
+      uint8* out = job->img->pixel + (size_t)y*w;
+      memcpy(ring + (size_t)(y % (dy + 1))*w, out, w);
+      const int ny = ((y + dy < h) ? y + dy : h - 1) - ((y - dy > 0) ? y - dy : 0) + 1;
+      uint64_t s = 0;
+      for (int x = 0; x < dx && x < w; x++) s += col[x];
+      for (int x = 0; x < w; x++) {
+        if (x + dx < w) s += col[x + dx];
+        if (x - dx - 1 >= 0) s -= col[x - dx - 1];
+        const int nx = ((x + dx < w) ? x + dx : w - 1) - ((x - dx > 0) ? x - dx : 0) + 1;
+        double count = (double)nx * ny;
+        out[x] = (uint8)((double)s / count + 0.5);   // com 0.5 para o arredondamento às unidades
+      }
+    }
+  }
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped at the borders), rounded.
+/// The time per pixel does not depend on dx and dy, and the extra memory is
+/// a few rows per thread (about 3*dy + 5 rows), not a copy of the image.
+/// The image is changed in-place.
+/// On failure (out of memory), img is unchanged and errCause is set.
+void ImageBlur(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  const int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return;
+  // janelas maiores do que a imagem são cortadas de qualquer forma
+  if (dx > w - 1) dx = w - 1;
+  if (dy > h - 1) dy = h - 1;
+  int nbands = ParallelThreads();
+  if (nbands > h / (64 + dy)) nbands = h / (64 + dy);
+  if (nbands < 1) nbands = 1;
+  BlurJob job = { img, dx, dy, nbands, NULL, NULL, 0 };
+  job.bandsize = (size_t)(dy + 1)*w + (size_t)w*sizeof(uint32_t);
+  job.bandsize = (job.bandsize + 7) & ~(size_t)7;   // somas alinhadas
+  job.margins = (uint8*)malloc((size_t)nbands*2*dy*w + 1);
+  job.scratch = (uint8*)malloc((size_t)nbands*job.bandsize);
+  if (check( job.margins != NULL && job.scratch != NULL, "Falha ao alocar memória" )) {
+    pixelsChanged(img);
+    for (int b = 0; b < nbands; b++) {
+      const int b0 = (int)((long)h * b / nbands);
+      const int b1 = (int)((long)h * (b+1) / nbands);
+      uint8* above = job.margins + (size_t)b*2*dy*w;
+      uint8* below = above + (size_t)dy*w;
+      int top = (b0 - dy > 0) ? b0 - dy : 0;
+      int bottom = (b1 + dy < h) ? b1 + dy : h;
+      memcpy(above + (size_t)(top - (b0 - dy))*w, img->pixel + (size_t)top*w, (size_t)(b0 - top)*w);
+      memcpy(below, img->pixel + (size_t)b1*w, (size_t)(bottom - b1)*w);
+    }
+    ParallelFor(nbands, 1, blurBands, &job);
+    // cada pixel de origem entra e sai uma vez das somas, e é escrito uma vez
+    PIXMEM += 3ul * w * h;
+    ATRIB += (unsigned long)w * h;
+  }
+  free(job.margins);
+  free(job.scratch);
 }
 
 /*
@@ -790,3 +3060,2899 @@ void ImageBlur(Image img, int dx, int dy) { ///
 }
 */
 
+
+/// Morphological filters
+
+// Rectangular min (erode) and max (dilate) filters, separable in a
+// horizontal and a vertical pass, each using the van Herk/Gil-Werman
+// algorithm: about 3 min/max per pixel, whatever the window size.
+// Both passes work on sequences of "elements" of several bytes, filtered
+// lane by lane with SIMD: in the vertical pass an element is a strip of
+// a row (MORPH_STRIP columns); in the horizontal pass, the rows are first
+// interleaved in groups of MORPH_ROWS, so that an element is a column of
+// MORPH_ROWS pixels.
+// As in ImageBlur, windows are clipped at the borders: the pixels outside
+// are simply ignored.
+
+#define MORPH_STRIP 256
+#define MORPH_ROWS 16
+
+enum { MORPH_MIN = 0, MORPH_MAX = 1 };
+
+// out = min or max of a and b, lane by lane
+static void lanesOp(uint8* out, const uint8* a, const uint8* b, int lanes, int op) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= lanes; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i r = (op == MORPH_MAX) ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb);
+    _mm_storeu_si128((__m128i*)(out + i), r);
+  }
+#endif
+  for (; i < lanes; i++) {
+    out[i] = (op == MORPH_MAX) ? (a[i] > b[i] ? a[i] : b[i]) : (a[i] < b[i] ? a[i] : b[i]);
+  }
+}
+
+// van Herk/Gil-Werman filter of radius r over n elements of `lanes` bytes,
+// element i at src + i*stride, into dst (same layout; dst may be src).
+// The sequence is padded with r neutral elements at each end, and g and h
+// (scratch space for (n+2r)*lanes bytes each) get the running min/max
+// from the start and from the end of each block of 2r+1 elements.
+static void vhgw(const uint8* src, uint8* dst, size_t stride, int n, int lanes,
+                 int r, int op, uint8* g, uint8* h) {
+  const int k = 2*r + 1;
+  const int len = n + 2*r;
+  const uint8 neutral = (op == MORPH_MAX) ? 0 : PixMax;
+  #define P(i) (src + (size_t)((i) - r)*stride)
+  #define PAD(i) ((i) < r || (i) >= n + r)
+  for (int i = 0; i < len; i++) {
+    uint8* gi = g + (size_t)i*lanes;
+    if (i % k == 0) {
+      if (PAD(i)) memset(gi, neutral, lanes); else memcpy(gi, P(i), lanes);
+    } else if (PAD(i)) {
+      memcpy(gi, gi - lanes, lanes);
+    } else {
+      lanesOp(gi, gi - lanes, P(i), lanes, op);
+    }
+  }
+  for (int i = len - 1; i >= 0; i--) {
+    uint8* hi = h + (size_t)i*lanes;
+    if (i % k == k - 1 || i == len - 1) {
+      if (PAD(i)) memset(hi, neutral, lanes); else memcpy(hi, P(i), lanes);
+    } else if (PAD(i)) {
+      memcpy(hi, hi + lanes, lanes);
+    } else {
+      lanesOp(hi, hi + lanes, P(i), lanes, op);
+    }
+  }
+  #undef P
+  #undef PAD
+  // A janela [x-r, x+r] corresponde a [x, x+2r] na sequência com margens
+  for (int x = 0; x < n; x++) {
+    lanesOp(dst + (size_t)x*stride, h + (size_t)x*lanes, g + (size_t)(x + 2*r)*lanes, lanes, op);
+  }
+}
+
+typedef struct {
+  Image img;
+  int dx, dy;
+  int op;
+  uint8** scratch;      // one scratch buffer per chunk
+  volatile int next;    // next unused scratch buffer
+} MorphJob;
+
+// Scratch bytes needed by one chunk of either pass
+static size_t morphScratch(int w, int h, int dx, int dy) {
+  size_t vert = 2 * (size_t)(h + 2*dy) * MORPH_STRIP;
+  size_t horz = 2 * (size_t)(w + 2*dx) * MORPH_ROWS + (size_t)w * MORPH_ROWS;
+  return vert > horz ? vert : horz;
+}
+
+// Horizontal pass over the groups of MORPH_ROWS rows [begin, end)
+static void morphRows(void* arg, int begin, int end) {
+  MorphJob* job = (MorphJob*)arg;
+  const int w = job->img->width, h = job->img->height;
+  uint8* t = job->scratch[__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)];
+  uint8* g = t + (size_t)w*MORPH_ROWS;
+  uint8* hh = g + (size_t)(w + 2*job->dx)*MORPH_ROWS;
+  for (int b = begin; b < end; b++) {
+    int y0 = b*MORPH_ROWS;
+    int rows = (h - y0 < MORPH_ROWS) ? h - y0 : MORPH_ROWS;
+    uint8* p = job->img->pixel + (size_t)y0*w;
+    // Entrelaçar as linhas: t[x*rows + j] = pixel (x, y0+j)
+    for (int j = 0; j < rows; j++) {
+      for (int x = 0; x < w; x++) t[(size_t)x*rows + j] = p[(size_t)j*w + x];
+    }
+    vhgw(t, t, rows, w, rows, job->dx, job->op, g, hh);
+    for (int j = 0; j < rows; j++) {
+      for (int x = 0; x < w; x++) p[(size_t)j*w + x] = t[(size_t)x*rows + j];
+    }
+  }
+}
+
+// Vertical pass over the strips of MORPH_STRIP columns [begin, end)
+static void morphCols(void* arg, int begin, int end) {
+  MorphJob* job = (MorphJob*)arg;
+  const int w = job->img->width, h = job->img->height;
+  uint8* g = job->scratch[__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)];
+  uint8* hh = g + (size_t)(h + 2*job->dy)*MORPH_STRIP;
+  for (int b = begin; b < end; b++) {
+    int x0 = b*MORPH_STRIP;
+    int lanes = (w - x0 < MORPH_STRIP) ? w - x0 : MORPH_STRIP;
+    uint8* p = job->img->pixel + x0;
+    vhgw(p, p, w, h, lanes, job->dy, job->op, g, hh);
+  }
+}
+
+// Apply the min/max filters ops[0], ops[1], ... in sequence to img.
+// All scratch memory is allocated first, so that img is either filtered
+// completely or (on failure) left unchanged.
+static int morph(Image img, int dx, int dy, const int* ops, int nops) {
+  const int w = img->width, h = img->height;
+  if (w == 0 || h == 0 || (dx == 0 && dy == 0)) return 1;
+  int nthreads = ParallelThreads();
+  size_t size = morphScratch(w, h, dx, dy);
+  uint8* scratch[nthreads];
+  int success = 1;
+  for (int t = 0; t < nthreads; t++) {
+    scratch[t] = success ? (uint8*)malloc(size) : NULL;
+    success = check( scratch[t] != NULL, "Falha ao alocar memória" );
+  }
+  if (success) {
+    pixelsChanged(img);
+    int groups = (h + MORPH_ROWS - 1) / MORPH_ROWS;
+    int strips = (w + MORPH_STRIP - 1) / MORPH_STRIP;
+    for (int i = 0; i < nops; i++) {
+      MorphJob job = { img, dx, dy, ops[i], scratch, 0 };
+      if (dx > 0) ParallelFor(groups, 1, morphRows, &job);
+      job.next = 0;
+      if (dy > 0) ParallelFor(strips, 1, morphCols, &job);
+      // ~3 comparações e ~4 acessos por pixel em cada passagem
+      COMP += 3ul * w * h * ((dx > 0) + (dy > 0));
+      PIXMEM += 4ul * w * h * ((dx > 0) + (dy > 0));
+    }
+  }
+  for (int t = 0; t < nthreads; t++) free(scratch[t]);
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle: each pixel is
+/// substituted by the minimum of the pixels in [x-dx, x+dx]x[y-dy, y+dy]
+/// (clipped at the borders, as in ImageBlur).
+/// The time per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  const int ops[] = { MORPH_MIN };
+  return morph(img, dx, dy, ops, 1);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle: each pixel is
+/// substituted by the maximum of the pixels in [x-dx, x+dx]x[y-dy, y+dy]
+/// (clipped at the borders, as in ImageBlur).
+/// The time per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  const int ops[] = { MORPH_MAX };
+  return morph(img, dx, dy, ops, 1);
+}
+
+/// Morphological opening: erosion followed by dilation with the same
+/// (2dx+1)x(2dy+1) rectangle.  Removes light details smaller than it.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  const int ops[] = { MORPH_MIN, MORPH_MAX };
+  return morph(img, dx, dy, ops, 2);
+}
+
+/// Morphological closing: dilation followed by erosion with the same
+/// (2dx+1)x(2dy+1) rectangle.  Removes dark details smaller than it.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageClose(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  const int ops[] = { MORPH_MAX, MORPH_MIN };
+  return morph(img, dx, dy, ops, 2);
+}
+
+
+/// Paged (out-of-core) images
+
+// A paged image keeps its pixels in a file (raw PGM, or a tiled container
+// for read-only images) and only a bounded number of T x T tiles in memory.
+// Resident tiles are kept in an LRU list: a tile that is needed and not
+// resident replaces the least recently used one (written back if dirty).
+
+// Tile size of paged raw PGM files
+#define PAGED_TILE 256
+
+struct paged {
+  int width;
+  int height;
+  int maxval;
+  int writable;
+  int fd;
+  off_t offset;       // raw: início da matriz de pixeis no ficheiro
+  uint64_t* index;    // tiled: offsets dos tiles no ficheiro (NULL se raw)
+  int tile;           // T
+  long budget;        // bytes de tiles em memória (também o limite das janelas de trabalho)
+  int ntx, nty;       // número de tiles por linha / coluna
+  int* slotOf;        // slotOf[tile] = slot onde está o tile, ou -1
+  int nslots;
+  int* tileOf;        // tileOf[slot] = tile no slot, ou -1
+  uint8* data;        // nslots * T*T bytes
+  uint8* dirty;
+  int* prev;          // lista LRU dos slots (mru = mais recente)
+  int* next;
+  int mru, lru;
+  int failed;         // houve erro de I/O
+};
+
+// Move slot s to the front (most recently used) of the LRU list.
+static void lruTouch(PagedImage p, int s) {
+  if (p->mru == s) return;
+  // retirar da lista
+  if (p->prev[s] >= 0) p->next[p->prev[s]] = p->next[s];
+  if (p->next[s] >= 0) p->prev[p->next[s]] = p->prev[s];
+  if (p->lru == s) p->lru = p->prev[s];
+  // inserir à frente
+  p->prev[s] = -1;
+  p->next[s] = p->mru;
+  if (p->mru >= 0) p->prev[p->mru] = s;
+  p->mru = s;
+  if (p->lru < 0) p->lru = s;
+}
+
+// Dimensions of tile t
+static void pagedTileDims(PagedImage p, int t, int* x0, int* y0, int* tw, int* th) {
+  int T = p->tile;
+  *x0 = (t % p->ntx) * T;
+  *y0 = (t / p->ntx) * T;
+  *tw = (*x0 + T <= p->width) ? T : p->width - *x0;
+  *th = (*y0 + T <= p->height) ? T : p->height - *y0;
+}
+
+// Write back slot s, if dirty.
+static int pagedFlushSlot(PagedImage p, int s) {
+  if (!p->dirty[s]) return 1;
+  int x0, y0, tw, th;
+  pagedTileDims(p, p->tileOf[s], &x0, &y0, &tw, &th);
+  const uint8* buf = p->data + (size_t)s * p->tile * p->tile;
+  for (int y = 0; y < th; y++) {
+    off_t pos = p->offset + (off_t)(y0 + y)*p->width + x0;
+    if (!check(pwrite(p->fd, buf + (size_t)y*tw, tw, pos) == tw, "Writing pixels failed")) {
+      p->failed = 1;
+      return 0;
+    }
+  }
+  p->dirty[s] = 0;
+  return 1;
+}
+
+// Read tile t into slot s.
+static int pagedReadTile(PagedImage p, int t, int s) {
+  int x0, y0, tw, th;
+  pagedTileDims(p, t, &x0, &y0, &tw, &th);
+  uint8* buf = p->data + (size_t)s * p->tile * p->tile;
+  if (p->index != NULL) {
+    size_t bytes = (size_t)(p->index[t+1] - p->index[t]);
+    uint8* in = (bytes <= tileBound((size_t)tw*th)) ? (uint8*)malloc(bytes + 1) : NULL;
+    int ok =
+    check( in != NULL, "Invalid file format" ) &&
+    check( preadAll(p->fd, in, bytes, (off_t)p->index[t]), "Reading pixels" ) &&
+    check( tileDecode(in, bytes, tw, th, buf), "Corrupt tile" );
+    free(in);
+    return ok;
+  }
+  for (int y = 0; y < th; y++) {
+    off_t pos = p->offset + (off_t)(y0 + y)*p->width + x0;
+    if (!check(preadAll(p->fd, buf + (size_t)y*tw, tw, pos), "Reading pixels")) return 0;
+  }
+  return 1;
+}
+
+// Get the buffer of tile (tx, ty), loading it if needed.
+// The buffer is tw x th (see pagedTileDims), row-major, and stays valid
+// until the next call for this paged image.
+// On I/O failure, returns NULL and p->failed is set.
+static uint8* pagedTile(PagedImage p, int tx, int ty, int write) {
+  int t = ty * p->ntx + tx;
+  int s = p->slotOf[t];
+  if (s >= 0) {
+    PGHIT += 1;
+  } else {
+    PGMISS += 1;
+    s = p->lru;   // substituir o tile usado há mais tempo
+    if (p->tileOf[s] >= 0) {
+      if (!pagedFlushSlot(p, s)) return NULL;
+      p->slotOf[p->tileOf[s]] = -1;
+      p->tileOf[s] = -1;
+    }
+    if (!pagedReadTile(p, t, s)) {
+      p->failed = 1;
+      return NULL;
+    }
+    p->tileOf[s] = t;
+    p->slotOf[t] = s;
+  }
+  lruTouch(p, s);
+  if (write) p->dirty[s] = 1;
+  return p->data + (size_t)s * p->tile * p->tile;
+}
+
+// Allocate the cache of a paged image whose geometry is already set.
+static int pagedAlloc(PagedImage p, long budget) {
+  int T = p->tile;
+  p->ntx = (p->width + T - 1) / T;
+  p->nty = (p->height + T - 1) / T;
+  long ntiles = (long)p->ntx * p->nty;
+  long nslots = budget / ((long)T*T);
+  if (nslots < 4) nslots = 4;   // mínimo para as operações com vizinhos
+  p->budget = nslots * T*T;
+  if (nslots > ntiles) nslots = (ntiles > 0) ? ntiles : 1;
+  p->nslots = (int)nslots;
+  p->slotOf = (int*)malloc((ntiles + 1) * sizeof(int));
+  p->tileOf = (int*)malloc(nslots * sizeof(int));
+  p->prev = (int*)malloc(nslots * sizeof(int));
+  p->next = (int*)malloc(nslots * sizeof(int));
+  p->dirty = (uint8*)calloc(nslots, 1);
+  p->data = (uint8*)malloc(nslots * (size_t)T*T);
+  if (!check(p->slotOf != NULL && p->tileOf != NULL && p->prev != NULL &&
+             p->next != NULL && p->dirty != NULL && p->data != NULL, "Falha ao alocar memória")) {
+    return 0;
+  }
+  for (long t = 0; t < ntiles; t++) p->slotOf[t] = -1;
+  for (int s = 0; s < nslots; s++) {
+    p->tileOf[s] = -1;
+    p->prev[s] = s - 1;
+    p->next[s] = (s + 1 < nslots) ? s + 1 : -1;
+  }
+  p->mru = 0;
+  p->lru = (int)nslots - 1;
+  return 1;
+}
+
+static void pagedFree(PagedImage p) {
+  if (p->fd >= 0) close(p->fd);
+  free(p->index);
+  free(p->slotOf);
+  free(p->tileOf);
+  free(p->prev);
+  free(p->next);
+  free(p->dirty);
+  free(p->data);
+  free(p);
+}
+
+/// Open a raw PGM (P5) or tiled container file as a read-only paged image.
+/// At most budget bytes of pixel tiles are kept in memory (at least 4 tiles).
+/// On success, returns the paged image.
+/// (The caller is responsible for closing it with ImagePagedClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PagedImage ImagePagedOpen(const char* filename, long budget) { ///
+  assert (filename != NULL);
+  PagedImage p = (PagedImage)calloc(1, sizeof(*p));
+  if (!check(p != NULL, "Falha ao alocar memória")) return NULL;
+  p->fd = -1;
+  int success = check( (p->fd = open(filename, O_RDONLY)) >= 0, "Open failed" );
+  if (success && isTiled(p->fd)) {
+    success =
+    readTiledHeader(p->fd, &p->width, &p->height, &p->maxval, &p->tile) &&
+    pagedAlloc(p, budget);
+    if (success) {
+      long ntiles = (long)p->ntx * p->nty;
+      uint8* raw = (uint8*)malloc(8 * (ntiles + 1));
+      p->index = (uint64_t*)malloc(8 * (ntiles + 1));
+      success =
+      check( raw != NULL && p->index != NULL, "Falha ao alocar memória" ) &&
+      check( preadAll(p->fd, raw, 8*(ntiles + 1), TILED_HEADER), "Invalid file format" );
+      for (long t = 0; success && t <= ntiles; t++) p->index[t] = get64(raw + 8*t);
+      free(raw);
+    }
+  } else if (success) {
+    PGMHeader hd;
+    success =
+    readHeader(p->fd, &hd, &p->offset) &&
+    check( !hd.plain, "Invalid file format" ) &&
+    (p->width = hd.width, p->height = hd.height, p->maxval = hd.maxval, 1) &&
+    (p->tile = PAGED_TILE, 1) &&
+    pagedAlloc(p, budget);
+  }
+  if (!success) {
+    errsave = errno;
+    pagedFree(p);
+    errno = errsave;
+    return NULL;
+  }
+  return p;
+}
+
+/// Create a new black width x height raw PGM file and open it as a
+/// writable paged image (see ImagePagedOpen).
+/// Changes are written to the file when tiles are evicted from memory and
+/// by ImagePagedClose.
+/// On success, returns the paged image.
+/// (The caller is responsible for closing it with ImagePagedClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PagedImage ImagePagedCreate(const char* filename, int width, int height, uint8 maxval, long budget) { ///
+  assert (filename != NULL);
+  assert (width >= 0 && height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  PagedImage p = (PagedImage)calloc(1, sizeof(*p));
+  if (!check(p != NULL, "Falha ao alocar memória")) return NULL;
+  char head[64];
+  int len = snprintf(head, sizeof(head), "P5\n%d %d\n%u\n", width, height, maxval);
+  p->width = width;
+  p->height = height;
+  p->maxval = maxval;
+  p->writable = 1;
+  p->offset = len;
+  p->tile = PAGED_TILE;
+  p->fd = -1;
+  int success =
+  check( (p->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666)) >= 0, "Open failed" ) &&
+  check( pwrite(p->fd, head, len, 0) == len, "Writing header failed" ) &&
+  // ficheiro esparso: os pixeis ainda não escritos leem-se como 0
+  check( ftruncate(p->fd, (off_t)len + (off_t)width*height) == 0, "Writing pixels failed" ) &&
+  pagedAlloc(p, budget);
+  if (!success) {
+    errsave = errno;
+    pagedFree(p);
+    errno = errsave;
+    return NULL;
+  }
+  return p;
+}
+
+/// Close the paged image pointed to by (*pp), writing back modified tiles.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+/// Returns nonzero on success, or 0 if any I/O error happened while the
+/// image was open (errno/errCause are set).
+int ImagePagedClose(PagedImage* pp) { ///
+  assert (pp != NULL);
+  PagedImage p = *pp;
+  if (p == NULL) return 1;
+  int success = !p->failed;
+  for (int s = 0; s < p->nslots; s++) {
+    if (p->tileOf[s] >= 0) success = pagedFlushSlot(p, s) && success;
+  }
+  errsave = errno;
+  pagedFree(p);
+  errno = errsave;
+  *pp = NULL;
+  return success;
+}
+
+/// Get paged image width
+int ImagePagedWidth(PagedImage p) { ///
+  assert (p != NULL);
+  return p->width;
+}
+
+/// Get paged image height
+int ImagePagedHeight(PagedImage p) { ///
+  assert (p != NULL);
+  return p->height;
+}
+
+/// Get paged image maxval
+int ImagePagedMaxval(PagedImage p) { ///
+  assert (p != NULL);
+  return p->maxval;
+}
+
+/// Get the pixel (level) at position (x,y) of a paged image.
+/// Returns 0 if the tile could not be read (see ImagePagedClose).
+uint8 ImagePagedGetPixel(PagedImage p, int x, int y) { ///
+  assert (p != NULL);
+  assert (0 <= x && x < p->width && 0 <= y && y < p->height);
+  int T = p->tile;
+  const uint8* t = pagedTile(p, x / T, y / T, 0);
+  PIXMEM += 1;
+  if (t == NULL) return 0;
+  int tw = (x - x % T + T <= p->width) ? T : p->width - (x - x % T);
+  return t[(y % T)*tw + x % T];
+}
+
+/// Set the pixel at position (x,y) of a writable paged image.
+void ImagePagedSetPixel(PagedImage p, int x, int y, uint8 level) { ///
+  assert (p != NULL && p->writable);
+  assert (0 <= x && x < p->width && 0 <= y && y < p->height);
+  int T = p->tile;
+  uint8* t = pagedTile(p, x / T, y / T, 1);
+  PIXMEM += 1;
+  if (t == NULL) return;
+  int tw = (x - x % T + T <= p->width) ? T : p->width - (x - x % T);
+  t[(y % T)*tw + x % T] = level;
+}
+
+// Copy the rectangle (x,y,w,h) of p into img at (ix,iy), or the other way
+// round if toPaged, one tile at a time.
+static int pagedCopyRect(PagedImage p, int x, int y, int w, int h,
+                         Image img, int ix, int iy, int toPaged) {
+  int T = p->tile;
+  for (int ty = y / T; ty <= (y + h - 1) / T && h > 0; ty++) {
+    for (int tx = x / T; tx <= (x + w - 1) / T && w > 0; tx++) {
+      uint8* t = pagedTile(p, tx, ty, toPaged);
+      if (t == NULL) return 0;
+      int x0, y0, tw, th;
+      pagedTileDims(p, ty * p->ntx + tx, &x0, &y0, &tw, &th);
+      int ax = (x0 > x) ? x0 : x;
+      int ay = (y0 > y) ? y0 : y;
+      int bx = (x0 + tw < x + w) ? x0 + tw : x + w;
+      int by = (y0 + th < y + h) ? y0 + th : y + h;
+      for (int yy = ay; yy < by; yy++) {
+        uint8* tp = t + (size_t)(yy - y0)*tw + (ax - x0);
+        uint8* ip = img->pixel + (size_t)(iy + yy - y)*img->width + (ix + ax - x);
+        if (toPaged) memcpy(tp, ip, bx - ax);
+        else memcpy(ip, tp, bx - ax);
+      }
+      PIXMEM += (unsigned long)(bx - ax)*(by - ay);
+    }
+  }
+  return 1;
+}
+
+/// Crop a rectangular subimage from a paged image into a new (in-memory)
+/// image.  Only the tiles that intersect the rectangle are loaded.
+/// Requires: the rectangle must be inside p.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImagePagedCrop(PagedImage p, int x, int y, int w, int h) { ///
+  assert (p != NULL);
+  assert (0 <= x && 0 <= y && w >= 0 && h >= 0 && x + w <= p->width && y + h <= p->height);
+  Image img = ImageCreate(w, h, (uint8)p->maxval);
+  if (img == NULL) return NULL;
+  if (!pagedCopyRect(p, x, y, w, h, img, 0, 0, 0)) ImageDestroy(&img);
+  return img;
+}
+
+// Geometric transformations of paged images.
+// Each destination tile is produced from the (at most 4) source tiles that
+// hold its pixels.  The destination tile buffer stays valid while source
+// tiles are loaded, since each paged image has its own cache.
+// rotate == 0: dst(x,y) = src(W-1-x, y)   (mirror)
+// rotate == 1: dst(x,y) = src(W-1-y, x)   (90 degrees anti-clockwise)
+static int pagedTransform(PagedImage src, PagedImage dst, int rotate) {
+  int W = src->width;
+  int S = src->tile;
+  for (int ty = 0; ty < dst->nty; ty++) {
+    for (int tx = 0; tx < dst->ntx; tx++) {
+      int x0, y0, tw, th;
+      pagedTileDims(dst, ty * dst->ntx + tx, &x0, &y0, &tw, &th);
+      uint8* d = pagedTile(dst, tx, ty, 1);
+      if (d == NULL) return 0;
+      // retângulo correspondente na origem: [ax, bx) x [ay, by)
+      int ax = rotate ? W - y0 - th : W - x0 - tw;
+      int bx = rotate ? W - y0 : W - x0;
+      int ay = rotate ? x0 : y0;
+      int by = rotate ? x0 + tw : y0 + th;
+      for (int sty = ay / S; sty <= (by - 1) / S; sty++) {
+        for (int stx = ax / S; stx <= (bx - 1) / S; stx++) {
+          const uint8* t = pagedTile(src, stx, sty, 0);
+          if (t == NULL) return 0;
+          int sx0, sy0, stw, sth;
+          pagedTileDims(src, sty * src->ntx + stx, &sx0, &sy0, &stw, &sth);
+          int cx0 = (sx0 > ax) ? sx0 : ax, cx1 = (sx0 + stw < bx) ? sx0 + stw : bx;
+          int cy0 = (sy0 > ay) ? sy0 : ay, cy1 = (sy0 + sth < by) ? sy0 + sth : by;
+          for (int sy = cy0; sy < cy1; sy++) {
+            const uint8* row = t + (size_t)(sy - sy0)*stw;
+            for (int sx = cx0; sx < cx1; sx++) {
+              int x = rotate ? sy : W - 1 - sx;
+              int y = rotate ? W - 1 - sx : sy;
+              d[(size_t)(y - y0)*tw + (x - x0)] = row[sx - sx0];
+            }
+          }
+          PIXMEM += 2ul*(cx1 - cx0)*(cy1 - cy0);
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/// Mirror a paged image (flip left-right) into dst.
+/// Requires: dst is writable and has the same size as src.
+/// Works one destination tile at a time.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePagedMirror(PagedImage src, PagedImage dst) { ///
+  assert (src != NULL && dst != NULL && dst->writable);
+  assert (src->width == dst->width && src->height == dst->height);
+  return pagedTransform(src, dst, 0);
+}
+
+/// Rotate a paged image 90 degrees anti-clockwise into dst.
+/// Requires: dst is writable and is src->height x src->width.
+/// Works one destination tile at a time.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePagedRotate(PagedImage src, PagedImage dst) { ///
+  assert (src != NULL && dst != NULL && dst->writable);
+  assert (dst->width == src->height && dst->height == src->width);
+  return pagedTransform(src, dst, 1);
+}
+
+// Blocks of work of the paged operations.
+// An operation that needs a margin around each block of output (blur) or
+// of candidate positions (locate) loads the block and its margin, the
+// window, as an in-memory image.  The blocks are the tiles, halved (the
+// larger side first) until the window fits in the budget of the paged
+// image, so memory does not grow with the image width.
+
+// Size bw x bh of the blocks, at most tw x th, whose windows with total
+// margins mx and my fit in budget bytes.
+// Returns 0 if not even a 1 x 1 block fits.
+static int pagedBlock(long budget, int tw, int th, int mx, int my, int* bw, int* bh) {
+  *bw = tw;
+  *bh = th;
+  while ((long)(*bw + mx) * (*bh + my) > budget) {
+    if (*bw == 1 && *bh == 1) return 0;
+    if (*bw >= *bh) *bw = (*bw + 1) / 2;
+    else *bh = (*bh + 1) / 2;
+  }
+  return 1;
+}
+
+/// Blur a paged image with a (2dx+1)x(2dy+1) mean filter into dst
+/// (see ImageBlur).
+/// Requires: dst is writable and has the same size as src.
+/// Works one destination tile at a time: each tile is blurred in memory
+/// with a margin of dx columns and dy rows around it, and split in smaller
+/// blocks if that window does not fit in the memory budget of src.
+/// On success, returns nonzero.
+/// On failure (including a window that does not fit in the budget even
+/// for a single pixel), returns 0 and errno/errCause are set accordingly.
+int ImagePagedBlur(PagedImage src, PagedImage dst, int dx, int dy) { ///
+  assert (src != NULL && dst != NULL && dst->writable);
+  assert (src->width == dst->width && src->height == dst->height);
+  assert (dx >= 0 && dy >= 0);
+  const int W = src->width, H = src->height;
+  if (W == 0 || H == 0) return 1;
+  // janelas maiores do que a imagem são cortadas de qualquer forma
+  if (dx > W - 1) dx = W - 1;
+  if (dy > H - 1) dy = H - 1;
+  int bw, bh;
+  if (!pagedBlock(src->budget, dst->tile, dst->tile, 2*dx, 2*dy, &bw, &bh)) {
+    errno = ENOMEM;
+    return check(0, "Blur window exceeds the memory budget");
+  }
+  for (int ty = 0; ty < dst->nty; ty++) {
+    for (int tx = 0; tx < dst->ntx; tx++) {
+      int x0, y0, tw, th;
+      pagedTileDims(dst, ty * dst->ntx + tx, &x0, &y0, &tw, &th);
+      for (int by = y0; by < y0 + th; by += bh) {
+        for (int bx = x0; bx < x0 + tw; bx += bw) {
+          int w = (bx + bw < x0 + tw) ? bw : x0 + tw - bx;
+          int h = (by + bh < y0 + th) ? bh : y0 + th - by;
+          // as margens dão a cada pixel do bloco a mesma vizinhança que na imagem toda
+          int left = (bx - dx > 0) ? bx - dx : 0;
+          int top = (by - dy > 0) ? by - dy : 0;
+          int right = (bx + w + dx < W) ? bx + w + dx : W;
+          int bottom = (by + h + dy < H) ? by + h + dy : H;
+          Image win = ImagePagedCrop(src, left, top, right - left, bottom - top);
+          if (win == NULL) return 0;
+          ImageBlur(win, dx, dy);
+          // ImageBlur só falha sem memória, e então deixa errCause definido
+          int ok = errCause[0] == '\0' &&
+                   pagedCopyRect(dst, bx, by, w, h, win, bx - left, by - top, 1);
+          ImageDestroy(&win);
+          if (!ok) return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/// Locate a subimage inside a paged image (see ImageLocateSubImage).
+/// Works on blocks of candidate positions whose windows (the block plus
+/// the template size) fit in the memory budget of p, and finds the same
+/// position as ImageLocateSubImage on the whole image.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure (including a template too large for the budget), returns -1
+/// and errno/errCause are set accordingly.
+int ImagePagedLocateSubImage(PagedImage p, int* px, int* py, Image img2) { ///
+  assert (p != NULL);
+  assert (img2 != NULL);
+  const int w = img2->width, h = img2->height;
+  // mesmas posições candidatas que ImageLocateSubImage: x <= W - w, y <= H - h
+  const int nx = p->width - w + 1, ny = p->height - h + 1;
+  if (nx <= 0 || ny <= 0) return 0;
+  // Cada janela tem w-1 colunas e h-1 linhas a mais do que as posições que cobre.
+  int bw, bh;
+  if (!pagedBlock(p->budget, p->tile, p->tile, w - 1, h - 1, &bw, &bh)) {
+    errno = ENOMEM;
+    check(0, "Template exceeds the memory budget");
+    return -1;
+  }
+  for (int y0 = 0; y0 < ny; y0 += bh) {
+    int y1 = (y0 + bh < ny) ? y0 + bh : ny;   // linhas candidatas [y0, y1)
+    int found = 0, fx = 0, fy = 0;
+    for (int x0 = 0; x0 < nx; x0 += bw) {
+      int x1 = (x0 + bw < nx) ? x0 + bw : nx;
+      Image win = ImagePagedCrop(p, x0, y0, x1 - x0 + w - 1, y1 - y0 + h - 1);
+      if (win == NULL) return -1;
+      int x, y;
+      // a primeira posição de cada bloco; a da faixa é a de menor (y, x)
+      if (ImageLocateSubImage(win, &x, &y, img2) && (!found || y0 + y < fy)) {
+        found = 1;
+        fx = x0 + x;
+        fy = y0 + y;
+        y1 = fy + 1;   // os blocos seguintes só interessam até à linha fy
+      }
+      ImageDestroy(&win);
+    }
+    if (found) {
+      if (px != NULL) *px = fx;
+      if (py != NULL) *py = fy;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/// Run-length encoded binary images
+
+// A binary image (each pixel black = 0 or white = maxval) is stored as the
+// list of its white runs, row by row: run[2k], run[2k+1] are the columns
+// [x0, x1) of the k-th run, and the runs of row y are k = row[y] ..
+// row[y+1]-1, sorted and separated by at least one black pixel.
+// All operations work on the runs: their cost depends on the number of
+// runs (the number of black/white transitions), not on the number of pixels.
+
+struct rle {
+  int width;
+  int height;
+  int maxval;
+  long* row;   // height+1 índices de run
+  int* run;    // 2 inteiros por run
+};
+
+// Growable list of runs, built row by row.
+typedef struct {
+  int* run;
+  long n;      // número de runs
+  long cap;
+  long first;  // primeiro run da linha em construção
+} RunBuf;
+
+// Append run [x0, x1) to the current row of b, merging it with the
+// previous run of the row if they touch.  Empty runs are ignored.
+// Returns 0 on failure (out of memory).
+static int runPush(RunBuf* b, int x0, int x1) {
+  if (x0 >= x1) return 1;
+  if (b->n > b->first && b->run[2*b->n - 1] == x0) {
+    b->run[2*b->n - 1] = x1;
+    return 1;
+  }
+  if (b->n == b->cap) {
+    long cap = b->cap < 256 ? 256 : 2*b->cap;
+    int* run = (int*)realloc(b->run, 2*sizeof(int)*cap);
+    if (run == NULL) return 0;
+    b->run = run;
+    b->cap = cap;
+  }
+  b->run[2*b->n] = x0;
+  b->run[2*b->n + 1] = x1;
+  b->n++;
+  return 1;
+}
+
+// Allocate an RLE image with no runs yet (row is left for the caller).
+static RLEImage rleAlloc(int width, int height, int maxval) {
+  RLEImage r = (RLEImage)malloc(sizeof(*r));
+  if (!check(r != NULL, "Falha ao alocar memória")) return NULL;
+  r->width = width;
+  r->height = height;
+  r->maxval = maxval;
+  r->run = NULL;
+  r->row = (long*)malloc(sizeof(long)*(height + 1));
+  if (!check(r->row != NULL, "Falha ao alocar memória")) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Give the runs built in b to r, shrinking the list to fit.
+static void rleTake(RLEImage r, RunBuf* b) {
+  int* run = (b->n > 0) ? (int*)realloc(b->run, 2*sizeof(int)*b->n) : NULL;
+  if (b->n == 0) free(b->run);
+  r->run = (run != NULL || b->n == 0) ? run : b->run;
+  b->run = NULL;
+}
+
+// First position >= x in p[0..w) whose class (level >= thr) differs from
+// white (0 or 1), or w if there is none.
+static int nextChange(const uint8* p, int x, int w, uint8 thr, int white) {
+#ifdef __SSE2__
+  const __m128i vthr = _mm_set1_epi8((char)thr);
+  const int flip = white ? 0xFFFF : 0;
+  for (; x + 16 <= w; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + x));
+    // v >= thr  <=>  max(v, thr) == v
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, vthr), v)) ^ flip;
+    if (m != 0) return x + __builtin_ctz(m);
+  }
+#endif
+  while (x < w && (p[x] >= thr) == white) x++;
+  return x;
+}
+
+typedef struct {
+  Image img;
+  uint8 thr;
+  long* count;          // count[y+1] = número de runs da linha y
+  RunBuf* buf;          // uma lista de runs por chunk
+  int* first;           // primeira linha do chunk de cada lista
+  volatile int next;    // próxima lista livre
+  volatile int failed;
+} ThresholdJob;
+
+// Threshold rows [begin, end) straight into a list of runs
+static void thresholdRows(void* arg, int begin, int end) {
+  ThresholdJob* job = (ThresholdJob*)arg;
+  const int w = job->img->width;
+  int slot = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+  RunBuf* b = &job->buf[slot];
+  job->first[slot] = begin;
+  for (int y = begin; y < end && !job->failed; y++) {
+    const uint8* p = job->img->pixel + (size_t)y*w;
+    b->first = b->n;
+    for (int x = nextChange(p, 0, w, job->thr, 0); x < w; ) {
+      int x1 = nextChange(p, x, w, job->thr, 1);
+      if (!runPush(b, x, x1)) { job->failed = 1; return; }
+      x = nextChange(p, x1, w, job->thr, 0);
+    }
+    job->count[y + 1] = b->n - b->first;
+  }
+}
+
+/// Threshold an image into a run-length encoded binary image, in a single
+/// pass over the pixels (see ImageThreshold): pixels with level>=thr become
+/// white runs, the others black.  Rows are encoded in parallel.
+/// The original img is not modified.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying it with ImageRLEDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage ImageRLEThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  const int h = img->height;
+  RLEImage r = rleAlloc(img->width, h, img->maxval);
+  if (r == NULL) return NULL;
+  const int nthreads = ParallelThreads();
+  ThresholdJob job = { img, thr, r->row, NULL, NULL, 0, 0 };
+  job.buf = (RunBuf*)calloc(nthreads, sizeof(RunBuf));
+  job.first = (int*)malloc(sizeof(int)*nthreads);
+  if (check(job.buf != NULL && job.first != NULL, "Falha ao alocar memória")) {
+    r->row[0] = 0;
+    ParallelFor(h, 64, thresholdRows, &job);
+    PIXMEM += (unsigned long)img->width*h;
+    job.failed = !check(!job.failed, "Falha ao alocar memória");
+  } else {
+    job.failed = 1;
+  }
+  if (!job.failed) {
+    for (int y = 0; y < h; y++) r->row[y + 1] += r->row[y];
+    int nbufs = job.next;
+    if (nbufs == 1) {
+      rleTake(r, &job.buf[0]);
+    } else if (nbufs > 1) {
+      // Juntar as listas dos chunks, pela ordem das linhas
+      long n = r->row[h];
+      r->run = (int*)malloc(2*sizeof(int)*(n > 0 ? n : 1));
+      if (check(r->run != NULL, "Falha ao alocar memória")) {
+        for (int s = 0; s < nbufs; s++) {
+          memcpy(r->run + 2*r->row[job.first[s]], job.buf[s].run, 2*sizeof(int)*job.buf[s].n);
+        }
+      } else {
+        job.failed = 1;
+      }
+    }
+  }
+  errsave = errno;
+  if (job.buf != NULL) {
+    for (int s = 0; s < nthreads; s++) free(job.buf[s].run);
+  }
+  free(job.buf);
+  free(job.first);
+  if (job.failed) ImageRLEDestroy(&r);
+  errno = errsave;
+  return r;
+}
+
+/// Destroy the RLE image pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void ImageRLEDestroy(RLEImage* rp) { ///
+  assert (rp != NULL);
+  if (*rp == NULL) return;
+  free((*rp)->row);
+  free((*rp)->run);
+  free(*rp);
+  *rp = NULL;
+}
+
+/// Get RLE image width
+int ImageRLEWidth(RLEImage r) { ///
+  assert (r != NULL);
+  return r->width;
+}
+
+/// Get RLE image height
+int ImageRLEHeight(RLEImage r) { ///
+  assert (r != NULL);
+  return r->height;
+}
+
+/// Get the number of white runs in an RLE image.
+long ImageRLERuns(RLEImage r) { ///
+  assert (r != NULL);
+  return r->row[r->height];
+}
+
+// Expand row y of r into w bytes of pixels
+static void rleDecodeRow(RLEImage r, int y, uint8* p) {
+  memset(p, 0, r->width);
+  for (long k = r->row[y]; k < r->row[y + 1]; k++) {
+    memset(p + r->run[2*k], r->maxval, r->run[2*k + 1] - r->run[2*k]);
+  }
+}
+
+/// Convert an RLE image back to an ordinary image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRLEDecode(RLEImage r) { ///
+  assert (r != NULL);
+  Image img = ImageCreate(r->width, r->height, (uint8)r->maxval);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < r->height; y++) rleDecodeRow(r, y, img->pixel + (size_t)y*r->width);
+  PIXMEM += (unsigned long)r->width*r->height;
+  return img;
+}
+
+/// Save an RLE image to a raw PGM file.
+/// The pixels are expanded one row at a time, as they are written.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageRLESave(RLEImage r, const char* filename) { ///
+  assert (r != NULL);
+  assert (filename != NULL);
+  const int w = r->width;
+  FILE* f = NULL;
+  uint8* p = (uint8*)malloc(w > 0 ? w : 1);
+
+  int success =
+  check( p != NULL, "Falha ao alocar memória" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, r->height, r->maxval) > 0, "Writing header failed" );
+  for (int y = 0; success && y < r->height; y++) {
+    rleDecodeRow(r, y, p);
+    success = check( fwrite(p, sizeof(uint8), w, f) == (size_t)w, "Writing pixels failed" );
+  }
+  PIXMEM += (unsigned long)w*r->height;
+
+  // Cleanup
+  errsave = errno;
+  free(p);
+  if (f != NULL) success = check( fclose(f) == 0, "Writing pixels failed" ) && success;
+  errno = errsave;
+  return success;
+}
+
+/// Transform an RLE image to its negative, in-place: the runs become the
+/// gaps between them.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, r is unchanged and errCause is set.
+int ImageRLENegative(RLEImage r) { ///
+  assert (r != NULL);
+  RunBuf b = { NULL, 0, 0, 0 };
+  long* row = (long*)malloc(sizeof(long)*(r->height + 1));
+  int success = check( row != NULL, "Falha ao alocar memória" );
+  if (success) row[0] = 0;
+  for (int y = 0; success && y < r->height; y++) {
+    b.first = b.n;
+    int x = 0;
+    for (long k = r->row[y]; success && k < r->row[y + 1]; k++) {
+      success = runPush(&b, x, r->run[2*k]);
+      x = r->run[2*k + 1];
+    }
+    success = success && runPush(&b, x, r->width);
+    row[y + 1] = b.n;
+    COMP += (unsigned long)(r->row[y + 1] - r->row[y]);
+  }
+  if (!check(success, "Falha ao alocar memória")) {
+    free(row);
+    free(b.run);
+    return 0;
+  }
+  free(r->row);
+  free(r->run);
+  r->row = row;
+  rleTake(r, &b);
+  return 1;
+}
+
+// Index of the first run of row y that ends after column x
+static long rleFind(RLEImage r, int y, int x) {
+  long lo = r->row[y], hi = r->row[y + 1];
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if (r->run[2*mid + 1] <= x) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/// Paste an RLE image into a larger one.
+/// Paste r2 into position (x, y) of r1, in-place (see ImagePaste).
+/// Requires: r2 must fit inside r1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, r1 is unchanged and errCause is set.
+int ImageRLEPaste(RLEImage r1, int x, int y, RLEImage r2) { ///
+  assert (r1 != NULL);
+  assert (r2 != NULL);
+  assert (0 <= x && 0 <= y && x + r2->width <= r1->width && y + r2->height <= r1->height);
+  const int xe = x + r2->width;
+  RunBuf b = { NULL, 0, 0, 0 };
+  long* row = (long*)malloc(sizeof(long)*(r1->height + 1));
+  int success = check( row != NULL, "Falha ao alocar memória" );
+  if (success) row[0] = 0;
+  for (int j = 0; success && j < r1->height; j++) {
+    b.first = b.n;
+    long k = r1->row[j], end = r1->row[j + 1];
+    if (y <= j && j < y + r2->height) {
+      // runs de r1 à esquerda da janela, depois os de r2, depois os da direita
+      for (; success && k < end && r1->run[2*k] < x; k++) {
+        int x1 = r1->run[2*k + 1];
+        success = runPush(&b, r1->run[2*k], x1 < x ? x1 : x);
+      }
+      for (long i = r2->row[j - y]; success && i < r2->row[j - y + 1]; i++) {
+        success = runPush(&b, x + r2->run[2*i], x + r2->run[2*i + 1]);
+      }
+      for (k = rleFind(r1, j, xe); success && k < end; k++) {
+        int x0 = r1->run[2*k];
+        success = runPush(&b, x0 > xe ? x0 : xe, r1->run[2*k + 1]);
+      }
+      COMP += (unsigned long)(end - r1->row[j] + r2->row[j - y + 1] - r2->row[j - y]);
+    } else {
+      for (; success && k < end; k++) success = runPush(&b, r1->run[2*k], r1->run[2*k + 1]);
+    }
+    row[j + 1] = b.n;
+  }
+  if (!check(success, "Falha ao alocar memória")) {
+    free(row);
+    free(b.run);
+    return 0;
+  }
+  free(r1->row);
+  free(r1->run);
+  r1->row = row;
+  rleTake(r1, &b);
+  return 1;
+}
+
+/// Crop a rectangular subimage from an RLE image (see ImageCrop).
+/// Requires: the rectangle must be inside r.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying it with ImageRLEDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage ImageRLECrop(RLEImage r, int x, int y, int w, int h) { ///
+  assert (r != NULL);
+  assert (0 <= x && 0 <= y && w >= 0 && h >= 0 && x + w <= r->width && y + h <= r->height);
+  RLEImage c = rleAlloc(w, h, r->maxval);
+  if (c == NULL) return NULL;
+  RunBuf b = { NULL, 0, 0, 0 };
+  int success = 1;
+  c->row[0] = 0;
+  for (int j = 0; success && j < h; j++) {
+    b.first = b.n;
+    for (long k = rleFind(r, y + j, x); success && k < r->row[y + j + 1] && r->run[2*k] < x + w; k++) {
+      int x0 = r->run[2*k], x1 = r->run[2*k + 1];
+      success = runPush(&b, (x0 > x ? x0 : x) - x, (x1 < x + w ? x1 : x + w) - x);
+    }
+    c->row[j + 1] = b.n;
+  }
+  if (!check(success, "Falha ao alocar memória")) {
+    free(b.run);
+    ImageRLEDestroy(&c);
+    return NULL;
+  }
+  rleTake(c, &b);
+  return c;
+}
+
+// Compare row j2 of r2 to the runs of row j1 of r1 clipped to [x, x+w2).
+static int rleMatchRow(RLEImage r1, int x, int j1, RLEImage r2, int j2) {
+  const int xe = x + r2->width;
+  long i = r2->row[j2], iend = r2->row[j2 + 1];
+  for (long k = rleFind(r1, j1, x); k < r1->row[j1 + 1] && r1->run[2*k] < xe; k++, i++) {
+    int x0 = r1->run[2*k], x1 = r1->run[2*k + 1];
+    COMP += 1;
+    if (i == iend || (x0 > x ? x0 : x) - x != r2->run[2*i] ||
+        (x1 < xe ? x1 : xe) - x != r2->run[2*i + 1]) return 0;
+  }
+  return i == iend;
+}
+
+/// Compare an RLE image to a subimage of a larger RLE image, by comparing
+/// their runs (see ImageMatchSubImage).  Only the black/white pattern is
+/// compared (not maxval).
+/// Returns 1 (true) if r2 matches subimage of r1 at pos (x, y).
+/// Returns 0, otherwise.
+int ImageRLEMatchSubImage(RLEImage r1, int x, int y, RLEImage r2) { ///
+  assert (r1 != NULL);
+  assert (r2 != NULL);
+  assert (0 <= x && 0 <= y && x + r2->width <= r1->width && y + r2->height <= r1->height);
+  if (r2->width == 0) return 1;
+  for (int j = 0; j < r2->height; j++) {
+    if (!rleMatchRow(r1, x, y + j, r2, j)) return 0;
+  }
+  return 1;
+}
+
+// Positions [lo, hi] where a window of w pixels of row y of r is all of
+// one color (white or black), stored in iv; returns their number.
+// iv must have room for the runs of the row + 1 intervals.
+static long rleUniform(RLEImage r, int y, int w, int white, int* iv) {
+  long n = 0;
+  int gap = 0;   // início do intervalo preto corrente
+  for (long k = r->row[y]; k < r->row[y + 1]; k++) {
+    int x0 = r->run[2*k], x1 = r->run[2*k + 1];
+    int a = white ? x0 : gap;
+    int e = white ? x1 : x0;
+    if (e - a >= w) { iv[2*n] = a; iv[2*n + 1] = e - w; n++; }
+    gap = x1;
+  }
+  if (!white && r->width - gap >= w) { iv[2*n] = gap; iv[2*n + 1] = r->width - w; n++; }
+  return n;
+}
+
+// Locate a template whose rows are all uniform (no transition inside):
+// for each y, intersect the sets of positions where each row matches.
+// Returns 1 if found, 0 if not, -1 on failure (out of memory).
+static int rleLocateUniform(RLEImage r1, int* px, int* py, RLEImage r2) {
+  const int w2 = r2->width, h2 = r2->height;
+  long maxruns = 0;
+  for (int y = 0; y < r1->height; y++) {
+    long n = r1->row[y + 1] - r1->row[y];
+    if (n > maxruns) maxruns = n;
+  }
+  int* mem = (int*)malloc(3 * 2*sizeof(int)*(maxruns + 2));
+  if (!check(mem != NULL, "Falha ao alocar memória")) return -1;
+  int* a = mem;
+  int* b = a + 2*(maxruns + 2);
+  int* c = b + 2*(maxruns + 2);
+  int found = 0;
+  for (int y = 0; y <= r1->height - h2 && !found; y++) {
+    // mesmas posições candidatas que ImageLocateSubImage: x <= width - w2
+    long na = 1;
+    a[0] = 0;
+    a[1] = r1->width - w2;
+    for (int j = 0; j < h2 && na > 0 && w2 > 0; j++) {
+      int white = r2->row[j + 1] > r2->row[j];
+      long nb = rleUniform(r1, y + j, w2, white, b);
+      // interseção das listas ordenadas a e b
+      long nc = 0;
+      for (long i = 0, k = 0; i < na && k < nb; ) {
+        int lo = a[2*i] > b[2*k] ? a[2*i] : b[2*k];
+        int hi = a[2*i + 1] < b[2*k + 1] ? a[2*i + 1] : b[2*k + 1];
+        if (lo <= hi) { c[2*nc] = lo; c[2*nc + 1] = hi; nc++; }
+        if (a[2*i + 1] < b[2*k + 1]) i++; else k++;
+        COMP += 1;
+      }
+      int* t = a; a = c; c = t;
+      na = nc;
+    }
+    if (na > 0 && a[0] <= a[1]) {
+      if (px != NULL) *px = a[0];
+      if (py != NULL) *py = y;
+      found = 1;
+    }
+  }
+  free(mem);
+  return found;
+}
+
+/// Locate an RLE subimage inside a larger RLE image (see
+/// ImageLocateSubImage): the first matching position, in raster order, is
+/// found.  Only the black/white pattern is compared (not maxval).
+/// Candidates are taken from the runs: a transition of the template can only
+/// fall on a transition of the same kind in r1, so each row of r1 is tried
+/// at a few positions only.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageRLELocateSubImage(RLEImage r1, int* px, int* py, RLEImage r2) { ///
+  assert (r1 != NULL);
+  assert (r2 != NULL);
+  const int w2 = r2->width, h2 = r2->height;
+  // Procurar uma transição no interior do template: posição b na linha jt,
+  // subida (início de run) ou descida (fim de run)
+  int jt = -1, b = 0, rise = 0;
+  for (int j = 0; j < h2 && jt < 0; j++) {
+    long k = r2->row[j];
+    if (k == r2->row[j + 1]) continue;
+    if (r2->run[2*k] > 0) { jt = j; b = r2->run[2*k]; rise = 1; }
+    else if (r2->run[2*k + 1] < w2) { jt = j; b = r2->run[2*k + 1]; rise = 0; }
+  }
+  if (jt < 0) return rleLocateUniform(r1, px, py, r2);
+  for (int y = 0; y <= r1->height - h2; y++) {
+    const int yt = y + jt;
+    for (long k = r1->row[yt]; k < r1->row[yt + 1]; k++) {
+      int x = r1->run[2*k + !rise] - b;
+      if (x < 0) continue;
+      if (x > r1->width - w2) break;
+      if (ImageRLEMatchSubImage(r1, x, y, r2)) {
+        if (px != NULL) *px = x;
+        if (py != NULL) *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/// Bit-packed binary images
+
+// A bitmap stores one bit per pixel (1 = white = maxval, 0 = black), 64
+// pixels per word: pixel x of a row is bit x%64 of word x/64, so the
+// leftmost pixel is the least significant bit.  Each row starts on a new
+// word, and the padding bits after the last pixel of a row are always 0.
+
+struct bitmap {
+  int width;
+  int height;
+  int maxval;
+  int stride;        // palavras por linha
+  uint64_t* bits;
+};
+
+// Bits of the last word of a row that hold pixels
+static uint64_t bitLastMask(int width) {
+  return (width % 64 == 0) ? ~(uint64_t)0 : ((uint64_t)1 << (width % 64)) - 1;
+}
+
+// Allocate a bitmap with all pixels black.
+static BitImage bitAlloc(int width, int height, int maxval) {
+  BitImage b = (BitImage)malloc(sizeof(*b));
+  if (!check(b != NULL, "Falha ao alocar memória")) return NULL;
+  b->width = width;
+  b->height = height;
+  b->maxval = maxval;
+  b->stride = (width + 63) / 64;
+  b->bits = (uint64_t*)calloc((size_t)b->stride*height + 1, sizeof(uint64_t));
+  if (!check(b->bits != NULL, "Falha ao alocar memória")) {
+    free(b);
+    return NULL;
+  }
+  return b;
+}
+
+typedef struct {
+  Image img;
+  uint8 thr;
+  BitImage b;
+} BitThresholdJob;
+
+// Threshold rows [begin, end) into bits, 16 pixels per movemask
+static void bitThresholdRows(void* arg, int begin, int end) {
+  BitThresholdJob* job = (BitThresholdJob*)arg;
+  const int w = job->img->width;
+  const uint8 thr = job->thr;
+  for (int y = begin; y < end; y++) {
+    const uint8* p = job->img->pixel + (size_t)y*w;
+    uint64_t* row = job->b->bits + (size_t)y*job->b->stride;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i vthr = _mm_set1_epi8((char)thr);
+    for (; x + 64 <= w; x += 64) {
+      uint64_t word = 0;
+      for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + x + 16*i));
+        // v >= thr  <=>  max(v, thr) == v
+        uint64_t m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, vthr), v));
+        word |= m << (16*i);
+      }
+      row[x / 64] = word;
+    }
+#endif
+    for (; x < w; x++) {
+      if (p[x] >= thr) row[x / 64] |= (uint64_t)1 << (x % 64);
+    }
+  }
+}
+
+/// Threshold an image into a bit-packed binary image (see ImageThreshold):
+/// pixels with level>=thr become white, the others black.
+/// The original img is not modified.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying it with ImageBitDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageBitThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  BitImage b = bitAlloc(img->width, img->height, img->maxval);
+  if (b == NULL) return NULL;
+  BitThresholdJob job = { img, thr, b };
+  ParallelFor(img->height, 64, bitThresholdRows, &job);
+  PIXMEM += (unsigned long)img->width*img->height;
+  return b;
+}
+
+/// Destroy the bitmap pointed to by (*bp).
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+void ImageBitDestroy(BitImage* bp) { ///
+  assert (bp != NULL);
+  if (*bp == NULL) return;
+  free((*bp)->bits);
+  free(*bp);
+  *bp = NULL;
+}
+
+/// Get bitmap width
+int ImageBitWidth(BitImage b) { ///
+  assert (b != NULL);
+  return b->width;
+}
+
+/// Get bitmap height
+int ImageBitHeight(BitImage b) { ///
+  assert (b != NULL);
+  return b->height;
+}
+
+/// Convert a bitmap back to an ordinary image (white pixels get maxval).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBitDecode(BitImage b) { ///
+  assert (b != NULL);
+  Image img = ImageCreate(b->width, b->height, (uint8)b->maxval);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < b->height; y++) {
+    const uint64_t* row = b->bits + (size_t)y*b->stride;
+    uint8* p = img->pixel + (size_t)y*b->width;
+    for (int x = 0; x < b->width; x++) p[x] = ((row[x / 64] >> (x % 64)) & 1) ? (uint8)b->maxval : 0;
+  }
+  PIXMEM += (unsigned long)b->width*b->height;
+  return img;
+}
+
+// 64 pixels of row starting at pixel x (bits past the row's words are 0).
+static inline uint64_t bitGet64(const uint64_t* row, int nwords, int x) {
+  int q = x / 64, s = x % 64;
+  uint64_t lo = (q < nwords) ? row[q] : 0;
+  if (s == 0) return lo;
+  uint64_t hi = (q + 1 < nwords) ? row[q + 1] : 0;
+  return (lo >> s) | (hi << (64 - s));
+}
+
+// Number of differing pixels between b2 and the subimage of b1 at (x, y),
+// or a number > tol as soon as that much is reached.
+static long bitDistance(BitImage b1, int x, int y, BitImage b2, long tol) {
+  const uint64_t last = bitLastMask(b2->width);
+  long dist = 0;
+  for (int j = 0; j < b2->height; j++) {
+    const uint64_t* r1 = b1->bits + (size_t)(y + j)*b1->stride;
+    const uint64_t* r2 = b2->bits + (size_t)j*b2->stride;
+    for (int i = 0; i < b2->stride; i++) {
+      uint64_t d = bitGet64(r1, b1->stride, x + 64*i) ^ r2[i];
+      if (i == b2->stride - 1) d &= last;
+      dist += __builtin_popcountll(d);
+    }
+    COMP += (unsigned long)b2->stride;
+    if (dist > tol) break;
+  }
+  return dist;
+}
+
+/// Compare a bitmap to a subimage of a larger bitmap, 64 pixels at a time
+/// (shift, xor and popcount).  Only the black/white pattern is compared
+/// (not maxval).
+/// Returns 1 (true) if at most tol pixels of b2 differ from the subimage
+/// of b1 at pos (x, y) (tol = 0 requires an exact match).
+/// Returns 0, otherwise.
+int ImageBitMatchSubImage(BitImage b1, int x, int y, BitImage b2, long tol) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (0 <= x && 0 <= y && x + b2->width <= b1->width && y + b2->height <= b1->height);
+  assert (tol >= 0);
+  return bitDistance(b1, x, y, b2, tol) <= tol;
+}
+
+// Test the 64 candidate positions (x0 + l, y), l = 0..63, at once: bit l of
+// a word of b1 read at pixel x0 + i is pixel i of the window at x0 + l.
+// The mismatches of each position are counted in bit-sliced counters
+// (plane k holds bit k of the 64 counts), started at 2^nb - 1 - tol, so
+// that a count overflows exactly when it exceeds tol.
+// Returns the mask of positions (among valid) that match.
+static uint64_t bitLocateLanes(BitImage b1, int x0, int y, BitImage b2, long tol, uint64_t valid) {
+  int nb = 0;
+  while (nb < 62 && ((long)1 << nb) - 1 < tol) nb++;
+  const long bias = ((long)1 << nb) - 1 - tol;
+  uint64_t c[62];
+  for (int k = 0; k < nb; k++) c[k] = ((bias >> k) & 1) ? ~(uint64_t)0 : 0;
+  uint64_t over = ~valid;    // posições já rejeitadas
+  for (int j = 0; j < b2->height; j++) {
+    const uint64_t* r1 = b1->bits + (size_t)(y + j)*b1->stride;
+    const uint64_t* r2 = b2->bits + (size_t)j*b2->stride;
+    for (int i = 0; i < b2->width; i++) {
+      uint64_t v = bitGet64(r1, b1->stride, x0 + i);
+      uint64_t carry = ((r2[i / 64] >> (i % 64)) & 1) ? ~v : v;
+      for (int k = 0; k < nb && carry != 0; k++) {
+        uint64_t t = c[k] & carry;
+        c[k] ^= carry;
+        carry = t;
+      }
+      over |= carry;
+      if (over == ~(uint64_t)0) {
+        COMP += (unsigned long)j*b2->width + i + 1;
+        return 0;
+      }
+    }
+  }
+  COMP += (unsigned long)b2->width*b2->height;
+  return ~over;
+}
+
+/// Locate a subimage inside a larger bitmap (see ImageLocateSubImage),
+/// allowing up to tol differing pixels (see ImageBitMatchSubImage).
+/// The first matching position, in raster order, is found.
+/// 64 candidate positions of a row are tested together, one template pixel
+/// at a time, until all of them have more than tol differences.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageBitLocateSubImage(BitImage b1, int* px, int* py, BitImage b2, long tol) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (tol >= 0);
+  // mesmas posições candidatas que ImageLocateSubImage: x <= width - w2
+  const int xmax = b1->width - b2->width + 1;
+  for (int y = 0; y <= b1->height - b2->height; y++) {
+    for (int x0 = 0; x0 < xmax; x0 += 64) {
+      uint64_t valid = (xmax - x0 >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << (xmax - x0)) - 1;
+      uint64_t m = bitLocateLanes(b1, x0, y, b2, tol, valid);
+      if (m != 0) {
+        if (px != NULL) *px = x0 + __builtin_ctzll(m);
+        if (py != NULL) *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Bitwise morphology.
+// A dilation by [x-r, x+r] is the OR of a forward window F[x] = OR of
+// [x, x+r] and a backward window B[x] = OR of [x-r, x]; each is computed
+// in about log2(r) steps by doubling: after a step of length len,
+// A[x] |= A[x+len] (forward) covers twice as many pixels.  Pixels outside
+// the image read as 0, which clips the windows at the borders (as in
+// ImageBlur).  Erosion is the complement of the dilation of the complement.
+
+// row |= row shifted so that pixel x gets pixel x+k (k > 0: forward)
+// or pixel x-k (k < 0: backward), in place.
+static void bitOrShift(uint64_t* row, int nwords, int k) {
+  if (k > 0) {
+    for (int i = 0; i < nwords; i++) row[i] |= bitGet64(row, nwords, 64*i + k);
+  } else {
+    k = -k;
+    const int q = k / 64, s = k % 64;
+    for (int i = nwords - 1; i >= q; i--) {
+      uint64_t v = row[i - q] << s;
+      if (s != 0 && i - q - 1 >= 0) v |= row[i - q - 1] >> (64 - s);
+      row[i] |= v;
+    }
+  }
+}
+
+// Horizontal dilation by radius r of one row, using tmp (nwords words)
+static void bitDilateRow(uint64_t* row, int nwords, int r, uint64_t* tmp) {
+  memcpy(tmp, row, sizeof(uint64_t)*nwords);
+  int len = 1;
+  for (; 2*len <= r + 1; len *= 2) {
+    bitOrShift(row, nwords, len);
+    bitOrShift(tmp, nwords, -len);
+  }
+  if (len < r + 1) {
+    bitOrShift(row, nwords, r + 1 - len);
+    bitOrShift(tmp, nwords, -(r + 1 - len));
+  }
+  for (int i = 0; i < nwords; i++) row[i] |= tmp[i];
+}
+
+typedef struct {
+  BitImage b;
+  int dx, dy;
+  uint64_t* copy;       // cópia das linhas para a janela para trás
+} BitMorphJob;
+
+// Horizontal pass over rows [begin, end)
+static void bitDilateRows(void* arg, int begin, int end) {
+  BitMorphJob* job = (BitMorphJob*)arg;
+  BitImage b = job->b;
+  uint64_t last = bitLastMask(b->width);
+  for (int y = begin; y < end; y++) {
+    uint64_t* row = b->bits + (size_t)y*b->stride;
+    bitDilateRow(row, b->stride, job->dx, job->copy + (size_t)y*b->stride);
+    row[b->stride - 1] &= last;
+  }
+}
+
+// Vertical pass over words [begin, end) of every row
+static void bitDilateCols(void* arg, int begin, int end) {
+  BitMorphJob* job = (BitMorphJob*)arg;
+  BitImage b = job->b;
+  const int h = b->height, S = b->stride, r = job->dy;
+  uint64_t* f = b->bits;
+  uint64_t* g = job->copy;
+  for (int y = 0; y < h; y++) {
+    for (int i = begin; i < end; i++) g[(size_t)y*S + i] = f[(size_t)y*S + i];
+  }
+  int len = 1;
+  while (len < r + 1) {
+    int k = (2*len <= r + 1) ? len : r + 1 - len;
+    // para a frente (linhas por ordem crescente), para trás (decrescente)
+    for (int y = 0; y + k < h; y++) {
+      for (int i = begin; i < end; i++) f[(size_t)y*S + i] |= f[(size_t)(y + k)*S + i];
+    }
+    for (int y = h - 1; y - k >= 0; y--) {
+      for (int i = begin; i < end; i++) g[(size_t)y*S + i] |= g[(size_t)(y - k)*S + i];
+    }
+    if (k < len) break;
+    len *= 2;
+  }
+  for (int y = 0; y < h; y++) {
+    for (int i = begin; i < end; i++) f[(size_t)y*S + i] |= g[(size_t)y*S + i];
+  }
+}
+
+// Complement all the pixels of b (keeping the padding bits 0)
+static void bitComplement(BitImage b) {
+  uint64_t last = bitLastMask(b->width);
+  for (int y = 0; y < b->height; y++) {
+    uint64_t* row = b->bits + (size_t)y*b->stride;
+    for (int i = 0; i < b->stride; i++) row[i] = ~row[i];
+    if (b->stride > 0) row[b->stride - 1] &= last;
+  }
+}
+
+// Dilate (or erode, if erode != 0) b with a (2dx+1)x(2dy+1) rectangle.
+static int bitMorph(BitImage b, int dx, int dy, int erode) {
+  if (b->width == 0 || b->height == 0 || (dx == 0 && dy == 0)) return 1;
+  uint64_t* copy = (uint64_t*)malloc(sizeof(uint64_t)*b->stride*(size_t)b->height);
+  if (!check(copy != NULL, "Falha ao alocar memória")) return 0;
+  BitMorphJob job = { b, dx, dy, copy };
+  if (erode) bitComplement(b);
+  if (dx > 0) ParallelFor(b->height, 16, bitDilateRows, &job);
+  if (dy > 0) ParallelFor(b->stride, 1, bitDilateCols, &job);
+  if (erode) bitComplement(b);
+  free(copy);
+  return 1;
+}
+
+/// Erode a bitmap with a (2dx+1)x(2dy+1) rectangle (see ImageErode):
+/// a pixel stays white only if all the pixels in [x-dx, x+dx]x[y-dy, y+dy]
+/// (clipped at the borders) are white.
+/// The bitmap is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, b is unchanged and errCause is set.
+int ImageBitErode(BitImage b, int dx, int dy) { ///
+  assert (b != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return bitMorph(b, dx, dy, 1);
+}
+
+/// Dilate a bitmap with a (2dx+1)x(2dy+1) rectangle (see ImageDilate):
+/// a pixel becomes white if any pixel in [x-dx, x+dx]x[y-dy, y+dy] is white.
+/// The bitmap is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, b is unchanged and errCause is set.
+int ImageBitDilate(BitImage b, int dx, int dy) { ///
+  assert (b != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return bitMorph(b, dx, dy, 0);
+}
+
+/// Morphological opening of a bitmap: erosion followed by dilation with
+/// the same (2dx+1)x(2dy+1) rectangle (see ImageOpen).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errCause is set; b may have
+/// been eroded only.
+int ImageBitOpen(BitImage b, int dx, int dy) { ///
+  assert (b != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return bitMorph(b, dx, dy, 1) && bitMorph(b, dx, dy, 0);
+}
+
+/// Morphological closing of a bitmap: dilation followed by erosion with
+/// the same (2dx+1)x(2dy+1) rectangle (see ImageClose).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errCause is set; b may have
+/// been dilated only.
+int ImageBitClose(BitImage b, int dx, int dy) { ///
+  assert (b != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return bitMorph(b, dx, dy, 0) && bitMorph(b, dx, dy, 1);
+}
+
+
+/// Connected components
+
+// Components are found on the runs of the foreground (nonzero) pixels
+// (see ImageRLEThreshold), with a union-find forest over the run indices
+// in which the root of a tree is always its smallest index.
+// Bands of rows are linked in parallel (each band only touches its own
+// runs), then the rows at the seams between bands are linked.  Labels are
+// then given in raster order of the first pixel of each component, so the
+// result does not depend on the number of threads.
+
+struct labelmap {
+  int width;
+  int height;
+  int count;
+  uint32_t* label;
+  ImageBlob* blob;
+};
+
+static uint32_t ufFind(uint32_t* parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];   // compressão por halving
+    i = parent[i];
+  }
+  return i;
+}
+
+static void ufUnion(uint32_t* parent, uint32_t a, uint32_t b) {
+  a = ufFind(parent, a);
+  b = ufFind(parent, b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+// Join the runs of row y with the touching runs of row y-1.
+// With 8-connectivity, runs that only touch diagonally are also joined.
+static void linkRows(RLEImage r, uint32_t* parent, int y, int conn8) {
+  long i = r->row[y - 1], iend = r->row[y];
+  long k = r->row[y], kend = r->row[y + 1];
+  while (i < iend && k < kend) {
+    int a0 = r->run[2*i], a1 = r->run[2*i + 1];
+    int b0 = r->run[2*k], b1 = r->run[2*k + 1];
+    if (a0 < b1 + conn8 && b0 < a1 + conn8) ufUnion(parent, (uint32_t)i, (uint32_t)k);
+    if (a1 < b1) i++; else k++;
+  }
+  COMP += (unsigned long)(iend - r->row[y - 1] + kend - k);
+}
+
+typedef struct {
+  RLEImage r;
+  uint32_t* parent;
+  uint32_t* lab;         // label of each run
+  uint32_t* label;       // label map
+  int conn8;
+  int* first;            // primeira linha de cada banda
+  volatile int next;     // próxima banda livre
+} LabelJob;
+
+// Link the runs of the band of rows [begin, end)
+static void labelBand(void* arg, int begin, int end) {
+  LabelJob* job = (LabelJob*)arg;
+  RLEImage r = job->r;
+  job->first[__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)] = begin;
+  for (long k = r->row[begin]; k < r->row[end]; k++) job->parent[k] = (uint32_t)k;
+  for (int y = begin + 1; y < end; y++) linkRows(r, job->parent, y, job->conn8);
+}
+
+// Write rows [begin, end) of the label map
+static void labelFill(void* arg, int begin, int end) {
+  LabelJob* job = (LabelJob*)arg;
+  RLEImage r = job->r;
+  for (int y = begin; y < end; y++) {
+    uint32_t* p = job->label + (size_t)y*r->width;
+    memset(p, 0, sizeof(uint32_t)*r->width);
+    for (long k = r->row[y]; k < r->row[y + 1]; k++) {
+      for (int x = r->run[2*k]; x < r->run[2*k + 1]; x++) p[x] = job->lab[k];
+    }
+  }
+}
+
+/// Label the connected components of the foreground (nonzero) pixels of
+/// img, as after ImageThreshold.
+/// connectivity is 4 (pixels touch by the sides) or 8 (also by the corners).
+/// Components are numbered 1, 2, ... in raster order of their first pixel;
+/// background pixels get label 0.  For each component, its area, bounding
+/// box and centroid are computed (see ImageBlob).
+/// Works on the runs of each row: bands of rows are labeled in parallel with
+/// union-find, and then joined at the seams.
+/// On success, a new label map is returned.
+/// (The caller is responsible for destroying it with ImageLabelDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+LabelMap ImageLabel(Image img, int connectivity) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  const int w = img->width, h = img->height;
+  LabelMap lm = (LabelMap)calloc(1, sizeof(*lm));
+  if (!check(lm != NULL, "Falha ao alocar memória")) return NULL;
+  lm->width = w;
+  lm->height = h;
+  RLEImage r = ImageRLEThreshold(img, 1);
+  long nruns = (r != NULL) ? r->row[h] : 0;
+  LabelJob job = { r, NULL, NULL, NULL, connectivity == 8, NULL, 0 };
+  int success =
+  r != NULL &&
+  check( (uint64_t)nruns < UINT32_MAX, "Image too large" ) &&
+  check( (job.parent = (uint32_t*)malloc(sizeof(uint32_t)*(nruns + 1))) != NULL, "Falha ao alocar memória" ) &&
+  check( (job.lab = (uint32_t*)malloc(sizeof(uint32_t)*(nruns + 1))) != NULL, "Falha ao alocar memória" ) &&
+  check( (job.first = (int*)malloc(sizeof(int)*ParallelThreads())) != NULL, "Falha ao alocar memória" ) &&
+  check( (lm->label = (uint32_t*)malloc(sizeof(uint32_t)*((size_t)w*h + 1))) != NULL, "Falha ao alocar memória" );
+  if (success) {
+    ParallelFor(h, 64, labelBand, &job);
+    for (int s = 0; s < job.next; s++) {
+      if (job.first[s] > 0) linkRows(r, job.parent, job.first[s], job.conn8);
+    }
+    // As raízes são os menores índices: percorrendo os runs por ordem,
+    // cada raiz aparece antes dos outros runs da sua componente.
+    for (long k = 0; k < nruns; k++) {
+      uint32_t root = ufFind(job.parent, (uint32_t)k);
+      job.lab[k] = (root == k) ? (uint32_t)++lm->count : job.lab[root];
+    }
+    success = check( (lm->blob = (ImageBlob*)calloc(lm->count + 1, sizeof(ImageBlob))) != NULL, "Falha ao alocar memória" );
+  }
+  if (success) {
+    for (int i = 0; i < lm->count; i++) {
+      lm->blob[i].x = w;
+      lm->blob[i].y = h;
+    }
+    for (int y = 0; y < h; y++) {
+      for (long k = r->row[y]; k < r->row[y + 1]; k++) {
+        ImageBlob* b = &lm->blob[job.lab[k] - 1];
+        int x0 = r->run[2*k], x1 = r->run[2*k + 1];
+        long len = x1 - x0;
+        b->area += len;
+        if (x0 < b->x) b->x = x0;
+        if (x1 > b->w) b->w = x1;       // por agora, x final
+        if (y < b->y) b->y = y;
+        b->h = y + 1;                   // por agora, y final
+        b->cx += 0.5 * (double)(x0 + x1 - 1) * len;
+        b->cy += (double)y * len;
+      }
+    }
+    for (int i = 0; i < lm->count; i++) {
+      ImageBlob* b = &lm->blob[i];
+      b->w -= b->x;
+      b->h -= b->y;
+      b->cx /= b->area;
+      b->cy /= b->area;
+    }
+    job.label = lm->label;
+    ParallelFor(h, 64, labelFill, &job);
+    PIXMEM += (unsigned long)w*h;
+  }
+  errsave = errno;
+  free(job.parent);
+  free(job.lab);
+  free(job.first);
+  ImageRLEDestroy(&r);
+  if (!success) ImageLabelDestroy(&lm);
+  errno = errsave;
+  return lm;
+}
+
+/// Destroy the label map pointed to by (*lp).
+/// If (*lp)==NULL, no operation is performed.
+/// Ensures: (*lp)==NULL.
+void ImageLabelDestroy(LabelMap* lp) { ///
+  assert (lp != NULL);
+  if (*lp == NULL) return;
+  free((*lp)->label);
+  free((*lp)->blob);
+  free(*lp);
+  *lp = NULL;
+}
+
+/// Get the number of components of a label map.
+int ImageLabelCount(LabelMap lm) { ///
+  assert (lm != NULL);
+  return lm->count;
+}
+
+/// Get the labels of a label map: width*height labels, row by row
+/// (the label of pixel (x,y) is at index y*width + x).
+/// The array belongs to lm and must not be modified or freed.
+const uint32_t* ImageLabelMap(LabelMap lm) { ///
+  assert (lm != NULL);
+  return lm->label;
+}
+
+/// Get the statistics of component k (1 <= k <= ImageLabelCount(lm)).
+/// The blob belongs to lm and must not be modified or freed.
+const ImageBlob* ImageLabelBlob(LabelMap lm, int k) { ///
+  assert (lm != NULL);
+  assert (1 <= k && k <= lm->count);
+  return &lm->blob[k - 1];
+}
+
+
+/// Image stacking
+
+// The inputs are read in batches of rows, the same rows of every input
+// at a time, and each batch is reduced into the result by several threads
+// (each takes some of the rows).  Only one batch per input is in memory,
+// about STACK_BATCH bytes in all (at least one row per input).
+
+#define STACK_BATCH (4 << 20)
+
+// An input of ImageStack: a raw PGM file read by rows, or (for plain and
+// tiled files, which cannot be read by rows) an image loaded whole.
+typedef struct {
+  int fd;
+  off_t offset;
+  Image img;
+} StackInput;
+
+typedef struct {
+  const uint8** rows;   // rows[i] = lote de linhas da entrada i
+  int n;
+  int w;
+  int op;
+  uint8* out;           // linhas do resultado correspondentes ao lote
+  volatile int failed;
+} StackJob;
+
+// sum[x] += p[x] for n pixels
+static void addRow16(uint16_t* sum, const uint8* p, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= n; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + x));
+    __m128i lo = _mm_loadu_si128((const __m128i*)(sum + x));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(sum + x + 8));
+    _mm_storeu_si128((__m128i*)(sum + x), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+    _mm_storeu_si128((__m128i*)(sum + x + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+  }
+#endif
+  for (; x < n; x++) sum[x] += p[x];
+}
+
+// Reduce rows [begin, end) of the batch
+static void stackRows(void* arg, int begin, int end) {
+  StackJob* job = (StackJob*)arg;
+  const int n = job->n, w = job->w;
+  uint32_t* sum = NULL;
+  uint16_t* sum16 = NULL;
+  if (job->op == STACK_MEAN) {
+    sum = (uint32_t*)malloc(sizeof(uint32_t)*w);
+    sum16 = (uint16_t*)malloc(sizeof(uint16_t)*w);
+    if (sum == NULL || sum16 == NULL) {
+      job->failed = 1;
+      free(sum);
+      free(sum16);
+      return;
+    }
+  }
+  for (int r = begin; r < end; r++) {
+    uint8* dst = job->out + (size_t)r*w;
+    const size_t off = (size_t)r*w;
+    if (job->op == STACK_MIN || job->op == STACK_MAX) {
+      int mop = (job->op == STACK_MIN) ? MORPH_MIN : MORPH_MAX;
+      memcpy(dst, job->rows[0] + off, w);
+      for (int i = 1; i < n; i++) lanesOp(dst, dst, job->rows[i] + off, w, mop);
+    } else if (job->op == STACK_MEAN) {
+      // Somas de 16 bits para grupos de até 257 entradas (257*255 < 2^16)
+      memset(sum, 0, sizeof(uint32_t)*w);
+      for (int i0 = 0; i0 < n; i0 += 257) {
+        int i1 = (n - i0 < 257) ? n : i0 + 257;
+        memset(sum16, 0, sizeof(uint16_t)*w);
+        for (int i = i0; i < i1; i++) addRow16(sum16, job->rows[i] + off, w);
+        for (int x = 0; x < w; x++) sum[x] += sum16[x];
+      }
+      for (int x = 0; x < w; x++) dst[x] = (uint8)((sum[x] + n/2) / n);
+    } else {
+      // Mediana por contagem: histograma de 256 níveis, com 16 classes de
+      // 16 níveis para chegar depressa à ordem k = (n-1)/2
+      uint16_t fine[256] = { 0 }, coarse[16] = { 0 };
+      const int k = (n - 1) / 2;
+      int x = 0;
+#ifdef __SSE2__
+      // Até 255 entradas, 16 pixeis de cada vez: a mediana é o maior t com
+      // #{v < t} <= k, encontrado bit a bit (do mais significativo), com as
+      // contagens em bytes
+      const __m128i sign = _mm_set1_epi8((char)0x80);
+      const __m128i vk = _mm_set1_epi8((char)k);
+      for (; n <= 255 && x + 16 <= w; x += 16) {
+        __m128i m = _mm_setzero_si128();
+        for (int bit = 7; bit >= 0; bit--) {
+          __m128i b = _mm_set1_epi8((char)(1 << bit));
+          __m128i t = _mm_xor_si128(_mm_or_si128(m, b), sign);
+          __m128i cnt = _mm_setzero_si128();
+          for (int i = 0; i < n; i++) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(job->rows[i] + off + x)), sign);
+            cnt = _mm_sub_epi8(cnt, _mm_cmplt_epi8(v, t));
+          }
+          __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(cnt, vk), cnt);
+          m = _mm_or_si128(m, _mm_and_si128(le, b));
+        }
+        _mm_storeu_si128((__m128i*)(dst + x), m);
+      }
+#endif
+      for (; x < w; x++) {
+        for (int i = 0; i < n; i++) {
+          uint8 v = job->rows[i][off + x];
+          fine[v]++;
+          coarse[v >> 4]++;
+        }
+        int c = 0, b = 0;
+        while (c + coarse[b] <= k) c += coarse[b++];
+        int v = 16*b;
+        while (c + fine[v] <= k) c += fine[v++];
+        dst[x] = (uint8)v;
+        // limpar só as posições usadas
+        if (n < 256) {
+          for (int i = 0; i < n; i++) {
+            uint8 u = job->rows[i][off + x];
+            fine[u] = 0;
+            coarse[u >> 4] = 0;
+          }
+        } else {
+          memset(fine, 0, sizeof(fine));
+          memset(coarse, 0, sizeof(coarse));
+        }
+      }
+    }
+  }
+  free(sum);
+  free(sum16);
+}
+
+/// Combine n images of the same size, pixel by pixel, as given by op:
+///   STACK_MEAN : the rounded mean of the n levels;
+///   STACK_MEDIAN : the median level (for even n, the lower of the two
+///     middle levels);
+///   STACK_MIN, STACK_MAX : the minimum or maximum level.
+/// The images are read from the files files[0..n-1], all at the same time,
+/// in batches of rows, so that at most a few MB of input are in memory
+/// (at least one row of each file), besides the result.
+/// Plain (P2) and tiled files cannot be read by rows and are loaded whole.
+/// The result has the largest maxval of the inputs.
+/// Requires: 1 <= n <= 65535.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageStack(const char* files[], int n, int op) { ///
+  assert (files != NULL);
+  assert (1 <= n && n <= 65535);
+  assert (op == STACK_MEAN || op == STACK_MEDIAN || op == STACK_MIN || op == STACK_MAX);
+  StackInput* in = (StackInput*)calloc(n, sizeof(StackInput));
+  if (!check(in != NULL, "Falha ao alocar memória")) return NULL;
+  for (int i = 0; i < n; i++) in[i].fd = -1;
+  int w = 0, h = 0, maxval = 0;
+  int success = 1;
+  for (int i = 0; success && i < n; i++) {
+    PGMHeader hd;
+    success = check( (in[i].fd = open(files[i], O_RDONLY)) >= 0, "Open failed" );
+    if (!success) break;
+    int whole = isTiled(in[i].fd);
+    if (!whole) {
+      success = readHeader(in[i].fd, &hd, &in[i].offset);
+      if (!success) break;
+      whole = hd.plain;
+    }
+    if (whole) {
+      // sem leitura por linhas: carregar tudo
+      close(in[i].fd);
+      in[i].fd = -1;
+      success = (in[i].img = ImageLoad(files[i])) != NULL;
+      if (!success) break;
+      hd.width = in[i].img->width;
+      hd.height = in[i].img->height;
+      hd.maxval = in[i].img->maxval;
+    }
+    if (i == 0) {
+      w = hd.width;
+      h = hd.height;
+    }
+    success = check( hd.width == w && hd.height == h, "Image sizes differ" );
+    if (hd.maxval > maxval) maxval = hd.maxval;
+  }
+
+  Image img = NULL;
+  const uint8** rows = NULL;
+  uint8* batch = NULL;
+  int out = (int)(STACK_BATCH / ((size_t)n*w + 1));
+  if (out < 1) out = 1;
+  if (out > h) out = h;
+  success = success &&
+  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  check( (rows = (const uint8**)malloc(sizeof(uint8*)*n)) != NULL, "Falha ao alocar memória" ) &&
+  check( (batch = (uint8*)malloc((size_t)n*out*w + 1)) != NULL, "Falha ao alocar memória" );
+#if defined(POSIX_FADV_SEQUENTIAL)
+  for (int i = 0; success && i < n; i++) {
+    if (in[i].fd >= 0) posix_fadvise(in[i].fd, in[i].offset, (off_t)w*h, POSIX_FADV_SEQUENTIAL);
+  }
+#endif
+  for (int y = 0; success && w > 0 && y < h; y += out) {
+    int nrows = (h - y < out) ? h - y : out;
+    size_t len = (size_t)nrows*w;
+    for (int i = 0; success && i < n; i++) {
+      if (in[i].fd < 0) {
+        rows[i] = in[i].img->pixel + (size_t)y*w;
+      } else {
+        uint8* p = batch + (size_t)i*out*w;
+        success = check( preadAll(in[i].fd, p, len, in[i].offset + (off_t)y*w), "Reading pixels" );
+        rows[i] = p;
+      }
+    }
+    if (success) {
+      StackJob job = { rows, n, w, op, img->pixel + (size_t)y*w, 0 };
+      ParallelFor(nrows, 1 + (1 << 16) / ((size_t)n*w + 1), stackRows, &job);
+      success = check( !job.failed, "Falha ao alocar memória" );
+    }
+    PIXMEM += (unsigned long)len*(n + 1);  // count pixel memory accesses
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (!success) ImageDestroy(&img);
+  for (int i = 0; i < n; i++) {
+    if (in[i].fd >= 0) close(in[i].fd);
+    ImageDestroy(&in[i].img);
+  }
+  free(in);
+  free(rows);
+  free(batch);
+  errno = errsave;
+  return img;
+}
+
+
+/// Image comparison
+
+// The difference metrics are accumulated row by row with SSE2 (sum of
+// absolute differences with psadbw, squares with pmaddwd, maximum with
+// byte max).  SSIM is computed over all the SSIM_WIN x SSIM_WIN windows:
+// the five window sums it needs (x, y, x^2, y^2, xy) come from column sums
+// over a band of SSIM_WIN rows, slid down one row at a time (add the new
+// row, subtract the old one), and then slid along the row.  This is the
+// integral image of the band, kept in O(width) memory.
+
+#define SSIM_WIN 8
+
+typedef struct {
+  Image img1, img2;
+  int win;                // lado das janelas SSIM
+  double c1, c2;          // constantes do SSIM
+  unsigned long* sad;     // resultados de cada chunk
+  uint64_t* sq;
+  int* maxabs;
+  double* ssim;
+  volatile int next;      // próximo chunk livre
+  volatile int failed;
+} CompareJob;
+
+// Add the squared differences of n bytes of a and b to *sq, and raise
+// *maxabs to their largest absolute difference.
+static void diffRow(const uint8* a, const uint8* b, int n, uint64_t* sq, int* maxabs) {
+  int i = 0;
+  uint64_t s = 0;
+  int m = *maxabs;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i vmax = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    // cada iteração soma no máximo 2*255^2 a cada lane de 32 bits
+    __m128i acc = _mm_setzero_si128();
+    for (int k = 0; k < 16384 && i + 16 <= n; k++, i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      vmax = _mm_max_epu8(vmax, d);
+      __m128i lo = _mm_unpacklo_epi8(d, zero);
+      __m128i hi = _mm_unpackhi_epi8(d, zero);
+      acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    s += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  uint8 bytes[16];
+  _mm_storeu_si128((__m128i*)bytes, vmax);
+  for (int k = 0; k < 16; k++) if (bytes[k] > m) m = bytes[k];
+#endif
+  for (; i < n; i++) {
+    int d = abs(a[i] - b[i]);
+    s += (uint64_t)(d*d);
+    if (d > m) m = d;
+  }
+  *sq += s;
+  *maxabs = m;
+}
+
+// Difference metrics of rows [begin, end)
+static void compareRows(void* arg, int begin, int end) {
+  CompareJob* job = (CompareJob*)arg;
+  int slot = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+  const int w = job->img1->width;
+  for (int y = begin; y < end; y++) {
+    const uint8* a = job->img1->pixel + (size_t)y*w;
+    const uint8* b = job->img2->pixel + (size_t)y*w;
+    job->sad[slot] += sadRow(a, b, w);
+    diffRow(a, b, w, &job->sq[slot], &job->maxabs[slot]);
+  }
+}
+
+// Add (sign > 0) or subtract row a of img1 and row b of img2 to the column
+// sums s[0..4] (x, y, x^2, y^2, xy) of n columns.
+static void ssimColumns(uint32_t* s[5], const uint8* a, const uint8* b, int n, int sign) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + i)), zero);
+    __m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + i)), zero);
+    __m128i v[5] = { x, y, _mm_mullo_epi16(x, x), _mm_mullo_epi16(y, y), _mm_mullo_epi16(x, y) };
+    for (int k = 0; k < 5; k++) {
+      // alargar os 8 valores de 16 bits (sem sinal) para 32 bits
+      __m128i lo = _mm_unpacklo_epi16(v[k], zero);
+      __m128i hi = _mm_unpackhi_epi16(v[k], zero);
+      __m128i s0 = _mm_loadu_si128((const __m128i*)(s[k] + i));
+      __m128i s1 = _mm_loadu_si128((const __m128i*)(s[k] + i + 4));
+      s0 = (sign > 0) ? _mm_add_epi32(s0, lo) : _mm_sub_epi32(s0, lo);
+      s1 = (sign > 0) ? _mm_add_epi32(s1, hi) : _mm_sub_epi32(s1, hi);
+      _mm_storeu_si128((__m128i*)(s[k] + i), s0);
+      _mm_storeu_si128((__m128i*)(s[k] + i + 4), s1);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    uint32_t x = a[i], y = b[i];
+    uint32_t v[5] = { x, y, x*x, y*y, x*y };
+    for (int k = 0; k < 5; k++) s[k][i] += (sign > 0) ? v[k] : -v[k];
+  }
+}
+
+// Sum of the SSIM of the windows whose top rows are [begin, end)
+static void ssimRows(void* arg, int begin, int end) {
+  CompareJob* job = (CompareJob*)arg;
+  int slot = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+  const int w = job->img1->width, N = job->win;
+  const double A = (double)N*N;
+  const double c1 = job->c1*A*A, c2 = job->c2*A*A;
+  uint32_t* mem = (uint32_t*)calloc(10*(size_t)w, sizeof(uint32_t));
+  if (mem == NULL) {
+    job->failed = 1;
+    return;
+  }
+  uint32_t* s[5];      // somas das colunas da banda
+  uint32_t* win[5];    // somas das janelas da linha
+  for (int k = 0; k < 5; k++) {
+    s[k] = mem + (size_t)k*w;
+    win[k] = mem + (size_t)(5 + k)*w;
+  }
+  const uint8* p1 = job->img1->pixel;
+  const uint8* p2 = job->img2->pixel;
+  for (int y = begin; y < begin + N; y++) ssimColumns(s, p1 + (size_t)y*w, p2 + (size_t)y*w, w, 1);
+  double total = 0.0;
+  for (int y = begin; y < end; y++) {
+    if (y > begin) {
+      ssimColumns(s, p1 + (size_t)(y + N - 1)*w, p2 + (size_t)(y + N - 1)*w, w, 1);
+      ssimColumns(s, p1 + (size_t)(y - 1)*w, p2 + (size_t)(y - 1)*w, w, -1);
+    }
+    // Janelas ao longo da linha: somas das colunas x .. x+N-1 (o integral
+    // da banda), e depois o SSIM com as somas multiplicadas por A = N*N,
+    // para uma só divisão por janela:
+    //   ((2 Sx Sy + c1 A^2)(2 (A Sxy - Sx Sy) + c2 A^2)) /
+    //   ((Sx^2 + Sy^2 + c1 A^2)(A (Sxx + Syy) - Sx^2 - Sy^2 + c2 A^2))
+    for (int k = 0; k < 5; k++) {
+      uint32_t acc = 0;
+      for (int x = 0; x < N - 1; x++) acc += s[k][x];
+      for (int x = 0; x + N <= w; x++) {
+        acc += s[k][x + N - 1];
+        win[k][x] = acc;
+        acc -= s[k][x];
+      }
+    }
+    int x = 0;
+#ifdef __SSE2__
+    // duas janelas de cada vez (as somas cabem em int32)
+    const __m128d vA = _mm_set1_pd(A), vc1 = _mm_set1_pd(c1), vc2 = _mm_set1_pd(c2);
+    const __m128d two = _mm_set1_pd(2.0);
+    __m128d vtotal = _mm_setzero_pd();
+    for (; x + 1 + N <= w; x += 2) {
+      __m128d v[5];
+      for (int k = 0; k < 5; k++) v[k] = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(win[k] + x)));
+      __m128d sxy = _mm_mul_pd(v[0], v[1]);
+      __m128d sq = _mm_add_pd(_mm_mul_pd(v[0], v[0]), _mm_mul_pd(v[1], v[1]));
+      __m128d num = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(two, sxy), vc1),
+                               _mm_add_pd(_mm_mul_pd(two, _mm_sub_pd(_mm_mul_pd(vA, v[4]), sxy)), vc2));
+      __m128d den = _mm_mul_pd(_mm_add_pd(sq, vc1),
+                               _mm_add_pd(_mm_sub_pd(_mm_mul_pd(vA, _mm_add_pd(v[2], v[3])), sq), vc2));
+      vtotal = _mm_add_pd(vtotal, _mm_div_pd(num, den));
+    }
+    double t2[2];
+    _mm_storeu_pd(t2, vtotal);
+    total += t2[0] + t2[1];
+#endif
+    for (; x + N <= w; x++) {
+      double sx = win[0][x], sy = win[1][x];
+      double sxy = sx*sy, sxx = sx*sx, syy = sy*sy;
+      double num = (2*sxy + c1) * (2*(A*win[4][x] - sxy) + c2);
+      double den = (sxx + syy + c1) * (A*((double)win[2][x] + win[3][x]) - sxx - syy + c2);
+      total += num / den;
+    }
+  }
+  job->ssim[slot] += total;
+  free(mem);
+}
+
+/// Compare two images of the same size, pixel by pixel.
+/// Computes into *metrics:
+///   maxabs : the largest absolute difference of levels;
+///   mae, mse : the mean absolute and mean squared differences;
+///   psnr : the peak signal-to-noise ratio 10*log10(L^2/mse) in dB, where L
+///     is the largest maxval of the two images (INFINITY if mse is 0);
+///   ssim : the mean structural similarity of all the 8x8 windows (smaller,
+///     if an image is smaller), in [-1, 1], with 1 for identical images.
+/// Rows are compared in parallel.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly
+/// (also if the images do not have the same size).
+int ImageCompare(Image img1, Image img2, ImageMetrics* metrics) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (metrics != NULL);
+  if (!check(img1->width == img2->width && img1->height == img2->height, "Image sizes differ")) {
+    errno = EINVAL;
+    return 0;
+  }
+  const int w = img1->width, h = img1->height;
+  const int nthreads = ParallelThreads();
+  const int L = (img1->maxval > img2->maxval) ? img1->maxval : img2->maxval;
+  int N = SSIM_WIN;
+  if (w < N) N = w;
+  if (h < N) N = h;
+  CompareJob job = { img1, img2, N, (0.01*L)*(0.01*L), (0.03*L)*(0.03*L), NULL, NULL, NULL, NULL, 0, 0 };
+  job.sad = (unsigned long*)calloc(nthreads, sizeof(unsigned long));
+  job.sq = (uint64_t*)calloc(nthreads, sizeof(uint64_t));
+  job.maxabs = (int*)calloc(nthreads, sizeof(int));
+  job.ssim = (double*)calloc(nthreads, sizeof(double));
+  int success = check( job.sad != NULL && job.sq != NULL && job.maxabs != NULL && job.ssim != NULL,
+                       "Falha ao alocar memória" );
+  if (success && w > 0 && h > 0) {
+    ParallelFor(h, 64, compareRows, &job);
+    job.next = 0;
+    ParallelFor(h - N + 1, 16, ssimRows, &job);
+    success = check( !job.failed, "Falha ao alocar memória" );
+    PIXMEM += 4ul*w*h;  // duas passagens por ambas as imagens
+  }
+  if (success) {
+    unsigned long sad = 0;
+    uint64_t sq = 0;
+    int maxabs = 0;
+    double ssim = 0.0;
+    for (int s = 0; s < nthreads; s++) {
+      sad += job.sad[s];
+      sq += job.sq[s];
+      if (job.maxabs[s] > maxabs) maxabs = job.maxabs[s];
+      ssim += job.ssim[s];
+    }
+    double npix = (double)w*h;
+    metrics->maxabs = maxabs;
+    metrics->mae = (npix > 0) ? sad / npix : 0.0;
+    metrics->mse = (npix > 0) ? sq / npix : 0.0;
+    metrics->psnr = (sq == 0) ? INFINITY : 10.0*log10((double)L*L / metrics->mse);
+    metrics->ssim = (npix > 0) ? ssim / ((double)(w - N + 1)*(h - N + 1)) : 1.0;
+  }
+  errsave = errno;
+  free(job.sad);
+  free(job.sq);
+  free(job.maxabs);
+  free(job.ssim);
+  errno = errsave;
+  return success;
+}
+
+
+/// Content hashing and corpus index
+
+// ImageHash processes the pixels in stripes of 64 bytes, as 8 lanes of 64
+// bits, in the style of xxHash3: each lane accumulates the product of the
+// two halves of its data (mixed with a key) and the data of the neighbour
+// lane; every 16 stripes the accumulators are scrambled, and at the end
+// they are mixed with the size into one value.  The 32x32->64 bit products
+// map to SSE2 (pmuludq), two lanes per instruction.
+//
+// The corpus index stores, for each image, the hashes of its aligned
+// block x block squares.  A template with at least 2*block-1 columns and
+// rows always covers a complete aligned square, at one of block*block
+// offsets (one per alignment of the template position).  The polynomial
+// hashes of the squares of the template at all offsets are computed by
+// rolling them along rows and then columns, so they cost O(1) per position;
+// each one is looked up in the index to get candidate positions, which are
+// then confirmed against the corpus files.  Squares of a single level
+// (blank paper, borders) would match almost everywhere, so they are not
+// indexed, and the template uses another square of the same alignment.
+
+#define HASH_P1 0x9E3779B185EBCA87ull
+#define HASH_P2 0xC2B2AE3D27D4EB4Full
+#define HASH_P3 0x165667B19E3779F9ull
+#define HASH_P32 0x9E3779B1u
+#define HASH_STRIPE 64   // bytes por faixa: 8 lanes de 64 bits
+#define HASH_ROUNDS 16   // faixas entre baralhamentos
+
+// Multipliers of the polynomial block hashes, along rows and columns
+#define BLOCK_A 0x100000001B3ull
+#define BLOCK_C HASH_P1
+
+#define INDEX_HEADER 64
+#define INDEX_FILE 16    // bytes por imagem: hash, largura, altura
+#define INDEX_SLOT 24    // bytes por entrada: hash, imagem, x, y
+
+static const char INDEX_MAGIC[8] = "I8INDEX\n";
+
+static const uint64_t hashKey[8] = {
+  0xE220A8397B1DCDAFull, 0x6E789E6AA1B965F4ull, 0x06C45D188009454Full, 0xF88BB8A8724C81ECull,
+  0x1B39896A51A8749Bull, 0x53CB9F0C747EA2EAull, 0x2C829ABE1F4532E1ull, 0xC584133AC916AB3Cull
+};
+
+// Final avalanche of a 64-bit value (every input bit affects every output bit)
+static uint64_t hashMix(uint64_t h) {
+  h ^= h >> 33;
+  h *= HASH_P2;
+  h ^= h >> 29;
+  h *= HASH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Accumulate n stripes at p into acc[0..7], scrambling after the last one
+// if scramble is nonzero.
+static void hashStripes(uint64_t acc[8], const uint8* p, size_t n, int scramble) {
+#ifdef __SSE2__
+  __m128i a[4], key[4];
+  for (int k = 0; k < 4; k++) {
+    a[k] = _mm_loadu_si128((const __m128i*)(acc + 2*k));
+    key[k] = _mm_loadu_si128((const __m128i*)(hashKey + 2*k));
+  }
+  for (size_t s = 0; s < n; s++, p += HASH_STRIPE) {
+    for (int k = 0; k < 4; k++) {
+      __m128i d = _mm_loadu_si128((const __m128i*)(p + 16*k));
+      __m128i dk = _mm_xor_si128(d, key[k]);
+      // metade baixa x metade alta de cada lane; os dados vão para a vizinha
+      __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+      __m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+      a[k] = _mm_add_epi64(a[k], _mm_add_epi64(prod, swap));
+    }
+  }
+  if (scramble) {
+    const __m128i prime = _mm_set1_epi32((int)HASH_P32);
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_xor_si128(a[k], _mm_srli_epi64(a[k], 47));
+      v = _mm_xor_si128(v, key[(k + 2) & 3]);
+      // produto de 64 x 32 bits a partir de dois produtos de 32 x 32 bits
+      __m128i lo = _mm_mul_epu32(v, prime);
+      __m128i hi = _mm_mul_epu32(_mm_srli_epi64(v, 32), prime);
+      a[k] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+  }
+  for (int k = 0; k < 4; k++) _mm_storeu_si128((__m128i*)(acc + 2*k), a[k]);
+#else
+  for (size_t s = 0; s < n; s++, p += HASH_STRIPE) {
+    for (int j = 0; j < 8; j++) {
+      uint64_t d = get64(p + 8*j);
+      uint64_t dk = d ^ hashKey[j];
+      acc[j ^ 1] += d;
+      acc[j] += (dk & 0xFFFFFFFFu) * (dk >> 32);
+    }
+  }
+  if (scramble) {
+    for (int j = 0; j < 8; j++) {
+      uint64_t v = acc[j] ^ (acc[j] >> 47);
+      acc[j] = (v ^ hashKey[(j + 4) & 7]) * HASH_P32;
+    }
+  }
+#endif
+}
+
+/// Compute a 64-bit hash of the contents of img: its size, maxval and pixels.
+/// Images with the same contents have the same hash; images with different
+/// contents have different hashes, except with negligible probability
+/// (it is not a cryptographic hash, though).
+/// The pixels are hashed with SIMD instructions, at several GB/s, and the
+/// result is the same on every platform, so it may be stored in files.
+uint64_t ImageHash(Image img) { ///
+  assert (img != NULL);
+  const size_t len = (size_t)img->width * img->height;
+  const size_t full = len / HASH_STRIPE;
+  uint64_t acc[8];
+  for (int j = 0; j < 8; j++) acc[j] = HASH_P1 * (uint64_t)(j + 1);
+  for (size_t s = 0; s < full; s += HASH_ROUNDS) {
+    size_t n = (full - s < HASH_ROUNDS) ? full - s : HASH_ROUNDS;
+    hashStripes(acc, img->pixel + s*HASH_STRIPE, n, n == HASH_ROUNDS);
+  }
+  if (len % HASH_STRIPE != 0) {
+    // a última faixa incompleta é completada com zeros
+    uint8 last[HASH_STRIPE] = { 0 };
+    memcpy(last, img->pixel + full*HASH_STRIPE, len % HASH_STRIPE);
+    hashStripes(acc, last, 1, 0);
+  }
+  PIXMEM += len;
+  uint64_t h = (uint64_t)len * HASH_P1 +
+    hashMix(((uint64_t)img->width << 32 | (uint32_t)img->height) ^ (uint64_t)img->maxval * HASH_P3);
+  for (int j = 0; j < 8; j++) {
+    h ^= hashMix(acc[j] ^ hashKey[j]);
+    h = ((h << 27) | (h >> 37)) * HASH_P1;
+  }
+  return hashMix(h);
+}
+
+// Index key of the polynomial hash of a square (never 0, the empty slot)
+static uint64_t blockKey(uint64_t h) {
+  h = hashMix(h);
+  return (h == 0) ? 1 : h;
+}
+
+// An entry of the corpus index: a square of image file, at (x,y)
+typedef struct {
+  uint64_t key;
+  uint32_t file;
+  uint32_t x;
+  uint32_t y;
+} IndexEntry;
+
+// Shared state of the hashing of the squares of an image
+typedef struct {
+  Image img;
+  int block;
+  int nbx;          // quadrados por linha
+  uint64_t* keys;   // chave de cada quadrado (0 se for de um só nível)
+} IndexJob;
+
+// Hash the squares of rows of squares [begin, end)
+static void indexRows(void* arg, int begin, int end) {
+  IndexJob* job = (IndexJob*)arg;
+  const int w = job->img->width, B = job->block;
+  for (int by = begin; by < end; by++) {
+    for (int bx = 0; bx < job->nbx; bx++) {
+      const uint8* q = job->img->pixel + (size_t)by*B*w + (size_t)bx*B;
+      uint64_t h = 0;
+      int uniform = 1;
+      for (int j = 0; j < B; j++) {
+        const uint8* row = q + (size_t)j*w;
+        uint64_t r = 0;
+        for (int i = 0; i < B; i++) {
+          r = r*BLOCK_A + row[i];
+          uniform &= (row[i] == q[0]);
+        }
+        h = h*BLOCK_C + r;
+      }
+      job->keys[(size_t)by*job->nbx + bx] = uniform ? 0 : blockKey(h);
+    }
+  }
+}
+
+/// Build an index of the images in files files[0..n-1] (the corpus) and
+/// save it to file indexfile.
+/// Each image is split into block x block squares, aligned at multiples of
+/// block.  The hash of each square that is not of a single level is stored,
+/// with the image and the position of the square, in an open-addressing
+/// hash table, followed by the content hash of each image (see ImageHash)
+/// and the file names.  The index file is used mapped into memory, as is,
+/// by ImageIndexOpen.
+/// Only one image is in memory at a time, but the table is built in memory
+/// (24 bytes for each indexed square, plus the table itself).
+/// Requires: 2 <= block <= 1024, n >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageIndexBuild(const char* indexfile, const char* files[], int n, int block) { ///
+  assert (indexfile != NULL);
+  assert (n >= 0);
+  assert (2 <= block && block <= 1024);
+  uint8* fileinfo = (uint8*)calloc(n + 1, INDEX_FILE);
+  IndexEntry* entries = NULL;
+  size_t count = 0, cap = 0;
+  size_t namelen = 0;
+  int success = check( fileinfo != NULL, "Falha ao alocar memória" );
+  for (int f = 0; success && f < n; f++) {
+    Image img = ImageLoad(files[f]);
+    if (img == NULL) {
+      success = 0;
+      break;
+    }
+    put64(fileinfo + (size_t)f*INDEX_FILE, ImageHash(img));
+    put32(fileinfo + (size_t)f*INDEX_FILE + 8, (uint32_t)img->width);
+    put32(fileinfo + (size_t)f*INDEX_FILE + 12, (uint32_t)img->height);
+    namelen += strlen(files[f]) + 1;
+    IndexJob job = { img, block, img->width / block, NULL };
+    int nby = img->height / block;
+    size_t nsq = (size_t)job.nbx * nby;
+    if (count + nsq > cap) {
+      size_t ncap = 2*cap > count + nsq ? 2*cap : count + nsq;
+      IndexEntry* p = (IndexEntry*)realloc(entries, ncap * sizeof(IndexEntry));
+      success = check( p != NULL, "Falha ao alocar memória" );
+      if (success) {
+        entries = p;
+        cap = ncap;
+      }
+    }
+    if (success && nsq > 0) {
+      job.keys = (uint64_t*)malloc(nsq * sizeof(uint64_t));
+      success = check( job.keys != NULL, "Falha ao alocar memória" );
+    }
+    if (success && nsq > 0) {
+      ParallelFor(nby, 4, indexRows, &job);
+      PIXMEM += nsq * block * block;
+      for (size_t s = 0; s < nsq; s++) {
+        if (job.keys[s] == 0) continue;
+        IndexEntry e = { job.keys[s], (uint32_t)f, (uint32_t)(s % job.nbx * block), (uint32_t)(s / job.nbx * block) };
+        entries[count++] = e;
+      }
+    }
+    free(job.keys);
+    ImageDestroy(&img);
+  }
+
+  // tabela com ocupação de no máximo 1/2, para sondagens curtas
+  uint64_t nslots = 16;
+  while (nslots < 2*(uint64_t)count) nslots *= 2;
+  const size_t slotsoff = INDEX_HEADER + (size_t)n*INDEX_FILE;
+  const size_t namesoff = slotsoff + nslots*INDEX_SLOT;
+  uint8* table = NULL;
+  if (success) {
+    table = (uint8*)calloc(nslots, INDEX_SLOT);
+    success = check( table != NULL, "Falha ao alocar memória" );
+  }
+  for (size_t s = 0; success && s < count; s++) {
+    uint64_t i = entries[s].key & (nslots - 1);
+    while (get64(table + i*INDEX_SLOT) != 0) i = (i + 1) & (nslots - 1);
+    uint8* slot = table + i*INDEX_SLOT;
+    put64(slot, entries[s].key);
+    put32(slot + 8, entries[s].file);
+    put32(slot + 12, entries[s].x);
+    put32(slot + 16, entries[s].y);
+  }
+
+  FILE* out = NULL;
+  if (success) {
+    uint8 head[INDEX_HEADER] = { 0 };
+    memcpy(head, INDEX_MAGIC, 8);
+    put32(head + 8, (uint32_t)block);
+    put32(head + 12, (uint32_t)n);
+    put64(head + 16, nslots);
+    put64(head + 24, slotsoff);
+    put64(head + 32, namesoff);
+    put64(head + 40, namelen);
+    success =
+    check( (out = fopen(indexfile, "wb")) != NULL, "Open failed" ) &&
+    check( fwrite(head, 1, INDEX_HEADER, out) == INDEX_HEADER, "Writing header failed" ) &&
+    check( fwrite(fileinfo, INDEX_FILE, n, out) == (size_t)n, "Writing header failed" ) &&
+    check( fwrite(table, INDEX_SLOT, nslots, out) == nslots, "Writing index failed" );
+    for (int f = 0; success && f < n; f++) {
+      size_t len = strlen(files[f]) + 1;
+      success = check( fwrite(files[f], 1, len, out) == len, "Writing index failed" );
+    }
+  }
+  errsave = errno;
+  if (out != NULL && fclose(out) != 0 && success) success = check(0, "Writing index failed");
+  free(fileinfo);
+  free(entries);
+  free(table);
+  errno = errsave;
+  return success;
+}
+
+// Corpus index mapped into memory (see ImageIndexBuild for the layout)
+struct imageindex {
+  uint8* map;           // o ficheiro inteiro, só para leitura
+  size_t size;
+  int block;
+  int nfiles;
+  uint64_t nslots;
+  const uint8* files;   // hash, largura e altura de cada imagem
+  const uint8* slots;   // tabela de hash
+  const char** names;   // nome de cada imagem
+};
+
+/// Open the corpus index saved in file indexfile by ImageIndexBuild.
+/// The file is mapped into memory, not read: only the parts of the table
+/// used by the queries are ever read from disk.
+/// On success, a new index object is returned.
+/// (The caller is responsible for destroying it with ImageIndexClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexOpen(const char* indexfile) { ///
+  assert (indexfile != NULL);
+  int fd = -1;
+  struct stat st;
+  ImageIndex ix = (ImageIndex)calloc(1, sizeof(struct imageindex));
+  int success =
+  check( ix != NULL, "Falha ao alocar memória" ) &&
+  check( (fd = open(indexfile, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Reading failed" ) &&
+  check( st.st_size >= INDEX_HEADER, "Invalid file format" );
+  if (success) {
+    ix->size = (size_t)st.st_size;
+    void* p = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+    success = check( p != MAP_FAILED, "Falha ao alocar memória" );
+    if (success) ix->map = (uint8*)p;
+  }
+  if (success) {
+    const uint8* head = ix->map;
+    ix->block = (int)get32(head + 8);
+    ix->nfiles = (int)get32(head + 12);
+    ix->nslots = get64(head + 16);
+    uint64_t slotsoff = get64(head + 24), namesoff = get64(head + 32), namelen = get64(head + 40);
+    success =
+    check( memcmp(head, INDEX_MAGIC, 8) == 0, "Invalid file format" ) &&
+    check( ix->block >= 2 && ix->block <= 1024 && ix->nfiles >= 0, "Invalid index header" ) &&
+    check( ix->nslots > 0 && (ix->nslots & (ix->nslots - 1)) == 0, "Invalid index header" ) &&
+    check( slotsoff == INDEX_HEADER + (uint64_t)ix->nfiles*INDEX_FILE &&
+           namesoff == slotsoff + ix->nslots*INDEX_SLOT &&
+           namesoff + namelen == ix->size && (namelen == 0 || ix->map[ix->size - 1] == '\0'),
+           "Invalid index header" ) &&
+    check( (ix->names = (const char**)malloc((ix->nfiles + 1) * sizeof(char*))) != NULL,
+           "Falha ao alocar memória" );
+    if (success) {
+      ix->files = ix->map + INDEX_HEADER;
+      ix->slots = ix->map + slotsoff;
+      const char* name = (const char*)ix->map + namesoff;
+      const char* end = (const char*)ix->map + ix->size;
+      for (int f = 0; success && f < ix->nfiles; f++) {
+        success = check( name < end, "Invalid index header" );
+        ix->names[f] = name;
+        name += strlen(name) + 1;
+      }
+    }
+  }
+  errsave = errno;
+  if (fd >= 0) close(fd);   // o mapeamento mantém-se
+  if (!success) ImageIndexClose(&ix);
+  errno = errsave;
+  return ix;
+}
+
+/// Close the corpus index pointed to by (*ip).
+/// If (*ip)==NULL, no operation is performed.
+/// Ensures: (*ip)==NULL.
+void ImageIndexClose(ImageIndex* ip) { ///
+  assert (ip != NULL);
+  if (*ip == NULL) return;
+  if ((*ip)->map != NULL) munmap((*ip)->map, (*ip)->size);
+  free((*ip)->names);
+  free(*ip);
+  *ip = NULL;
+}
+
+/// Get the number of images in the corpus of an index.
+int ImageIndexCount(ImageIndex ix) { ///
+  assert (ix != NULL);
+  return ix->nfiles;
+}
+
+/// Get the file name of image i of the corpus (0 <= i < ImageIndexCount(ix)).
+/// The name belongs to ix and must not be modified or freed.
+const char* ImageIndexName(ImageIndex ix, int i) { ///
+  assert (ix != NULL);
+  assert (0 <= i && i < ix->nfiles);
+  return ix->names[i];
+}
+
+/// Find an image of the corpus with the same contents as img, by its
+/// content hash (see ImageHash), without reading any corpus file.
+/// Returns the number of the first such image, or -1 if there is none.
+int ImageIndexFind(ImageIndex ix, Image img) { ///
+  assert (ix != NULL);
+  assert (img != NULL);
+  uint64_t h = ImageHash(img);
+  for (int f = 0; f < ix->nfiles; f++) {
+    if (get64(ix->files + (size_t)f*INDEX_FILE) == h) return f;
+  }
+  return -1;
+}
+
+// Compare candidates of ImageIndexLocate by file, then raster order
+static int cmpHit(const void* a, const void* b) {
+  const IndexEntry* p = (const IndexEntry*)a;
+  const IndexEntry* q = (const IndexEntry*)b;
+  if (p->file != q->file) return (p->file < q->file) ? -1 : 1;
+  if (p->y != q->y) return (p->y < q->y) ? -1 : 1;
+  if (p->x != q->x) return (p->x < q->x) ? -1 : 1;
+  return 0;
+}
+
+// Candidate positions of img2 in the corpus of ix, from the index.
+// For each alignment (ox,oy) of the template, the first square at
+// (ox + k*block, oy + l*block) that is not of a single level is looked up.
+// On success, returns the number of candidates, sorted (see cmpHit), in a
+// new array *phits (NULL if there are none).
+// Returns -2 if some alignment only has squares of a single level, and
+// -1 on failure (errCause is set).
+static long indexCandidates(ImageIndex ix, Image img2, IndexEntry** phits) {
+  const int B = ix->block;
+  const int w = img2->width, h = img2->height;
+  const int nx = w - B + 1, ny = h - B + 1;
+  uint64_t AB = 1, CB = 1;   // A^B e C^B, para retirar o termo que sai da janela
+  for (int i = 0; i < B; i++) {
+    AB *= BLOCK_A;
+    CB *= BLOCK_C;
+  }
+  uint64_t* rows = (uint64_t*)malloc((size_t)nx*h * sizeof(uint64_t));
+  uint64_t* sq = (uint64_t*)malloc((size_t)nx*ny * sizeof(uint64_t));
+  uint16_t* run = (uint16_t*)malloc((size_t)w*h * sizeof(uint16_t));
+  IndexEntry* hits = NULL;
+  long count = 0, cap = 0;
+  if (!check( rows != NULL && sq != NULL && run != NULL, "Falha ao alocar memória" )) count = -1;
+
+  for (int y = 0; count == 0 && y < h; y++) {
+    // hashes das janelas de B pixels da linha, a rolar para a direita
+    const uint8* p = img2->pixel + (size_t)y*w;
+    uint64_t* r = rows + (size_t)y*nx;
+    uint64_t v = 0;
+    for (int i = 0; i < B; i++) v = v*BLOCK_A + p[i];
+    r[0] = v;
+    for (int x = 1; x < nx; x++) {
+      v = v*BLOCK_A - p[x-1]*AB + p[x+B-1];
+      r[x] = v;
+    }
+    // comprimento (limitado a B) do troço de pixels iguais a começar em x
+    uint16_t* u = run + (size_t)y*w;
+    u[w-1] = 1;
+    for (int x = w - 2; x >= 0; x--) {
+      u[x] = (p[x] != p[x+1]) ? 1 : (u[x+1] < B) ? u[x+1] + 1 : B;
+    }
+  }
+  if (count == 0) {
+    // as mesmas janelas, agora a rolar para baixo
+    for (int x = 0; x < nx; x++) {
+      uint64_t v = 0;
+      for (int j = 0; j < B; j++) v = v*BLOCK_C + rows[(size_t)j*nx + x];
+      sq[x] = v;
+      for (int y = 1; y < ny; y++) {
+        v = v*BLOCK_C - rows[(size_t)(y-1)*nx + x]*CB + rows[(size_t)(y+B-1)*nx + x];
+        sq[(size_t)y*nx + x] = v;
+      }
+    }
+  }
+  const uint64_t mask = ix->nslots - 1;
+  for (int oy = 0; count >= 0 && oy < B; oy++) {
+    for (int ox = 0; count >= 0 && ox < B; ox++) {
+      int bx = -1, by = -1;
+      for (int y = oy; bx < 0 && y + B <= h; y += B) {
+        for (int x = ox; bx < 0 && x + B <= w; x += B) {
+          const uint8 level = img2->pixel[(size_t)y*w + x];
+          int j = 0;
+          while (j < B && run[(size_t)(y+j)*w + x] >= B && img2->pixel[(size_t)(y+j)*w + x] == level) j++;
+          if (j < B) {
+            bx = x;
+            by = y;
+          }
+        }
+      }
+      if (bx < 0) {
+        count = -2;
+        break;
+      }
+      const uint64_t key = blockKey(sq[(size_t)by*nx + bx]);
+      for (uint64_t i = key & mask; ; i = (i + 1) & mask) {
+        const uint8* slot = ix->slots + i*INDEX_SLOT;
+        uint64_t k = get64(slot);
+        if (k == 0) break;
+        if (k != key) continue;
+        uint32_t f = get32(slot + 8);
+        long tx = (long)get32(slot + 12) - bx, ty = (long)get32(slot + 16) - by;
+        if (f >= (uint32_t)ix->nfiles || tx < 0 || ty < 0) continue;
+        // as mesmas posições que ImageLocateSubImage percorre
+        const uint8* info = ix->files + (size_t)f*INDEX_FILE;
+        if (tx > (long)get32(info + 8) - w || ty > (long)get32(info + 12) - h) continue;
+        if (count == cap) {
+          cap = (cap == 0) ? 64 : 2*cap;
+          IndexEntry* p = (IndexEntry*)realloc(hits, cap * sizeof(IndexEntry));
+          if (!check( p != NULL, "Falha ao alocar memória" )) {
+            count = -1;
+            break;
+          }
+          hits = p;
+        }
+        IndexEntry e = { k, f, (uint32_t)tx, (uint32_t)ty };
+        hits[count++] = e;
+      }
+    }
+  }
+  errsave = errno;
+  free(rows);
+  free(sq);
+  free(run);
+  if (count > 0) {
+    qsort(hits, count, sizeof(IndexEntry), cmpHit);
+    *phits = hits;
+  } else {
+    free(hits);
+    *phits = NULL;
+  }
+  PIXMEM += 2ul*w*h;
+  errno = errsave;
+  return count;
+}
+
+/// Search for img2 in the images of the corpus of ix, in the order they
+/// were given to ImageIndexBuild, as ImageLocateSubImage would do in each
+/// one of them.
+/// If img2 has at least 2*block-1 columns and rows, every position of img2
+/// in a corpus image covers a complete indexed square, so only the
+/// positions given by the hashes of its squares are checked, each by
+/// reading just that region of the corpus file (see ImageLoadRegion) and
+/// comparing it with ImageMatchSubImage.  Smaller templates, and templates
+/// in which all the squares of some alignment are of a single level, are
+/// searched by loading every corpus image in turn.
+/// If a match is found, returns 1 and sets *pfile to the number of the
+/// image (see ImageIndexName) and (*px, *py) to the position of img2 in it.
+/// Returns 0 if img2 is not found, and -1 on failure (for instance, if a
+/// corpus file cannot be read), with errno/errCause set accordingly.
+int ImageIndexLocate(ImageIndex ix, int* pfile, int* px, int* py, Image img2) { ///
+  assert (ix != NULL);
+  assert (img2 != NULL);
+  IndexEntry* hits = NULL;
+  long count = -2;
+  if (img2->width >= 2*ix->block - 1 && img2->height >= 2*ix->block - 1) {
+    count = indexCandidates(ix, img2, &hits);
+    if (count == -1) return -1;
+  }
+  int found = 0;
+  if (count >= 0) {
+    for (long c = 0; found == 0 && c < count; c++) {
+      Image region = ImageLoadRegion(ix->names[hits[c].file], hits[c].x, hits[c].y,
+                                     img2->width, img2->height);
+      if (region == NULL) {
+        found = -1;
+        break;
+      }
+      if (ImageMatchSubImage(region, 0, 0, img2)) {
+        found = 1;
+        if (pfile != NULL) *pfile = hits[c].file;
+        if (px != NULL) *px = hits[c].x;
+        if (py != NULL) *py = hits[c].y;
+      }
+      ImageDestroy(&region);
+    }
+  } else {
+    // o índice não serve para este modelo: pesquisa em todas as imagens
+    for (int f = 0; found == 0 && f < ix->nfiles; f++) {
+      Image img = ImageLoad(ix->names[f]);
+      if (img == NULL) {
+        found = -1;
+        break;
+      }
+      if (ImageLocateSubImage(img, px, py, img2)) {
+        found = 1;
+        if (pfile != NULL) *pfile = f;
+      }
+      ImageDestroy(&img);
+    }
+  }
+  errsave = errno;
+  free(hits);
+  errno = errsave;
+  return found;
+}
@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +25,9 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type ImageIO is a pointer to a background load or save
+typedef struct imageio *ImageIO;
+
 /// Error handling functions
 
 /// Error cause.
@@ -60,19 +65,176 @@ void ImageDestroy(Image* imgp) ;
 
 /// PGM file operations
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) 8 bit PGM files are accepted, as well as
+/// tiled container files (see ImageSaveTiled).
+/// If the file holds several concatenated images, only the first is loaded.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load all the PGM images concatenated in a file.
+/// Up to max images are stored in imgs[0], imgs[1], ...
+/// Bytes after the last image that do not start another PGM image (P5 or
+/// P2 magic number) are ignored, as ImageLoad ignores all after the first.
+/// A tiled container file (see ImageSaveTiled) loads as a single image.
+/// A regular file is mapped in memory and parsed in place, so its raw
+/// rasters are copied once, straight into the images.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadMany(const char* filename, Image imgs[], int max) ;
+
+/// Parse a PGM image (raw P5 or plain P2) from a memory buffer.
+/// Parsing starts at buf and never reads past buf+size.
+/// If consumed != NULL, *consumed is set to the number of bytes parsed
+/// (so that another image following it can be parsed next).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errCause is set accordingly.
+Image ImageLoadMem(const void* buf, size_t size, size_t* consumed) ;
+
+/// Load all the PGM images in an open stream, from its current position
+/// to the end, as ImageLoadMany does (but tiled files are not accepted).
+/// The stream is not closed.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadFile(FILE* f, Image imgs[], int max) ;
+
+/// Load all the PGM images readable from file descriptor fd, from its
+/// current position to the end (for a pipe, until the writer closes it),
+/// as ImageLoadFile does.
+/// The data is read with large read() calls, straight into one buffer.
+/// The descriptor is not closed.
+/// On success, returns the number of images loaded (at least 1).
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns 0, no image is kept and errno/errCause are set.
+int ImageLoadFd(int fd, Image imgs[], int max) ;
+
+/// Load a rectangular region of a PGM file.
+/// The region is specified by the top left corner coords (x, y) and
+/// width w and height h, and must be inside the image stored in the file.
+/// For raw (P5) files, only the header and the rows of the region are read.
+/// Plain (P2) files are loaded whole and then cropped.
+/// Tiled container files (see ImageSaveTiled) are also accepted: only the
+/// tiles that intersect the region are read and decoded.
+/// On success, a new w x h image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
+
+/// Load a PGM file reduced by an integer factor, for previews.
+/// Each output pixel is the mean of a block of factor x factor pixels
+/// (smaller at the right and bottom edges), so the result has
+/// ceil(width/factor) x ceil(height/factor) pixels.
+/// Raw (P5) files are read in batches of rows, averaged as they come,
+/// so only the result and one batch are ever in memory.
+/// Plain (P2) and tiled files are loaded whole and then reduced.
+/// Requires: 1 <= factor <= 255.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadScaled(const char* filename, int factor) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Save image in PGM format to an open stream, at its current position.
+/// The stream is not closed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFile(Image img, FILE* f) ;
+
+/// Save image in PGM format to file descriptor fd, at its current position.
+/// Header and pixels go out in a single writev() call (more, only if the
+/// descriptor takes less at a time, as pipes do).
+/// The descriptor is not closed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFd(Image img, int fd) ;
+
+/// Tiled container files
+
+/// Save image to a tiled container file.
+/// The image is split in tile x tile tiles (e.g. 256), each compressed
+/// independently (tiles are encoded in parallel), and an index of tile
+/// offsets is stored in the header, so that regions can be loaded later by
+/// decoding only the tiles they touch (see ImageLoadTiled, ImageLoadRegion).
+/// Requires: 1 <= tile <= 32768.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveTiled(Image img, const char* filename, int tile) ;
+
+/// Load an image from a tiled container file (see ImageSaveTiled).
+/// The tiles are decoded in parallel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadTiled(const char* filename) ;
+
+/// Sharing pixels
+
+/// Create a new image with the same contents as img, sharing the pixel
+/// memory until either image is changed (copy-on-write, in blocks of rows).
+/// Where memory files are not available, the pixels are copied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageShare(Image img) ;
+
+/// Asynchronous I/O
+
+/// These functions run ImageLoadMany / ImageSave in background threads,
+/// so that disk I/O overlaps with computation.  The Wait functions set
+/// errno/errCause in the calling thread, as the synchronous versions do.
+
+/// Function called by the background threads around each load and save:
+/// op is "load" or "save", begin is 1 when it starts and 0 when it ends.
+/// At the end, imgs[0..n-1] are the images loaded, or the image saved
+/// (n is 0 if the operation failed); they must not be modified or kept.
+/// The function runs in the background thread, so it may use the thread
+/// id or thread-local data to pair the two calls of each operation.
+typedef void (*ImageIOHook)(const char* op, const char* filename, int begin, Image imgs[], int n);
+
+/// Set hook as the function called by the background threads when each
+/// load or save starts and ends (see ImageIOHook); NULL removes it.
+/// Must be set before starting any background load or save.
+void ImageSetIOHook(ImageIOHook hook) ;
+
+/// Start loading the PGM images of a file in a background thread
+/// (see ImageLoadMany).  At most max images (max <= 64) are loaded.
+/// Returns a handle to be passed to ImageLoadWait, or NULL if the
+/// background thread could not be started (the caller may then load
+/// synchronously).
+ImageIO ImageLoadAsync(const char* filename, int max) ;
+
+/// Wait for a background load started by ImageLoadAsync and release *req.
+/// Stores the images in imgs[0], imgs[1], ... and returns their number, as
+/// ImageLoadMany does.  On failure, returns 0 and errno/errCause are set.
+/// Ensures: (*req)==NULL.
+int ImageLoadWait(ImageIO* req, Image imgs[]) ;
+
+/// Start saving img to a PGM file in a background thread.
+/// The pixels are copied first (copy-on-write, see ImageShare), so img
+/// may be modified or destroyed right away.  The file is written under a temporary name and renamed
+/// when complete, so it never appears partially written.
+/// Returns a handle to be passed to ImageSaveWait, or NULL if the copy or
+/// the background thread could not be made (the caller may then save
+/// synchronously).
+ImageIO ImageSaveAsync(Image img, const char* filename) ;
+
+/// Wait for a background save started by ImageSaveAsync and release *req.
+/// Returns nonzero on success.
+/// On failure, returns 0 and errno/errCause are set.
+/// Ensures: (*req)==NULL.
+int ImageSaveWait(ImageIO* req) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -178,6 +340,51 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resampling modes for ImageResize.
+enum {
+  RESIZE_NEAREST = 0,   // nearest source pixel
+  RESIZE_BILINEAR = 1,  // bilinear interpolation
+  RESIZE_AREA = 2,      // area-weighted mean (box filter)
+};
+
+/// Resize an image to w x h pixels.
+/// mode selects how the output pixels are computed:
+///   RESIZE_NEAREST : the nearest source pixel;
+///   RESIZE_BILINEAR : bilinear interpolation of the 4 nearest source pixels;
+///   RESIZE_AREA : mean of the source pixels under the output pixel, each
+///     weighted by the area it covers (the best choice to reduce images).
+/// Requires: w > 0, h > 0 and img is not empty.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int mode) ;
+
+/// Sampling modes for ImageWarpAffine.
+enum {
+  WARP_NEAREST = 0,    // nearest source pixel
+  WARP_BILINEAR = 1,   // bilinear interpolation
+};
+
+/// Apply an affine transformation to an image.
+/// matrix = {a, b, c, d, e, f} maps each pixel (x,y) of img to position
+///   (a*x + b*y + c, d*x + e*y + f)
+/// of the result, which has the same size as img.  (For example, a rotation
+/// by t radians counter-clockwise about the center (cx,cy) has
+/// a = e = cos t, b = -d = sin t, c = cx - a*cx - b*cy, f = cy - d*cx - e*cy.)
+/// Each output pixel samples img at the corresponding position using
+/// interp: WARP_NEAREST (nearest pixel) or WARP_BILINEAR (bilinear
+/// interpolation).  Output pixels that come from outside img are black.
+/// The exact 90 degree rotation of a square image is done by ImageRotate.
+/// Requires: the matrix is invertible (a*e - b*d != 0).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double matrix[6], int interp) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -194,6 +401,15 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend an image into a larger image through an alpha mask.
+/// Blend img2 into position (x, y) of img1, where each pixel is weighted
+/// by the corresponding level a of mask (0 keeps img1, 255 gives img2):
+///   p1 = (a*p2 + (255-a)*p1 + 127) / 255   (integer division).
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -203,14 +419,503 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Templates of at least 3x3 pixels are searched coarse-to-fine: candidates
+/// are first rejected using the cached pyramid of img1 (see ImagePyramidBuild)
+/// and only the survivors are checked with ImageMatchSubImage.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Image pyramids
+
+/// Build (and cache in img) a pyramid with up to levels reduced levels.
+/// Level k is (width>>k)x(height>>k) and each of its pixels is the rounded
+/// mean of a 2x2 block of level k-1 (level 0 is img itself).
+/// Incomplete blocks on the right/bottom margins are discarded.
+/// Levels already cached are reused.
+/// The cache is dropped automatically whenever the pixels of img change.
+/// On success, returns the number of levels available (may be < levels,
+/// if the image is too small).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImagePyramidBuild(Image img, int levels) ;
+
+/// Get level k of the cached pyramid of img (level 0 is img itself).
+/// Requires: 0 <= k <= number of levels built by ImagePyramidBuild.
+/// The returned image belongs to img and must not be destroyed or modified.
+Image ImagePyramidLevel(Image img, int k) ;
+
+/// Discard the cached pyramid of img, if any.
+void ImagePyramidDrop(Image img) ;
+
+/// Approximate matching
+
+/// Similarity measures for ImageLocateBest.
+enum {
+  MATCH_SAD = 0,  // sum of absolute differences (lower is better)
+  MATCH_NCC = 1,  // normalized cross-correlation (higher is better)
+  MATCH_NCC_SPATIAL = 2,  // MATCH_NCC, always by the spatial method (for testing)
+  MATCH_NCC_FFT = 3,      // MATCH_NCC, always by FFT correlation (for testing)
+};
+
+/// Find the position where img2 best matches a subimage of img1.
+/// metric selects the similarity measure:
+///   MATCH_SAD : sum of absolute differences (lower is better, 0 is exact);
+///   MATCH_NCC : normalized cross-correlation (higher is better, in [-1, 1]).
+///     Where the window or the template is uniform, the NCC is undefined and
+///     taken as 1 if both are uniform, 0 otherwise.
+/// Every position where img2 fits inside img1 is considered; ties are
+/// resolved in favour of the first position in raster order.
+/// MATCH_NCC_SPATIAL and MATCH_NCC_FFT give the same result as MATCH_NCC,
+/// but always by the spatial or by the FFT method.
+/// For large templates, the NCC cross terms are computed by FFT correlation
+/// (chosen automatically by a cost model); candidates are then confirmed
+/// exactly, so the result is the same as the spatial search.
+/// On success, returns 1 and sets (*px, *py) to the best position and
+/// *score to its metric value.
+/// If img2 does not fit inside img1, returns 0 and leaves the outputs untouched.
+/// On failure (out of memory), returns 0 and errno/errCause are set accordingly.
+int ImageLocateBest(Image img1, Image img2, int metric, int* px, int* py, double* score) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped at the borders), rounded.
+/// The time per pixel does not depend on dx and dy, and the extra memory is
+/// a few rows per thread (about 3*dy + 5 rows), not a copy of the image.
 /// The image is changed in-place.
+/// On failure (out of memory), img is unchanged and errCause is set.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Morphological filters
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle: each pixel is
+/// substituted by the minimum of the pixels in [x-dx, x+dx]x[y-dy, y+dy]
+/// (clipped at the borders, as in ImageBlur).
+/// The time per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle: each pixel is
+/// substituted by the maximum of the pixels in [x-dx, x+dx]x[y-dy, y+dy]
+/// (clipped at the borders, as in ImageBlur).
+/// The time per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Morphological opening: erosion followed by dilation with the same
+/// (2dx+1)x(2dy+1) rectangle.  Removes light details smaller than it.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Morphological closing: dilation followed by erosion with the same
+/// (2dx+1)x(2dy+1) rectangle.  Removes dark details smaller than it.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, img is unchanged and errCause is set.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Paged (out-of-core) images
+
+/// A paged image keeps its pixels in a file (raw PGM, or a tiled container
+/// for read-only images) and only a bounded set of tiles in memory, managed
+/// as an LRU cache.  Cache hits and misses are counted in the "pghit" and
+/// "pgmiss" instrumentation counters.
+
+// Type PagedImage is a pointer to paged image objects
+typedef struct paged *PagedImage;
+
+/// Open a raw PGM (P5) or tiled container file as a read-only paged image.
+/// At most budget bytes of pixel tiles are kept in memory (at least 4 tiles).
+/// On success, returns the paged image.
+/// (The caller is responsible for closing it with ImagePagedClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PagedImage ImagePagedOpen(const char* filename, long budget) ;
+
+/// Create a new black width x height raw PGM file and open it as a
+/// writable paged image (see ImagePagedOpen).
+/// Changes are written to the file when tiles are evicted from memory and
+/// by ImagePagedClose.
+/// On success, returns the paged image.
+/// (The caller is responsible for closing it with ImagePagedClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PagedImage ImagePagedCreate(const char* filename, int width, int height, uint8 maxval, long budget) ;
+
+/// Close the paged image pointed to by (*pp), writing back modified tiles.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+/// Returns nonzero on success, or 0 if any I/O error happened while the
+/// image was open (errno/errCause are set).
+int ImagePagedClose(PagedImage* pp) ;
+
+/// Get paged image width
+int ImagePagedWidth(PagedImage p) ;
+
+/// Get paged image height
+int ImagePagedHeight(PagedImage p) ;
+
+/// Get paged image maxval
+int ImagePagedMaxval(PagedImage p) ;
+
+/// Get the pixel (level) at position (x,y) of a paged image.
+/// Returns 0 if the tile could not be read (see ImagePagedClose).
+uint8 ImagePagedGetPixel(PagedImage p, int x, int y) ;
+
+/// Set the pixel at position (x,y) of a writable paged image.
+void ImagePagedSetPixel(PagedImage p, int x, int y, uint8 level) ;
+
+/// Crop a rectangular subimage from a paged image into a new (in-memory)
+/// image.  Only the tiles that intersect the rectangle are loaded.
+/// Requires: the rectangle must be inside p.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImagePagedCrop(PagedImage p, int x, int y, int w, int h) ;
+
+/// Mirror a paged image (flip left-right) into dst.
+/// Requires: dst is writable and has the same size as src.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePagedMirror(PagedImage src, PagedImage dst) ;
+
+/// Rotate a paged image 90 degrees anti-clockwise into dst.
+/// Requires: dst is writable and is src->height x src->width.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePagedRotate(PagedImage src, PagedImage dst) ;
+
+/// Blur a paged image with a (2dx+1)x(2dy+1) mean filter into dst
+/// (see ImageBlur).
+/// Requires: dst is writable and has the same size as src.
+/// Works one destination tile at a time: each tile is blurred in memory
+/// with a margin of dx columns and dy rows around it, and split in smaller
+/// blocks if that window does not fit in the memory budget of src.
+/// On success, returns nonzero.
+/// On failure (including a window that does not fit in the budget even
+/// for a single pixel), returns 0 and errno/errCause are set accordingly.
+int ImagePagedBlur(PagedImage src, PagedImage dst, int dx, int dy) ;
+
+/// Locate a subimage inside a paged image (see ImageLocateSubImage).
+/// Works on blocks of candidate positions whose windows (the block plus
+/// the template size) fit in the memory budget of p, and finds the same
+/// position as ImageLocateSubImage on the whole image.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure (including a template too large for the budget), returns -1
+/// and errno/errCause are set accordingly.
+int ImagePagedLocateSubImage(PagedImage p, int* px, int* py, Image img2) ;
+
+/// Run-length encoded binary images
+
+/// An RLE image is a binary image (each pixel is black = 0 or white = maxval)
+/// stored as the list of the white runs of each row, as produced by
+/// thresholding.  Its operations work on the runs, so their cost depends on
+/// the number of black/white transitions rather than on the number of pixels.
+
+// Type RLEImage is a pointer to RLE image objects
+typedef struct rle *RLEImage;
+
+/// Threshold an image into a run-length encoded binary image, in a single
+/// pass over the pixels (see ImageThreshold): pixels with level>=thr become
+/// white runs, the others black.
+/// The original img is not modified.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying it with ImageRLEDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage ImageRLEThreshold(Image img, uint8 thr) ;
+
+/// Destroy the RLE image pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void ImageRLEDestroy(RLEImage* rp) ;
+
+/// Get RLE image width
+int ImageRLEWidth(RLEImage r) ;
+
+/// Get RLE image height
+int ImageRLEHeight(RLEImage r) ;
+
+/// Get the number of white runs in an RLE image.
+long ImageRLERuns(RLEImage r) ;
+
+/// Convert an RLE image back to an ordinary image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRLEDecode(RLEImage r) ;
+
+/// Save an RLE image to a raw PGM file.
+/// The pixels are expanded one row at a time, as they are written.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageRLESave(RLEImage r, const char* filename) ;
+
+/// Transform an RLE image to its negative, in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, r is unchanged and errCause is set.
+int ImageRLENegative(RLEImage r) ;
+
+/// Paste an RLE image into a larger one.
+/// Paste r2 into position (x, y) of r1, in-place (see ImagePaste).
+/// Requires: r2 must fit inside r1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, r1 is unchanged and errCause is set.
+int ImageRLEPaste(RLEImage r1, int x, int y, RLEImage r2) ;
+
+/// Crop a rectangular subimage from an RLE image (see ImageCrop).
+/// Requires: the rectangle must be inside r.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying it with ImageRLEDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage ImageRLECrop(RLEImage r, int x, int y, int w, int h) ;
+
+/// Compare an RLE image to a subimage of a larger RLE image, by comparing
+/// their runs (see ImageMatchSubImage).  Only the black/white pattern is
+/// compared (not maxval).
+/// Returns 1 (true) if r2 matches subimage of r1 at pos (x, y).
+/// Returns 0, otherwise.
+int ImageRLEMatchSubImage(RLEImage r1, int x, int y, RLEImage r2) ;
+
+/// Locate an RLE subimage inside a larger RLE image (see
+/// ImageLocateSubImage): the first matching position, in raster order, is
+/// found.  Only the black/white pattern is compared (not maxval).
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageRLELocateSubImage(RLEImage r1, int* px, int* py, RLEImage r2) ;
+
+/// Bit-packed binary images
+
+/// A bitmap is a binary image (each pixel is black = 0 or white = maxval)
+/// stored with one bit per pixel, 64 pixels per word, each row padded to a
+/// whole number of words.  Comparisons and morphology work on whole words,
+/// so they handle 64 pixels per operation.
+
+// Type BitImage is a pointer to bitmap objects
+typedef struct bitmap *BitImage;
+
+/// Threshold an image into a bit-packed binary image (see ImageThreshold):
+/// pixels with level>=thr become white, the others black.
+/// The original img is not modified.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying it with ImageBitDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageBitThreshold(Image img, uint8 thr) ;
+
+/// Destroy the bitmap pointed to by (*bp).
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+void ImageBitDestroy(BitImage* bp) ;
+
+/// Get bitmap width
+int ImageBitWidth(BitImage b) ;
+
+/// Get bitmap height
+int ImageBitHeight(BitImage b) ;
+
+/// Convert a bitmap back to an ordinary image (white pixels get maxval).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBitDecode(BitImage b) ;
+
+/// Compare a bitmap to a subimage of a larger bitmap, 64 pixels at a time.
+/// Only the black/white pattern is compared (not maxval).
+/// Returns 1 (true) if at most tol pixels of b2 differ from the subimage
+/// of b1 at pos (x, y) (tol = 0 requires an exact match).
+/// Returns 0, otherwise.
+int ImageBitMatchSubImage(BitImage b1, int x, int y, BitImage b2, long tol) ;
+
+/// Locate a subimage inside a larger bitmap (see ImageLocateSubImage),
+/// allowing up to tol differing pixels (see ImageBitMatchSubImage).
+/// The first matching position, in raster order, is found.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageBitLocateSubImage(BitImage b1, int* px, int* py, BitImage b2, long tol) ;
+
+/// Erode a bitmap with a (2dx+1)x(2dy+1) rectangle (see ImageErode).
+/// The bitmap is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, b is unchanged and errCause is set.
+int ImageBitErode(BitImage b, int dx, int dy) ;
+
+/// Dilate a bitmap with a (2dx+1)x(2dy+1) rectangle (see ImageDilate).
+/// The bitmap is changed in-place.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, b is unchanged and errCause is set.
+int ImageBitDilate(BitImage b, int dx, int dy) ;
+
+/// Morphological opening of a bitmap (see ImageOpen).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errCause is set; b may have
+/// been eroded only.
+int ImageBitOpen(BitImage b, int dx, int dy) ;
+
+/// Morphological closing of a bitmap (see ImageClose).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errCause is set; b may have
+/// been dilated only.
+int ImageBitClose(BitImage b, int dx, int dy) ;
+
+/// Connected components
+
+/// Statistics of a connected component.
+typedef struct {
+  long area;         // number of pixels
+  int x, y, w, h;    // bounding box
+  double cx, cy;     // centroid (mean of the pixel coordinates)
+} ImageBlob;
+
+// Type LabelMap is a pointer to label map objects
+typedef struct labelmap *LabelMap;
+
+/// Label the connected components of the foreground (nonzero) pixels of
+/// img, as after ImageThreshold.
+/// connectivity is 4 (pixels touch by the sides) or 8 (also by the corners).
+/// Components are numbered 1, 2, ... in raster order of their first pixel;
+/// background pixels get label 0.  For each component, its area, bounding
+/// box and centroid are computed (see ImageBlob).
+/// On success, a new label map is returned.
+/// (The caller is responsible for destroying it with ImageLabelDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+LabelMap ImageLabel(Image img, int connectivity) ;
+
+/// Destroy the label map pointed to by (*lp).
+/// If (*lp)==NULL, no operation is performed.
+/// Ensures: (*lp)==NULL.
+void ImageLabelDestroy(LabelMap* lp) ;
+
+/// Get the number of components of a label map.
+int ImageLabelCount(LabelMap lm) ;
+
+/// Get the labels of a label map: width*height labels, row by row
+/// (the label of pixel (x,y) is at index y*width + x).
+/// The array belongs to lm and must not be modified or freed.
+const uint32_t* ImageLabelMap(LabelMap lm) ;
+
+/// Get the statistics of component k (1 <= k <= ImageLabelCount(lm)).
+/// The blob belongs to lm and must not be modified or freed.
+const ImageBlob* ImageLabelBlob(LabelMap lm, int k) ;
+
+/// Image stacking
+
+/// Combination modes for ImageStack.
+enum {
+  STACK_MEAN = 0,    // rounded mean
+  STACK_MEDIAN = 1,  // median (lower median, for an even number of images)
+  STACK_MIN = 2,     // minimum
+  STACK_MAX = 3,     // maximum
+};
+
+/// Combine n images of the same size, pixel by pixel, as given by op:
+///   STACK_MEAN : the rounded mean of the n levels;
+///   STACK_MEDIAN : the median level (for even n, the lower of the two
+///     middle levels);
+///   STACK_MIN, STACK_MAX : the minimum or maximum level.
+/// The images are read from the files files[0..n-1], all at the same time,
+/// in batches of rows, so that at most a few MB of input are in memory
+/// (at least one row of each file), besides the result.
+/// Plain (P2) and tiled files cannot be read by rows and are loaded whole.
+/// The result has the largest maxval of the inputs.
+/// Requires: 1 <= n <= 65535.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageStack(const char* files[], int n, int op) ;
+
+/// Image comparison
+
+/// Differences between two images (see ImageCompare).
+typedef struct {
+  int maxabs;       // largest absolute difference
+  double mae;       // mean absolute difference
+  double mse;       // mean squared difference
+  double psnr;      // peak signal-to-noise ratio, in dB
+  double ssim;      // mean structural similarity, in [-1, 1]
+} ImageMetrics;
+
+/// Compare two images of the same size, pixel by pixel.
+/// Computes into *metrics:
+///   maxabs : the largest absolute difference of levels;
+///   mae, mse : the mean absolute and mean squared differences;
+///   psnr : the peak signal-to-noise ratio 10*log10(L^2/mse) in dB, where L
+///     is the largest maxval of the two images (INFINITY if mse is 0);
+///   ssim : the mean structural similarity of all the 8x8 windows (smaller,
+///     if an image is smaller), in [-1, 1], with 1 for identical images.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly
+/// (also if the images do not have the same size).
+int ImageCompare(Image img1, Image img2, ImageMetrics* metrics) ;
+
+/// Content hashing and corpus index
+
+/// Compute a 64-bit hash of the contents of img: its size, maxval and pixels.
+/// Images with the same contents have the same hash; images with different
+/// contents have different hashes, except with negligible probability
+/// (it is not a cryptographic hash, though).
+/// The pixels are hashed with SIMD instructions, at several GB/s, and the
+/// result is the same on every platform, so it may be stored in files.
+uint64_t ImageHash(Image img) ;
+
+// Type ImageIndex is a pointer to corpus index objects
+typedef struct imageindex *ImageIndex;
+
+/// Build an index of the images in files files[0..n-1] (the corpus) and
+/// save it to file indexfile.
+/// Each image is split into block x block squares, aligned at multiples of
+/// block.  The hash of each square that is not of a single level is stored,
+/// with the image and the position of the square, in an open-addressing
+/// hash table, followed by the content hash of each image (see ImageHash)
+/// and the file names.  The index file is used mapped into memory, as is,
+/// by ImageIndexOpen.
+/// Requires: 2 <= block <= 1024, n >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageIndexBuild(const char* indexfile, const char* files[], int n, int block) ;
+
+/// Open the corpus index saved in file indexfile by ImageIndexBuild.
+/// The file is mapped into memory, not read: only the parts of the table
+/// used by the queries are ever read from disk.
+/// On success, a new index object is returned.
+/// (The caller is responsible for destroying it with ImageIndexClose!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexOpen(const char* indexfile) ;
+
+/// Close the corpus index pointed to by (*ip).
+/// If (*ip)==NULL, no operation is performed.
+/// Ensures: (*ip)==NULL.
+void ImageIndexClose(ImageIndex* ip) ;
+
+/// Get the number of images in the corpus of an index.
+int ImageIndexCount(ImageIndex ix) ;
+
+/// Get the file name of image i of the corpus (0 <= i < ImageIndexCount(ix)).
+/// The name belongs to ix and must not be modified or freed.
+const char* ImageIndexName(ImageIndex ix, int i) ;
+
+/// Find an image of the corpus with the same contents as img, by its
+/// content hash (see ImageHash), without reading any corpus file.
+/// Returns the number of the first such image, or -1 if there is none.
+int ImageIndexFind(ImageIndex ix, Image img) ;
+
+/// Search for img2 in the images of the corpus of ix, in the order they
+/// were given to ImageIndexBuild, as ImageLocateSubImage would do in each
+/// one of them.
+/// If img2 has at least 2*block-1 columns and rows, only the positions
+/// given by the hashes of its squares are checked, each by reading just
+/// that region of the corpus file and comparing it with ImageMatchSubImage.
+/// Smaller templates, and templates in which all the squares of some
+/// alignment are of a single level, are searched by loading every corpus
+/// image in turn.
+/// If a match is found, returns 1 and sets *pfile to the number of the
+/// image (see ImageIndexName) and (*px, *py) to the position of img2 in it.
+/// Returns 0 if img2 is not found, and -1 on failure (for instance, if a
+/// corpus file cannot be read), with errno/errCause set accordingly.
+int ImageIndexLocate(ImageIndex ix, int* pfile, int* px, int* py, Image img2) ;
+
 #endif
@@ -0,0 +1,348 @@
+// imageProfile - Empirical complexity of the image8bit operations.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// João Manuel Rodrigues <jmr@ua.pt>
+// 2023
+
+// Each operation is run on generated images of growing size, and on
+// growing values of its parameter (window radius, template size or
+// position...).  The instrumentation counters and the cpu time of each run
+// are fitted to y = a*x^b by least squares on log-log scale, and the
+// candidate models 1, x, x log x and x^2 are ranked by how constant y/model
+// is.  The counters are deterministic, so their exponents are compared
+// with the expected model of each sweep: an exponent above it is reported
+// as a regression (and the exit status is 1).  Times are only reported.
+// The counters are per thread, and ParallelFor adds the counts of its
+// worker threads to the caller's, so InstrCount read after a run holds
+// exactly the work of that run, with any number of threads (-t).
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "image8bit.h"
+#include "instrumentation.h"
+#include "parallel.h"
+
+static const char* USAGE =
+    "USAGE: imageProfile [-t THREADS] [-s MAXSIDE] [OPERATION...]\n"
+    "  Run each OPERATION (all, by default) on generated images of growing\n"
+    "  size and on growing values of its parameter, fit the instrumentation\n"
+    "  counters and cpu times to candidate models (1, x, x log x, x^2) and\n"
+    "  print the fitted exponents.  Exits with status 1 if some counter grows\n"
+    "  faster than expected.\n"
+    "\n"
+    "  -t THREADS      Worker threads (default 1, for reproducible times)\n"
+    "  -s MAXSIDE      Largest image side in size sweeps (default 1024)\n"
+    "\n"
+    "OPERATIONS:\n"
+    "  neg rotate crop resize blur erode locate match label compare hash\n"
+    ;
+
+// Minimum cpu time measured for each point (runs are repeated until then)
+#define MINTIME 0.02
+
+// Maximum number of points of a sweep
+#define MAXPOINTS 12
+
+// Side of the images in parameter sweeps
+#define PARAMSIDE 512
+
+// Candidate models: f(x) = x^e * log2(x)^l
+typedef struct {
+  const char* name;   // com x = n ou k, conforme o varrimento
+  double e;
+  int l;
+} Model;
+
+static const Model models[] = {
+  { "1", 0.0, 0 },
+  { "x", 1.0, 0 },
+  { "x log x", 1.0, 1 },
+  { "x^2", 2.0, 0 },
+};
+#define NMODELS (int)(sizeof(models) / sizeof(models[0]))
+
+// One sweep of an operation
+typedef struct {
+  const char* op;
+  int param;          // 0: varre o tamanho (x = n pixels); 1: varre k
+  const char* var;    // o que é k, nos varrimentos do parâmetro
+  int k[MAXPOINTS];   // valores de k (ou o k fixo, em k[0], se param == 0)
+  int expect;         // modelo esperado dos contadores (índice em models)
+  // Prepare the operand of the operation (may return NULL)
+  Image (*setup)(Image img, int k);
+  // Run the operation on img (changed or not) with parameter k
+  void (*run)(Image img, int k, Image aux);
+} Sweep;
+
+static void runNeg(Image img, int k, Image aux) {
+  ImageNegative(img);
+}
+
+static void runRotate(Image img, int k, Image aux) {
+  Image r = ImageRotate(img);
+  ImageDestroy(&r);
+}
+
+static void runCrop(Image img, int k, Image aux) {
+  Image r = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  ImageDestroy(&r);
+}
+
+static void runResize(Image img, int k, Image aux) {
+  Image r = ImageResize(img, ImageWidth(img)/2, ImageHeight(img)/2, RESIZE_AREA);
+  ImageDestroy(&r);
+}
+
+static void runBlur(Image img, int k, Image aux) {
+  ImageBlur(img, k, k);
+}
+
+static void runErode(Image img, int k, Image aux) {
+  ImageErode(img, k, k);
+}
+
+// Template of size k x k cut from the bottom right corner of img, so that
+// it is found at the last positions searched.
+static Image setupCorner(Image img, int k) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  return ImageCrop(img, w - k - 1, h - k - 1, k, k);
+}
+
+// Template of 16x16 pixels cut from row k of img, at the middle column.
+static Image setupRow(Image img, int k) {
+  return ImageCrop(img, ImageWidth(img)/2, k, 16, 16);
+}
+
+static void runLocate(Image img, int k, Image aux) {
+  int x, y;
+  ImageLocateSubImage(img, &x, &y, aux);
+}
+
+static void runMatch(Image img, int k, Image aux) {
+  int x, y;
+  double score;
+  ImageLocateBest(img, aux, MATCH_SAD, &x, &y, &score);
+}
+
+static void runLabel(Image img, int k, Image aux) {
+  LabelMap lm = ImageLabel(img, 8);
+  ImageLabelDestroy(&lm);
+}
+
+static Image setupCopy(Image img, int k) {
+  return ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+}
+
+static void runCompare(Image img, int k, Image aux) {
+  ImageMetrics m;
+  ImageCompare(img, aux, &m);
+}
+
+static void runHash(Image img, int k, Image aux) {
+  ImageHash(img);
+}
+
+static const Sweep sweeps[] = {
+  { "neg", 0, NULL, { 0 }, 1, NULL, runNeg },
+  { "rotate", 0, NULL, { 0 }, 1, NULL, runRotate },
+  { "crop", 0, NULL, { 0 }, 1, NULL, runCrop },
+  { "resize", 0, NULL, { 0 }, 1, NULL, runResize },
+  { "blur", 0, NULL, { 4 }, 1, NULL, runBlur },
+  { "blur", 1, "dx=dy", { 1, 2, 4, 8, 16, 32, 64 }, 0, NULL, runBlur },
+  { "erode", 0, NULL, { 4 }, 1, NULL, runErode },
+  { "erode", 1, "dx=dy", { 1, 2, 4, 8, 16, 32, 64 }, 0, NULL, runErode },
+  { "locate", 0, NULL, { 16 }, 1, setupCorner, runLocate },
+  { "locate", 1, "position (pixels before the match)", { 16, 32, 64, 128, 256, 480 }, 1, setupRow, runLocate },
+  { "match", 0, NULL, { 8 }, 1, setupCorner, runMatch },
+  { "match", 1, "template pixels", { 8, 16, 32, 64 }, 1, setupCorner, runMatch },
+  { "label", 0, NULL, { 0 }, 1, NULL, runLabel },
+  { "compare", 0, NULL, { 0 }, 1, setupCopy, runCompare },
+  { "hash", 0, NULL, { 0 }, 1, NULL, runHash },
+};
+#define NSWEEPS (int)(sizeof(sweeps) / sizeof(sweeps[0]))
+
+// x of a point: n = number of pixels, or k (or the value derived from k)
+static double xOf(const Sweep* s, int side, int k) {
+  if (!s->param) return (double)side * side;
+  if (s->setup == setupRow) return (double)k * PARAMSIDE + PARAMSIDE/2;
+  if (s->setup == setupCorner) return (double)k * k;
+  return k;
+}
+
+// A side x side image of pseudo-random levels, the same on every run.
+static Image noise(int side) {
+  Image img = ImageCreate(side, side, 255);
+  if (img == NULL) error(4, errno, "Creating image: %s", ImageErrMsg());
+  unsigned int seed = (unsigned int)side;
+  for (int y = 0; y < side; y++) {
+    for (int x = 0; x < side; x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+  return img;
+}
+
+// Least squares fit of log(y) = log(a) + b*log(x).  Returns b.
+static double fitExponent(const double* x, const double* y, int n) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < n; i++) {
+    double lx = log(x[i]), ly = log(y[i]);
+    sx += lx;
+    sy += ly;
+    sxx += lx*lx;
+    sxy += lx*ly;
+  }
+  double d = n*sxx - sx*sx;
+  return (d > 0.0) ? (n*sxy - sx*sy) / d : 0.0;
+}
+
+// Index of the model for which y/f(x) varies least (standard deviation of
+// its logarithm).
+static int bestModel(const double* x, const double* y, int n) {
+  int best = 0;
+  double bestdev = INFINITY;
+  for (int m = 0; m < NMODELS; m++) {
+    double s = 0, ss = 0;
+    for (int i = 0; i < n; i++) {
+      double r = log(y[i]) - models[m].e*log(x[i]);
+      if (models[m].l) r -= log(log2(x[i]));
+      s += r;
+      ss += r*r;
+    }
+    double dev = ss/n - (s/n)*(s/n);
+    if (dev < bestdev - 1e-9) {
+      bestdev = dev;
+      best = m;
+    }
+  }
+  return best;
+}
+
+// Name of model m for a sweep: x is n or k.
+static const char* modelName(int m, int param, char* buf, size_t size) {
+  const char* x = param ? "k" : "n";
+  switch (m) {
+    case 0: snprintf(buf, size, "1"); break;
+    case 1: snprintf(buf, size, "%s", x); break;
+    case 2: snprintf(buf, size, "%s log %s", x, x); break;
+    default: snprintf(buf, size, "%s^2", x); break;
+  }
+  return buf;
+}
+
+// Run sweep s, print its report and return the number of regressions.
+static int profile(const Sweep* s, int maxside) {
+  int sides[MAXPOINTS], ks[MAXPOINTS];
+  int n = 0;
+  if (s->param) {
+    for (; n < MAXPOINTS && s->k[n] > 0; n++) {
+      sides[n] = PARAMSIDE;
+      ks[n] = s->k[n];
+    }
+  } else {
+    for (int side = 64; side <= maxside && n < MAXPOINTS; side *= 2, n++) {
+      sides[n] = side;
+      ks[n] = s->k[0];
+    }
+  }
+  double x[MAXPOINTS];
+  double y[NUMCOUNTERS + 1][MAXPOINTS];   // contadores e, no fim, o tempo
+  for (int i = 0; i < n; i++) {
+    Image img = noise(sides[i]);
+    Image aux = (s->setup != NULL) ? s->setup(img, ks[i]) : NULL;
+    x[i] = xOf(s, sides[i], ks[i]);
+    // os contadores são de uma só execução (desta thread e das de
+    // ParallelFor); o tempo, da média de várias
+    InstrReset();
+    s->run(img, ks[i], aux);
+    for (int c = 0; c < NUMCOUNTERS; c++) y[c][i] = (double)InstrCount[c];
+    int reps = 0;
+    double t0 = cpu_time(), t;
+    do {
+      s->run(img, ks[i], aux);
+      reps++;
+    } while ((t = cpu_time() - t0) < MINTIME);
+    y[NUMCOUNTERS][i] = t / reps;
+    ImageDestroy(&aux);
+    ImageDestroy(&img);
+  }
+
+  if (s->param) {
+    printf("# %s: sweep of k = %s, on %dx%d images\n", s->op, s->var, PARAMSIDE, PARAMSIDE);
+  } else if (s->k[0] > 0) {
+    printf("# %s: sweep of n = pixels, with k = %d\n", s->op, s->k[0]);
+  } else {
+    printf("# %s: sweep of n = pixels\n", s->op);
+  }
+  printf("%12s", s->param ? "k" : "n");
+  for (int i = 0; i < n; i++) printf(" %11.0f", x[i]);
+  printf("\n");
+  int regressions = 0;
+  char name[32], expected[32];
+  for (int c = 0; c <= NUMCOUNTERS; c++) {
+    int counter = (c < NUMCOUNTERS);
+    if (counter && InstrName[c] == NULL) continue;
+    int zero = 0;
+    for (int i = 0; i < n; i++) zero |= (y[c][i] <= 0.0);
+    if (zero) continue;   // contador não usado (ou tempo abaixo da resolução)
+    printf("%12s", counter ? InstrName[c] : "time");
+    for (int i = 0; i < n; i++) printf(" %11.4g", y[c][i]);
+    double b = fitExponent(x, y[c], n);
+    int m = bestModel(x, y[c], n);
+    printf("   exponent %5.2f  ~ %s", b, modelName(m, s->param, name, sizeof(name)));
+    if (counter) {
+      // um termo log acrescenta pouco ao expoente nestas gamas de x
+      int slower = b > models[s->expect].e + (models[s->expect].l ? 0.35 : 0.2);
+      printf("  (expected %s)%s", modelName(s->expect, s->param, expected, sizeof(expected)),
+             slower ? "  REGRESSION" : "");
+      regressions += slower;
+    }
+    printf("\n");
+  }
+  printf("\n");
+  return regressions;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  int maxside = 1024;
+  int threads = 1;
+  int k = 1;
+  for (; k < ac && av[k][0] == '-'; k++) {
+    if (strcmp(av[k], "-t") == 0 && k+1 < ac && sscanf(av[k+1], "%d", &threads) == 1 && threads >= 1) {
+      k++;
+    } else if (strcmp(av[k], "-s") == 0 && k+1 < ac && sscanf(av[k+1], "%d", &maxside) == 1 && maxside >= 256) {
+      k++;
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  for (int i = k; i < ac; i++) {
+    int known = 0;
+    for (int j = 0; j < NSWEEPS; j++) known |= (strcmp(av[i], sweeps[j].op) == 0);
+    if (!known) error(1, 0, "Unknown operation %s\n%s", av[i], USAGE);
+  }
+
+  ImageInit();
+  ParallelSetThreads(threads);
+
+  int regressions = 0;
+  for (int j = 0; j < NSWEEPS; j++) {
+    int selected = (k == ac);
+    for (int i = k; i < ac; i++) selected |= (strcmp(av[i], sweeps[j].op) == 0);
+    if (selected) regressions += profile(&sweeps[j], maxside);
+  }
+  printf("# %d regression(s)\n", regressions);
+  return regressions > 0;
+}
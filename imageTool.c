@@ -9,59 +9,147 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
+#include "parallel.h"
+#include "queue.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [--trace TRACE] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [--trace TRACE] batch DIR FILE... -- [OPERATION [OPERAND...]]\n"
+    "       imageTool index INDEX BLOCK FILE...\n"
+    "       imageTool stack MODE DEST FILE...\n"
+    "       imageTool paged BUDGET FILE OPERATION [OPERAND] [DEST]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
     "  Some operations create images, which are appended to an internal buffer:\n"
     "      I0, I1, ..., PRED, CURR\n"
+    "  Images may also be given names, to be used later in the pipeline.\n"
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
+    "  In batch mode, each FILE is loaded, the OPERATIONS are applied to it\n"
+    "  (the buffer starts with just that image) and the final CURR is saved\n"
+    "  to DIR with the same file name.  Loading, processing and saving run\n"
+    "  concurrently, on different files; the time spent by each stage and\n"
+    "  the waits between them are reported at the end.\n"
+    "\n"
+    "  In index mode, the FILEs are indexed by the hashes of their aligned\n"
+    "  BLOCKxBLOCK squares (BLOCK = 2 to 1024) into file INDEX, for search.\n"
+    "\n"
+    "  In stack mode, the FILEs (images of the same size) are combined pixel\n"
+    "  by pixel, reading them by rows, and the result is saved to file DEST.\n"
+    "  MODE is mean (rounded), median (the lower one, for an even number of\n"
+    "  FILEs), min or max.\n"
+    "\n"
+    "  In paged mode, FILE (raw or tiled) is processed out of core, with at\n"
+    "  most BUDGET bytes of its tiles in memory, by one of the OPERATIONS\n"
+    "  blur DX,DY DEST, mirror DEST, rotate DEST, crop X,Y,W,H DEST (these\n"
+    "  write raw PGM file DEST) or locate TEMPLATE (search image file\n"
+    "  TEMPLATE in FILE, print matching position, or NOTFOUND).\n"
+    "\n"
+    "  With --trace, each operation, load and save is recorded in file TRACE\n"
+    "  (Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev),\n"
+    "  with its thread, image size, pixel bytes touched and counter deltas.\n"
+    "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit raw (P5) or plain (P2) PGM format are accepted.\n"
+    "  A file with several concatenated images loads all of them.\n"
+    "  Tiled files written by tsave are also accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  The name - stands for the standard input (all images in it) and for\n"
+    "  the standard output in save, so that imageTool may be used in pipes.\n"
+    "  When an image is saved to -, reports (info, locate, hash, ...) are\n"
+    "  written to the standard error instead.\n"
     "\n"
     "OPERATIONS:\n"
-    "  FILE            Load PGM image file, creating new image\n"
+    "  FILE            Load PGM image file, creating new image(s)\n"
+    "  FILE@X,Y,W,H    Load only a rectangle of PGM image file, creating new image\n"
+    "  preview FACTOR  Load the next FILEs reduced by FACTOR (1 to 255), averaging\n"
+    "                  each FACTORxFACTOR block as it is read (1 = full size)\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  tsave FILE      Save CURR to tiled, compressed file (256x256 tiles)\n"
+    "  as NAME         Name a copy of CURR (copy-on-write: no pixels are copied)\n"
+    "  use NAME        Copy the image named NAME, creating new image\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
+    "  rle LEVEL       Apply thresholding to CURR through a run-length encoded\n"
+    "                  image (same result as thr)\n"
+    "  rleneg, rlecrop X,Y,W,H, rlepaste X,Y, rlesave FILE\n"
+    "                  Same as neg, crop, paste and save, on the run-length\n"
+    "                  encoded black (0) / white (nonzero) pixels of the images\n"
+    "                  (white becomes maxval)\n"
+    "  bthr LEVEL      Apply thresholding to CURR through a bit-packed image\n"
+    "                  (same result as thr)\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  turn DEG        Rotate CURR DEG degrees counter-clockwise about its center,\n"
+    "                  creating new image of the same size\n"
+    "  warp A,B,C,D,E,F  Move each pixel (x,y) of CURR to (Ax+By+C, Dx+Ey+F),\n"
+    "                  creating new image of the same size\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H      Resize CURR to WxH pixels, creating new image\n"
+    "                  (area average to reduce, bilinear to enlarge)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  blendmask X,Y   Blend the image before PRED into CURR at position (X,Y),\n"
+    "                  weighting each pixel by the level of mask PRED\n"
+    "                  (0 keeps CURR, 255 gives the image)\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  rlelocate       Search PRED in CURR as locate, comparing the runs of their\n"
+    "                  run-length encoded black (0) / white (nonzero) pixels\n"
+    "  blocate TOL     Search PRED in CURR as locate, comparing their bit-packed\n"
+    "                  black (0) / white (nonzero) pixels and allowing up to TOL\n"
+    "                  of them to differ\n"
+    "  match METRIC    Search PRED in CURR, print best position and score\n"
+    "  compare         Compare PRED and CURR, print differences, PSNR and SSIM\n"
+    "  search INDEX    Search CURR in the files indexed in INDEX (see index mode),\n"
+    "                  print file and matching position, or NOTFOUND\n"
+    "  find INDEX      Find a file indexed in INDEX with the same contents as\n"
+    "                  CURR (by content hash), print its name, or NOTFOUND\n"
+    "  hash            Print the content hash of CURR\n"
+    "  label CONN      Print the connected components of the nonzero pixels of\n"
+    "                  CURR (CONN = 4 or 8) as CSV: label,area,x,y,w,h,cx,cy\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  erode DX,DY     Minimum of CURR over (2DX+1)x(2DY+1) rectangle\n"
+    "  dilate DX,DY    Maximum of CURR over (2DX+1)x(2DY+1) rectangle\n"
+    "  open DX,DY      Erode then dilate CURR (removes small bright spots)\n"
+    "  close DX,DY     Dilate then erode CURR (fills small dark holes)\n"
+    "  berode DX,DY, bdilate DX,DY, bopen DX,DY, bclose DX,DY\n"
+    "                  Same, for the black (0) / white (nonzero) pixels of CURR,\n"
+    "                  64 at a time in a bit-packed image (white becomes maxval)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  METRIC          sad (sum of absolute differences) or ncc (normalized\n"
+    "                  cross-correlation); nccspatial and nccfft are ncc\n"
+    "                  computed always by one method (for testing)\n"
     "\n"
     ;
 
@@ -74,35 +162,297 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Unknown image name",
 };
 
+// File descriptor where save - writes (see main)
+static int imageOut = STDOUT_FILENO;
 
-// This program strives for correctness and robustness.
-// You may want to temporarily comment out operand validation, namely
-// precondition checks, so that you can force precondition violations, and
-// observe the effect of assertions.
-//
-// Also, the program does not test every module function, but you may easily
-// add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Replace *pimg by the decoding of RLE image *pr, which is destroyed.
+// Returns 0 on failure (*pimg is kept).
+static int rleDecodeInto(Image* pimg, RLEImage* pr) {
+  Image dec = (*pr != NULL) ? ImageRLEDecode(*pr) : NULL;
+  ImageRLEDestroy(pr);
+  if (dec == NULL) return 0;
+  ImageDestroy(pimg);
+  *pimg = dec;
+  return 1;
+}
+
+// Number of operands of operation op, or -1 if op is not an operation
+// (and so names an image file).
+static int operands(const char* op) {
+  static const char* ops0[] = { "info", "tic", "toc", "neg", "rleneg", "rotate",
+    "mirror", "locate", "rlelocate", "compare", "hash", NULL };
+  static const char* ops1[] = { "thr", "rle", "bthr", "bri", "create", "crop", "rlecrop", "resize", "turn", "warp",
+    "paste", "rlepaste", "rlesave",
+    "blend", "blendmask", "blocate", "match", "search", "find", "label", "blur", "erode", "dilate", "open", "close",
+    "berode", "bdilate", "bopen", "bclose", "tsave", "save", "as", "use", "preview", NULL };
+  for (int i = 0; ops0[i] != NULL; i++) if (strcmp(op, ops0[i]) == 0) return 0;
+  for (int i = 0; ops1[i] != NULL; i++) if (strcmp(op, ops1[i]) == 0) return 1;
+  return -1;
+}
+
+// Wall clock time in seconds
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+// Tracing (--trace).
+// Each operation, load and save is written to the trace file as a complete
+// event ("ph":"X") of the Chrome trace-event format, with the size of the
+// resulting image, the pixel bytes touched (the pixmem counter) and the
+// deltas of all the instrumentation counters.  Threads are numbered in the
+// order of their first event.  Each thread has its own counters, so an
+// event counts only the work of its thread (and of the ParallelFor chunks
+// it runs); loading a file prefetched in the background also counts the
+// work of the background load, which is added when it is taken.
+
+static FILE* traceFile = NULL;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static double traceStart;     // instante 0 do trace
+static int traceEvents = 0;   // eventos escritos
+static int traceThreads = 0;  // threads numeradas
+static _Thread_local int traceTid = 0;
+static _Thread_local const char* traceThread = NULL;   // nome da thread
+
+// A traced operation in progress
+typedef struct {
+  double start;
+  unsigned long count[NUMCOUNTERS];
+} TraceSpan;
+
+// Write s as a JSON string.
+static void traceString(const char* s) {
+  putc('"', traceFile);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') fprintf(traceFile, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) fprintf(traceFile, "\\u%04x", *s);
+    else putc(*s, traceFile);
   }
+  putc('"', traceFile);
+}
 
-  ImageInit();
+// Start a traced operation.
+static void traceBegin(TraceSpan* sp) {
+  if (traceFile == NULL) return;
+  sp->start = now();
+  for (int c = 0; c < NUMCOUNTERS; c++) sp->count[c] = InstrCount[c];
+}
 
-  int err = 0;
+// End the traced operation sp, named name, of category cat ("op" or "io"),
+// with operand arg (may be NULL) and resulting image img (may be NULL).
+static void traceEnd(const TraceSpan* sp, const char* name, const char* cat, const char* arg, Image img) {
+  if (traceFile == NULL) return;
+  double end = now();
+  unsigned long delta[NUMCOUNTERS];
+  for (int c = 0; c < NUMCOUNTERS; c++) delta[c] = InstrCount[c] - sp->count[c];
+  pthread_mutex_lock(&traceLock);
+  if (traceFile != NULL) {
+    if (traceTid == 0) {
+      traceTid = ++traceThreads;
+      fprintf(traceFile, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+              traceEvents++ > 0 ? "," : "", traceTid);
+      traceString(traceThread != NULL ? traceThread : "main");
+      fprintf(traceFile, "}}");
+    }
+    fprintf(traceFile, "%s\n{\"name\":", traceEvents++ > 0 ? "," : "");
+    traceString(name);
+    fprintf(traceFile, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{",
+            cat, 1e6*(sp->start - traceStart), 1e6*(end - sp->start), traceTid);
+    if (arg != NULL) {
+      fprintf(traceFile, "\"operand\":");
+      traceString(arg);
+      fprintf(traceFile, ",");
+    }
+    if (img != NULL) {
+      fprintf(traceFile, "\"width\":%d,\"height\":%d,", ImageWidth(img), ImageHeight(img));
+    }
+    fprintf(traceFile, "\"bytes\":%lu", delta[0]);   // pixmem: acessos a pixeis de 1 byte
+    for (int c = 0; c < NUMCOUNTERS; c++) {
+      if (InstrName[c] != NULL) fprintf(traceFile, ",\"%s\":%lu", InstrName[c], delta[c]);
+    }
+    fprintf(traceFile, "}}");
+  }
+  pthread_mutex_unlock(&traceLock);
+}
+
+// Trace the loads and saves of the background threads (see ImageIOHook).
+static void traceIO(const char* op, const char* filename, int begin, Image imgs[], int n) {
+  static _Thread_local TraceSpan span;
+  if (traceThread == NULL) traceThread = "background I/O";
+  if (begin) {
+    traceBegin(&span);
+  } else {
+    traceEnd(&span, op, "io", filename, (n > 0) ? imgs[0] : NULL);
+  }
+}
+
+// Finish the trace file (at exit).
+static void traceClose(void) {
+  pthread_mutex_lock(&traceLock);
+  if (traceFile != NULL) {
+    fprintf(traceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(traceFile) != 0) perror("Writing trace failed");
+    traceFile = NULL;
+  }
+  pthread_mutex_unlock(&traceLock);
+}
+
+// Start tracing to file path.
+static void traceOpen(const char* path) {
+  traceFile = fopen(path, "w");
+  if (traceFile == NULL) error(4, errno, "Cannot open trace file %s", path);
+  fprintf(traceFile, "{\"traceEvents\":[");
+  traceStart = now();
+  ImageSetIOHook(traceIO);
+  atexit(traceClose);
+}
+
+// Is argument av[k] a region of an image file (FILE@X,Y,W,H)?
+static int isRegion(const char* arg) {
   int x, y, w, h;
+  const char* at = strrchr(arg, '@');
+  return at != NULL && sscanf(at, "@%d,%d,%d,%d", &x, &y, &w, &h) == 4;
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+// Background I/O.
+// Input files are loaded ahead of time, up to PREFETCH files beyond the
+// one being processed, and saves are written by background threads.
+// The handles are kept in io[k], indexed by the argument that names the file.
+#define PREFETCH 2
 
-  int k = 1;
-  while (k < ac) {
+// Wait for the pending saves to file name, among arguments [0, k).
+// Returns 0 if any of them failed.
+static int waitSaves(char* av[], ImageIO io[], int k, const char* name) {
+  int success = 1;
+  if (io == NULL) return success;
+  for (int j = 0; j < k; j++) {
+    if (io[j] != NULL && strcmp(av[j-1], "save") == 0 &&
+        strcmp(av[j], name) == 0) {
+      success = ImageSaveWait(&io[j]) && success;
+    }
+  }
+  return success;
+}
+
+// Start loading the plain image files among the arguments after k,
+// up to PREFETCH files ahead.  A file named as the target of a save
+// is not prefetched: it is only read when its turn comes.  Neither are
+// files loaded as previews (scale > 1, see "preview"), which are read
+// reduced.
+static void prefetch(int ac, char* av[], ImageIO io[], int k, int max, int scale) {
+  int files = 0;
+  int m = operands(av[k]);
+  // os operandos de av[k] não são ficheiros
+  for (int i = k + 1 + (m > 0 ? m : 0); i < ac && files < PREFETCH; i++) {
+    m = operands(av[i]);
+    if (m > 0 && strcmp(av[i], "preview") == 0 && i+1 < ac) scale = atoi(av[i+1]);
+    if (m >= 0) { i += m; continue; }
+    if (isRegion(av[i]) || strcmp(av[i], "-") == 0 || scale > 1) continue;
+    files++;
+    if (io[i] != NULL) continue;
+    int written = 0;
+    for (int j = 2; j < ac && !written; j++) {
+      written = strcmp(av[j], av[i]) == 0 &&
+                (strcmp(av[j-1], "save") == 0 || strcmp(av[j-1], "tsave") == 0);
+    }
+    if (!written) io[i] = ImageLoadAsync(av[i], max);
+  }
+}
+
+// The image buffer: images I0, I1, ..., and the images named by "as".
+// Both grow as needed.
+typedef struct {
+  Image* img;       // the images
+  int n;            // number of images
+  int cap;          // capacity of img
+  char** name;      // names given by "as"
+  Image* named;     // named[i] is the image named name[i]
+  int nnames;
+  int scale;        // files load reduced by this factor, if > 1 (see "preview")
+} Buffer;
+
+// Maximum number of images loaded from one file
+#define MAXLOAD 64
+
+// Make room in buf for m more images.
+// Returns 0 on failure (out of memory).
+static int bufferReserve(Buffer* buf, int m) {
+  if (buf->n + m <= buf->cap) return 1;
+  int cap = 2*buf->cap;
+  if (cap < buf->n + m) cap = buf->n + m;
+  Image* img = (Image*)realloc(buf->img, cap * sizeof(Image));
+  if (img == NULL) return 0;
+  buf->img = img;
+  buf->cap = cap;
+  return 1;
+}
+
+// Name image img in buf: the name refers to a copy of img (copy-on-write,
+// so no pixels are copied until either one changes).
+// Returns 0 on failure.
+static int bufferName(Buffer* buf, const char* name, Image img) {
+  int i = 0;
+  while (i < buf->nnames && strcmp(buf->name[i], name) != 0) i++;
+  Image share = ImageShare(img);
+  if (share == NULL) return 0;
+  if (i == buf->nnames) {   // novo nome
+    char** names = (char**)realloc(buf->name, (i+1) * sizeof(char*));
+    if (names != NULL) buf->name = names;
+    Image* named = (Image*)realloc(buf->named, (i+1) * sizeof(Image));
+    if (named != NULL) buf->named = named;
+    if (names == NULL || named == NULL || (names[i] = strdup(name)) == NULL) {
+      ImageDestroy(&share);
+      return 0;
+    }
+    buf->nnames++;
+  } else {
+    ImageDestroy(&buf->named[i]);
+  }
+  buf->named[i] = share;
+  return 1;
+}
+
+// Image named name in buf, or NULL.
+static Image bufferNamed(Buffer* buf, const char* name) {
+  for (int i = 0; i < buf->nnames; i++) {
+    if (strcmp(buf->name[i], name) == 0) return buf->named[i];
+  }
+  return NULL;
+}
+
+// Destroy all images in buf.
+static void bufferFree(Buffer* buf) {
+  while (buf->n > 0) ImageDestroy(&buf->img[--buf->n]);
+  for (int i = 0; i < buf->nnames; i++) {
+    ImageDestroy(&buf->named[i]);
+    free(buf->name[i]);
+  }
+  free(buf->img);
+  free(buf->name);
+  free(buf->named);
+}
+
+// Apply the operation named by av[*pk] (or load the file it names) to the
+// image buffer buf, and advance *pk to its last operand.
+// io holds the background loads and saves (see prefetch), or is NULL to
+// do all I/O synchronously.
+// Returns the error code (index into errors[]).
+static int runOp(int ac, char* av[], int* pk, Buffer* buf, ImageIO io[]) {
+  int err = 0;
+  int x, y, w, h;
+  int k = *pk;
+  TraceSpan span;
+  traceBegin(&span);
+  bufferReserve(buf, MAXLOAD);  // se falhar, os testes abaixo dão buffer cheio
+  Image* img = buf->img;
+  int n = buf->n;
+  const int N = buf->cap;
+  do {
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
@@ -128,6 +478,42 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
       ImageThreshold(img[n-1], (uint8)thr);
+    } else if (strcmp(av[k], "rle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      fprintf(stderr, "Thresholding I%d at %d (run-length encoded)\n", n-1, thr);
+      RLEImage r = ImageRLEThreshold(img[n-1], thr);
+      if (!rleDecodeInto(&img[n-1], &r)) { err = 4; break; }
+    } else if (strcmp(av[k], "rleneg") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Negating I%d (run-length encoded)\n", n-1);
+      RLEImage r = ImageRLEThreshold(img[n-1], 1);
+      if (r != NULL && !ImageRLENegative(r)) ImageRLEDestroy(&r);
+      if (!rleDecodeInto(&img[n-1], &r)) { err = 4; break; }
+    } else if (strcmp(av[k], "rlesave") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving %s <- I%d (run-length encoded)\n", av[k], n-1);
+      if (!waitSaves(av, io, k, av[k])) { err = 4; break; }
+      RLEImage r = ImageRLEThreshold(img[n-1], 1);
+      int ok = r != NULL && ImageRLESave(r, av[k]);
+      ImageRLEDestroy(&r);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "bthr") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      fprintf(stderr, "Thresholding I%d at %d (bit-packed)\n", n-1, thr);
+      BitImage b = ImageBitThreshold(img[n-1], thr);
+      if (b == NULL) { err = 4; break; }
+      Image dec = ImageBitDecode(b);
+      ImageBitDestroy(&b);
+      if (dec == NULL) { err = 4; break; }
+      ImageDestroy(&img[n-1]);
+      img[n-1] = dec;
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -151,6 +537,31 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "turn") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double deg;
+      if (sscanf(av[k], "%lf", &deg) != 1) { err = 5; break; }
+      // Rotação em torno do centro (com y para baixo)
+      double t = deg * M_PI / 180.0, c = cos(t), s = sin(t);
+      double cx = (ImageWidth(img[n-1]) - 1) / 2.0, cy = (ImageHeight(img[n-1]) - 1) / 2.0;
+      double m[6] = { c, s, cx - c*cx - s*cy, -s, c, cy + s*cx - c*cy };
+      fprintf(stderr, "Turning I%d by %g degrees -> I%d\n", n-1, deg, n);
+      img[n] = ImageWarpAffine(img[n-1], m, WARP_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "warp") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double m[6];
+      if (sscanf(av[k], "%lf,%lf,%lf,%lf,%lf,%lf", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) { err = 5; break; }
+      if (m[0]*m[4] - m[1]*m[3] == 0.0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Warping I%d -> I%d\n", n-1, n);
+      img[n] = ImageWarpAffine(img[n-1], m, WARP_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -168,6 +579,34 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rlecrop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d (run-length encoded)\n", n-1, x, y, w, h, n);
+      RLEImage r = ImageRLEThreshold(img[n-1], 1);
+      RLEImage c = (r != NULL) ? ImageRLECrop(r, x, y, w, h) : NULL;
+      ImageRLEDestroy(&r);
+      img[n] = (c != NULL) ? ImageRLEDecode(c) : NULL;
+      ImageRLEDestroy(&c);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
+      if (w <= 0 || h <= 0) { err = 5; break; }   // precondition check!
+      if (ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) { err = 5; break; }
+      // Reduzir: média por área; ampliar: interpolação bilinear
+      int shrink = w <= ImageWidth(img[n-1]) && h <= ImageHeight(img[n-1]);
+      fprintf(stderr, "Resizing I%d to %dx%d (%s) -> I%d\n", n-1, w, h,
+              shrink ? "area" : "bilinear", n);
+      img[n] = ImageResize(img[n-1], w, h, shrink ? RESIZE_AREA : RESIZE_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -177,6 +616,19 @@ int main(int ac, char* av[]) {
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
+    } else if (strcmp(av[k], "rlepaste") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(stderr, "Pasting I%d at I%d (%d,%d) (run-length encoded)\n", n-2, n-1, x, y);
+      RLEImage r1 = ImageRLEThreshold(img[n-1], 1);
+      RLEImage r2 = (r1 != NULL) ? ImageRLEThreshold(img[n-2], 1) : NULL;
+      if (r2 == NULL || !ImageRLEPaste(r1, x, y, r2)) ImageRLEDestroy(&r1);
+      ImageRLEDestroy(&r2);
+      if (!rleDecodeInto(&img[n-1], &r1)) { err = 4; break; }
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -187,6 +639,16 @@ int main(int ac, char* av[]) {
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+    } else if (strcmp(av[k], "blendmask") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 3) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-3]);
+      h = ImageHeight(img[n-3]);
+      if (ImageWidth(img[n-2]) != w || ImageHeight(img[n-2]) != h) { err = 6; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(stderr, "Blending I%d with I%d@(%d,%d) through mask I%d\n", n-3, n-1, x, y, n-2);
+      ImageBlendMask(img[n-1], x, y, img[n-3], img[n-2]);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
@@ -195,6 +657,103 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "rlelocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d (run-length encoded)\n", n-2, n-1);
+      RLEImage r1 = ImageRLEThreshold(img[n-1], 1);
+      RLEImage r2 = (r1 != NULL) ? ImageRLEThreshold(img[n-2], 1) : NULL;
+      int found = (r2 != NULL) ? ImageRLELocateSubImage(r1, &x, &y, r2) : -1;
+      ImageRLEDestroy(&r1);
+      ImageRLEDestroy(&r2);
+      if (found > 0) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else if (found == 0) {
+        printf("# NOTFOUND\n");
+      } else {
+        err = 4; break;
+      }
+    } else if (strcmp(av[k], "blocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      long tol;
+      if (sscanf(av[k], "%ld", &tol) != 1 || tol < 0) { err = 5; break; }
+      fprintf(stderr, "Locating I%d in I%d with tolerance %ld (bit-packed)\n", n-2, n-1, tol);
+      BitImage b1 = ImageBitThreshold(img[n-1], 1);
+      BitImage b2 = (b1 != NULL) ? ImageBitThreshold(img[n-2], 1) : NULL;
+      int found = (b2 != NULL) ? ImageBitLocateSubImage(b1, &x, &y, b2, tol) : -1;
+      ImageBitDestroy(&b1);
+      ImageBitDestroy(&b2);
+      if (found > 0) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else if (found == 0) {
+        printf("# NOTFOUND\n");
+      } else {
+        err = 4; break;
+      }
+    } else if (strcmp(av[k], "search") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Searching I%d in %s\n", n-1, av[k]);
+      ImageIndex ix = ImageIndexOpen(av[k]);
+      if (ix == NULL) { err = 4; break; }
+      int file;
+      int found = ImageIndexLocate(ix, &file, &x, &y, img[n-1]);
+      if (found > 0) {
+        printf("# FOUND %s (%d,%d)\n", ImageIndexName(ix, file), x, y);
+      } else if (found == 0) {
+        printf("# NOTFOUND\n");
+      }
+      ImageIndexClose(&ix);
+      if (found < 0) { err = 4; break; }
+    } else if (strcmp(av[k], "find") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Finding I%d in %s\n", n-1, av[k]);
+      ImageIndex ix = ImageIndexOpen(av[k]);
+      if (ix == NULL) { err = 4; break; }
+      int file = ImageIndexFind(ix, img[n-1]);
+      if (file >= 0) {
+        printf("# FOUND %s\n", ImageIndexName(ix, file));
+      } else {
+        printf("# NOTFOUND\n");
+      }
+      ImageIndexClose(&ix);
+    } else if (strcmp(av[k], "hash") == 0) {
+      if (n < 1) { err = 2; break; }
+      printf("# HASH %016" PRIx64 "\n", ImageHash(img[n-1]));
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1 || (conn != 4 && conn != 8)) { err = 5; break; }
+      fprintf(stderr, "Labeling I%d (%d-connected)\n", n-1, conn);
+      LabelMap lm = ImageLabel(img[n-1], conn);
+      if (lm == NULL) { err = 4; break; }
+      printf("label,area,x,y,w,h,cx,cy\n");
+      for (int i = 1; i <= ImageLabelCount(lm); i++) {
+        const ImageBlob* b = ImageLabelBlob(lm, i);
+        printf("%d,%ld,%d,%d,%d,%d,%.2f,%.2f\n", i, b->area, b->x, b->y, b->w, b->h, b->cx, b->cy);
+      }
+      ImageLabelDestroy(&lm);
+    } else if (strcmp(av[k], "compare") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Comparing I%d and I%d\n", n-2, n-1);
+      ImageMetrics m;
+      if (!ImageCompare(img[n-2], img[n-1], &m)) { err = 4; break; }
+      printf("# COMPARE maxabs=%d mae=%g mse=%g psnr=%g ssim=%g\n", m.maxabs, m.mae, m.mse, m.psnr, m.ssim);
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int metric;
+      if (strcmp(av[k], "sad") == 0) metric = MATCH_SAD;
+      else if (strcmp(av[k], "ncc") == 0) metric = MATCH_NCC;
+      else if (strcmp(av[k], "nccspatial") == 0) metric = MATCH_NCC_SPATIAL;
+      else if (strcmp(av[k], "nccfft") == 0) metric = MATCH_NCC_FFT;
+      else { err = 5; break; }
+      fprintf(stderr, "Matching I%d in I%d (%s)\n", n-2, n-1, av[k]);
+      double score;
+      if (!ImageLocateBest(img[n-1], img[n-2], metric, &x, &y, &score)) { err = 4; break; }
+      printf("# BEST (%d,%d) %s=%g\n", x, y, av[k], score);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -202,27 +761,501 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      int ok;
+      if (op[0] == 'e') {
+        fprintf(stderr, "Erode I%d with %dx%d rectangle\n", n-1, 2*dx+1, 2*dy+1);
+        ok = ImageErode(img[n-1], dx, dy);
+      } else if (op[0] == 'd') {
+        fprintf(stderr, "Dilate I%d with %dx%d rectangle\n", n-1, 2*dx+1, 2*dy+1);
+        ok = ImageDilate(img[n-1], dx, dy);
+      } else if (op[0] == 'o') {
+        fprintf(stderr, "Open I%d with %dx%d rectangle\n", n-1, 2*dx+1, 2*dy+1);
+        ok = ImageOpen(img[n-1], dx, dy);
+      } else {
+        fprintf(stderr, "Close I%d with %dx%d rectangle\n", n-1, 2*dx+1, 2*dy+1);
+        ok = ImageClose(img[n-1], dx, dy);
+      }
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "berode") == 0 || strcmp(av[k], "bdilate") == 0 ||
+               strcmp(av[k], "bopen") == 0 || strcmp(av[k], "bclose") == 0) {
+      const char* op = av[k] + 1;
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      const char* name = op[0] == 'e' ? "Erode" : op[0] == 'd' ? "Dilate" : op[0] == 'o' ? "Open" : "Close";
+      fprintf(stderr, "%s I%d with %dx%d rectangle (bit-packed)\n", name, n-1, 2*dx+1, 2*dy+1);
+      BitImage b = ImageBitThreshold(img[n-1], 1);
+      int ok = b != NULL &&
+        (op[0] == 'e' ? ImageBitErode(b, dx, dy) : op[0] == 'd' ? ImageBitDilate(b, dx, dy) :
+         op[0] == 'o' ? ImageBitOpen(b, dx, dy) : ImageBitClose(b, dx, dy));
+      Image dec = ok ? ImageBitDecode(b) : NULL;
+      ImageBitDestroy(&b);
+      if (dec == NULL) { err = 4; break; }
+      ImageDestroy(&img[n-1]);
+      img[n-1] = dec;
+    } else if (strcmp(av[k], "tsave") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving %s <- I%d (tiled)\n", av[k], n-1);
+      if (!waitSaves(av, io, k, av[k])) { err = 4; break; }
+      if (ImageSaveTiled(img[n-1], av[k], 256) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "preview") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int factor;
+      if (sscanf(av[k], "%d", &factor) != 1) { err = 5; break; }
+      if (factor < 1 || factor > 255) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Loading next files reduced by %d\n", factor);
+      buf->scale = factor;
+    } else if (strcmp(av[k], "as") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Naming I%d %s\n", n-1, av[k]);
+      if (!bufferName(buf, av[k], img[n-1])) { err = 4; break; }
+    } else if (strcmp(av[k], "use") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      Image named = bufferNamed(buf, av[k]);
+      if (named == NULL) { err = 8; break; }
+      fprintf(stderr, "Using %s -> I%d\n", av[k], n);
+      img[n] = ImageShare(named);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
+      if (strcmp(av[k], "-") == 0) {  // standard output
+        if (ImageSaveFd(img[n-1], imageOut) == 0) { err = 4; break; }
+      } else {
+        // Saves to the same file must complete in order
+        if (!waitSaves(av, io, k, av[k])) { err = 4; break; }
+        ImageIO req = (io != NULL) ? ImageSaveAsync(img[n-1], av[k]) : NULL;
+        if (io != NULL) io[k] = req;
+        if (req == NULL && ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      }
+    } else if (strchr(av[k], '@') != NULL &&
+               sscanf(strrchr(av[k], '@'), "@%d,%d,%d,%d", &x, &y, &w, &h) == 4) {
+      // region of image file: FILE@X,Y,W,H
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      if (w < 0 || h < 0) { err = 5; break; }
+      char* at = strrchr(av[k], '@');
+      *at = '\0';
+      fprintf(stderr, "Loading %s (%d,%d,%d,%d) -> I%d\n", av[k], x, y, w, h, n);
+      if (!waitSaves(av, io, k, av[k])) { *at = '@'; err = 4; break; }
+      img[n] = ImageLoadRegion(av[k], x, y, w, h);
+      *at = '@';
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else {  // image file
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+      int m;
+      if (strcmp(av[k], "-") == 0) {  // standard input
+        m = ImageLoadFd(STDIN_FILENO, &img[n], N - n);
+      } else if (buf->scale > 1) {  // preview: só a primeira imagem
+        if (!waitSaves(av, io, k, av[k])) { err = 4; break; }
+        img[n] = ImageLoadScaled(av[k], buf->scale);
+        m = (img[n] != NULL);
+      } else if (io != NULL && io[k] != NULL) {  // prefetched
+        Image loaded[MAXLOAD];
+        m = ImageLoadWait(&io[k], loaded);
+        if (m > N - n) {
+          while (m > 0) ImageDestroy(&loaded[--m]);
+          err = 3; break;
+        }
+        for (int i = 0; i < m; i++) img[n+i] = loaded[i];
+      } else {
+        if (!waitSaves(av, io, k, av[k])) { err = 4; break; }
+        m = ImageLoadMany(av[k], &img[n], N - n);
+      }
+      if (m == 0) { err = 4; break; }
+      if (m > 1) fprintf(stderr, "  %d images in %s -> I%d..I%d\n", m, av[k], n, n+m-1);
+      n += m;
+    }
+  } while (0);
+  if (traceFile != NULL) {
+    // os ficheiros, save e tsave são I/O; tudo o resto é processamento
+    const char* op = av[*pk];
+    const char* arg = (k > *pk) ? av[*pk + 1] : NULL;
+    int file = (operands(op) < 0);
+    int isIO = file || strcmp(op, "save") == 0 || strcmp(op, "tsave") == 0;
+    traceEnd(&span, file ? "load" : op, isIO ? "io" : "op", file ? op : arg, (n > 0) ? img[n-1] : NULL);
+  }
+  *pk = k;
+  buf->n = n;
+  return err;
+}
+
+// Run the paged command line: paged BUDGET FILE OPERATION [OPERAND] [DEST]
+// Exits on failure.
+static int runPaged(int ac, char* av[]) {
+  long budget;
+  if (ac < 6) error(1, 0, "%s", errors[1]);
+  if (sscanf(av[2], "%ld", &budget) != 1 || budget < 0) error(5, 0, "%s", errors[5]);
+  const char* op = av[4];
+  PagedImage src = ImagePagedOpen(av[3], budget);
+  if (src == NULL) error(4, errno, errors[4], ImageErrMsg());
+  int w = ImagePagedWidth(src), h = ImagePagedHeight(src);
+  uint8 maxval = (uint8)ImagePagedMaxval(src);
+  int err = 0;
+  PagedImage dst = NULL;
+  do {
+    if (strcmp(op, "blur") == 0) {
+      int dx, dy;
+      if (ac < 7) { err = 1; break; }
+      if (sscanf(av[5], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      fprintf(stderr, "Blur %s with %dx%d mean filter -> %s\n", av[3], 2*dx+1, 2*dy+1, av[6]);
+      dst = ImagePagedCreate(av[6], w, h, maxval, budget);
+      if (dst == NULL || !ImagePagedBlur(src, dst, dx, dy)) { err = 4; break; }
+    } else if (strcmp(op, "mirror") == 0 || strcmp(op, "rotate") == 0) {
+      int rotate = (op[0] == 'r');
+      fprintf(stderr, "%s %s -> %s\n", rotate ? "Rotating" : "Mirroring", av[3], av[5]);
+      dst = rotate ? ImagePagedCreate(av[5], h, w, maxval, budget)
+                   : ImagePagedCreate(av[5], w, h, maxval, budget);
+      if (dst == NULL) { err = 4; break; }
+      if (!(rotate ? ImagePagedRotate(src, dst) : ImagePagedMirror(src, dst))) { err = 4; break; }
+    } else if (strcmp(op, "crop") == 0) {
+      int x, y, cw, ch;
+      if (ac < 7) { err = 1; break; }
+      if (sscanf(av[5], "%d,%d,%d,%d", &x, &y, &cw, &ch) != 4) { err = 5; break; }
+      if (x < 0 || y < 0 || cw < 0 || ch < 0 || x > w - cw || y > h - ch) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Cropping %s (%d,%d,%d,%d) -> %s\n", av[3], x, y, cw, ch, av[6]);
+      Image img = ImagePagedCrop(src, x, y, cw, ch);
+      if (img == NULL) { err = 4; break; }
+      int ok = ImageSave(img, av[6]);
+      ImageDestroy(&img);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(op, "locate") == 0) {
+      fprintf(stderr, "Locating %s in %s\n", av[5], av[3]);
+      Image tmpl = ImageLoad(av[5]);
+      if (tmpl == NULL) { err = 4; break; }
+      int x, y;
+      int found = ImagePagedLocateSubImage(src, &x, &y, tmpl);
+      ImageDestroy(&tmpl);
+      if (found > 0) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else if (found == 0) {
+        printf("# NOTFOUND\n");
+      } else {
+        err = 4; break;
+      }
+    } else {
+      err = 5;
+    }
+  } while (0);
+  // fechar escreve os tiles alterados, o que também pode falhar
+  int errnum = errno;
+  const char* msg = ImageErrMsg();
+  if (!ImagePagedClose(&dst) && err == 0) { err = 4; errnum = errno; msg = ImageErrMsg(); }
+  if (!ImagePagedClose(&src) && err == 0) { err = 4; errnum = errno; msg = ImageErrMsg(); }
+  error(err, errnum, errors[err], msg);
+  return 0;
+}
+
+// Batch mode: a three stage pipeline.
+// One thread loads the input files, ParallelThreads() threads apply the
+// operations to each image and one thread saves the results, connected by
+// bounded queues of jobs, so that the I/O and the processing of
+// consecutive files overlap.
+
+// A file going through the pipeline
+typedef struct {
+  int file;     // index of the file argument
+  Image img;    // its image, or NULL if loading or processing failed
+} Job;
+
+// Shared state of the pipeline
+typedef struct {
+  char** av;
+  int first, last;    // file arguments [first, last)
+  int ops, end;       // operation arguments [ops, end)
+  const char* dir;    // output directory
+  int nworkers;
+  Queue loaded;       // load -> process
+  Queue processed;    // process -> save
+} Batch;
+
+// State of one pipeline thread
+typedef struct {
+  Batch* b;
+  double busy;        // seconds spent loading, processing or saving
+  int failed;         // number of files that failed
+} Stage;
+
+// Report the failure of a file (err is an index into errors[])
+static void batchError(Stage* st, const char* file, int err) {
+  char msg[256];
+  int errnum = errno;
+  snprintf(msg, sizeof(msg), errors[err], ImageErrMsg());
+  flockfile(stderr);
+  error(0, errnum, "%s: %s", file, msg);
+  funlockfile(stderr);
+  st->failed++;
+}
+
+static void* loadStage(void* arg) {
+  Stage* st = (Stage*)arg;
+  Batch* b = st->b;
+  traceThread = "load";
+  for (int k = b->first; k < b->last; k++) {
+    Job* job = (Job*)malloc(sizeof(Job));
+    if (job == NULL) { batchError(st, b->av[k], 4); continue; }
+    double t = now();
+    TraceSpan span;
+    traceBegin(&span);
+    job->file = k;
+    job->img = ImageLoad(b->av[k]);
+    traceEnd(&span, "load", "io", b->av[k], job->img);
+    st->busy += now() - t;
+    if (job->img == NULL) batchError(st, b->av[k], 4);
+    QueuePush(b->loaded, job);
+  }
+  // Um marcador de fim por cada thread de processamento
+  for (int i = 0; i < b->nworkers; i++) QueuePush(b->loaded, NULL);
+  return NULL;
+}
+
+static void* processStage(void* arg) {
+  Stage* st = (Stage*)arg;
+  Batch* b = st->b;
+  traceThread = "process";
+  // There are already ParallelThreads() workers: run each op in one thread.
+  // (Instrumentation counters are per thread, so workers do not race.)
+  ParallelSetLocalThreads(1);
+  Job* job;
+  while ((job = (Job*)QueuePop(b->loaded)) != NULL) {
+    if (job->img != NULL) {
+      double t = now();
+      Buffer buf = { NULL, 0, 0, NULL, NULL, 0, 1 };
+      int err = bufferReserve(&buf, 1) ? 0 : 3;
+      if (err == 0) buf.img[buf.n++] = job->img;
+      for (int k = b->ops; k < b->end && err == 0; k++) {
+        err = runOp(b->end, b->av, &k, &buf, NULL);
+      }
+      // The result is CURR
+      job->img = (err == 0) ? buf.img[--buf.n] : NULL;
+      bufferFree(&buf);
+      st->busy += now() - t;
+      if (err != 0) batchError(st, b->av[job->file], err);
+    }
+    QueuePush(b->processed, job);
+  }
+  QueuePush(b->processed, NULL);
+  return NULL;
+}
+
+static void* saveStage(void* arg) {
+  Stage* st = (Stage*)arg;
+  Batch* b = st->b;
+  traceThread = "save";
+  int ended = 0;
+  while (ended < b->nworkers) {
+    Job* job = (Job*)QueuePop(b->processed);
+    if (job == NULL) { ended++; continue; }
+    if (job->img != NULL) {
+      double t = now();
+      const char* name = strrchr(b->av[job->file], '/');
+      name = (name == NULL) ? b->av[job->file] : name + 1;
+      size_t len = strlen(b->dir) + strlen(name) + 2;
+      char* path = (char*)malloc(len);
+      TraceSpan span;
+      traceBegin(&span);
+      if (path == NULL || (snprintf(path, len, "%s/%s", b->dir, name),
+                           ImageSave(job->img, path) == 0)) {
+        batchError(st, b->av[job->file], 4);
+      }
+      traceEnd(&span, "save", "io", (path != NULL) ? path : name, job->img);
+      free(path);
+      ImageDestroy(&job->img);
+      st->busy += now() - t;
+    }
+    free(job);
+  }
+  return NULL;
+}
+
+// Run the batch command line: batch DIR FILE... -- [OPERATION...]
+// Returns the number of files that failed.
+static int runBatch(int ac, char* av[]) {
+  Batch b;
+  b.av = av;
+  b.dir = av[2];
+  b.first = 3;
+  b.last = b.first;
+  while (b.last < ac && strcmp(av[b.last], "--") != 0) b.last++;
+  b.ops = (b.last < ac) ? b.last + 1 : ac;
+  b.end = ac;
+  b.nworkers = ParallelThreads();
+  b.loaded = QueueCreate(b.nworkers + 1);
+  b.processed = QueueCreate(b.nworkers + 1);
+  if (b.loaded == NULL || b.processed == NULL) {
+    error(4, errno, "Cannot create pipeline queues");
+  }
+
+  // stage[0] loads, stage[1..nworkers] process, stage[nworkers+1] saves
+  int nstages = b.nworkers + 2;
+  Stage stage[nstages];
+  pthread_t tid[nstages];
+  for (int i = 0; i < nstages; i++) {
+    stage[i].b = &b;
+    stage[i].busy = 0.0;
+    stage[i].failed = 0;
+  }
+  double t = now();
+  for (int i = 0; i < nstages; i++) {
+    void* (*fn)(void*) = (i == 0) ? loadStage : (i == nstages-1) ? saveStage : processStage;
+    if (pthread_create(&tid[i], NULL, fn, &stage[i]) != 0) {
+      error(4, errno, "Cannot start pipeline threads");
     }
+  }
+  int failed = 0;
+  for (int i = 0; i < nstages; i++) {
+    pthread_join(tid[i], NULL);
+    failed += stage[i].failed;
+  }
+  t = now() - t;
+
+  // Utilization of each stage: busy time / (wall time * threads)
+  double busy = 0.0;
+  for (int i = 1; i <= b.nworkers; i++) busy += stage[i].busy;
+  printf("# Batch: %d files, %d failed, %.3fs\n", b.last - b.first, failed, t);
+  printf("# Stage    threads  busy(s)  utilization\n");
+  printf("# load     %7d  %7.3f  %10.1f%%\n", 1, stage[0].busy, 100.0*stage[0].busy/t);
+  printf("# process  %7d  %7.3f  %10.1f%%\n", b.nworkers, busy, 100.0*busy/(t*b.nworkers));
+  printf("# save     %7d  %7.3f  %10.1f%%\n", 1, stage[nstages-1].busy, 100.0*stage[nstages-1].busy/t);
+  long full, empty;
+  QueueStalls(b.loaded, &full, &empty);
+  printf("# Queue load->process: %ld stalls full, %ld stalls empty\n", full, empty);
+  QueueStalls(b.processed, &full, &empty);
+  printf("# Queue process->save: %ld stalls full, %ld stalls empty\n", full, empty);
+
+  QueueDestroy(&b.loaded);
+  QueueDestroy(&b.processed);
+  return failed;
+}
+
+// This program strives for correctness and robustness.
+// You may want to temporarily comment out operand validation, namely
+// precondition checks, so that you can force precondition violations, and
+// observe the effect of assertions.
+//
+// Also, the program does not test every module function, but you may easily
+// add new operations for that purpose.
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac > 2 && strcmp(av[1], "--trace") == 0) {
+    traceOpen(av[2]);
+    // os argumentos seguintes ficam a partir de av[1], como sem --trace
+    av[2] = av[0];
+    av += 2;
+    ac -= 2;
+  }
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  if (strcmp(av[1], "batch") == 0) {
+    if (ac < 3) error(1, 0, "%s", errors[1]);
+    int failed = runBatch(ac, av);
+    if (failed > 0) error(4, 0, "%d files failed", failed);
+    return 0;
+  }
+
+  if (strcmp(av[1], "index") == 0) {
+    int block;
+    if (ac < 4) error(1, 0, "%s", errors[1]);
+    if (sscanf(av[3], "%d", &block) != 1 || block < 2 || block > 1024) error(5, 0, "%s", errors[5]);
+    fprintf(stderr, "Indexing %d files in %s with %dx%d blocks\n", ac - 4, av[2], block, block);
+    if (!ImageIndexBuild(av[2], (const char**)(av + 4), ac - 4, block)) {
+      error(4, errno, errors[4], ImageErrMsg());
+    }
+    return 0;
+  }
+
+  if (strcmp(av[1], "stack") == 0) {
+    static const char* modes[] = { "mean", "median", "min", "max", NULL };
+    int mode = 0;
+    if (ac < 5) error(1, 0, "%s", errors[1]);
+    while (modes[mode] != NULL && strcmp(av[2], modes[mode]) != 0) mode++;
+    if (modes[mode] == NULL || ac - 4 > 65535) error(5, 0, "%s", errors[5]);
+    fprintf(stderr, "Stacking %d files (%s) -> %s\n", ac - 4, av[2], av[3]);
+    // Os modos estão pela ordem de STACK_MEAN..STACK_MAX
+    Image img = ImageStack((const char**)(av + 4), ac - 4, mode);
+    if (img == NULL || !ImageSave(img, av[3])) {
+      error(4, errno, errors[4], ImageErrMsg());
+    }
+    ImageDestroy(&img);
+    return 0;
+  }
+
+  if (strcmp(av[1], "paged") == 0) {
+    return runPaged(ac, av);
+  }
+
+  // With save -, the standard output carries images only: keep it in
+  // imageOut and send the reports, printed to stdout, to stderr.
+  for (int j = 2; j < ac; j++) {
+    if (strcmp(av[j-1], "save") == 0 && strcmp(av[j], "-") == 0) {
+      fflush(stdout);
+      imageOut = dup(STDOUT_FILENO);
+      if (imageOut < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        error(4, errno, "Cannot redirect the standard output");
+      }
+      break;
+    }
+  }
+
+  int err = 0;
+
+  // The image buffer
+  Buffer buf = { NULL, 0, 0, NULL, NULL, 0, 1 };
+
+  // Background loads and saves, indexed by argument
+  ImageIO io[ac];
+  for (int i = 0; i < ac; i++) io[i] = NULL;
+
+  int k = 1;
+  while (k < ac) {
+    prefetch(ac, av, io, k, MAXLOAD, buf.scale);
+    err = runOp(ac, av, &k, &buf, io);
+    if (err != 0) break;
     k++;
   }
   
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  // Finish background I/O: discard loads not used (after an error) and
+  // report the first failed save
+  const char* msg = ImageErrMsg();
+  int errnum = errno;
+  for (int i = 1; i < ac; i++) {
+    if (io[i] != NULL && strcmp(av[i-1], "save") != 0) {
+      Image loaded[MAXLOAD];
+      int m = ImageLoadWait(&io[i], loaded);
+      while (m > 0) ImageDestroy(&loaded[--m]);
+    }
   }
+  for (int i = 1; i < ac; i++) {
+    if (io[i] != NULL && !ImageSaveWait(&io[i]) && err == 0) {
+      err = 4;
+      msg = ImageErrMsg();
+      errnum = errno;
+    }
+  }
+
+  // Destroy remaining images
+  bufferFree(&buf);
 
-  error(err, errno, errors[err], ImageErrMsg());
+  error(err, errnum, errors[err], msg);
   return 0;
 }
 
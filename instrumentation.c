@@ -18,6 +18,10 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread has its own counters and reset time, so threads that run
+/// at the same time count only their own operations.  (Modules that hand
+/// work to other threads add their counts back to the calling thread.)
 
 #include "instrumentation.h"
 #include <stdio.h>
@@ -68,16 +72,16 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds) (of the calling thread)
+_Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
@@ -18,6 +18,10 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread has its own counters and reset time, so threads that run
+/// at the same time count only their own operations.  (Modules that hand
+/// work to other threads add their counts back to the calling thread.)
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -28,14 +32,14 @@ double cpu_time(void) ; ///
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds) (of the calling thread)
+extern _Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
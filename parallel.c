@@ -0,0 +1,102 @@
+/// A minimal parallel-for module.
+///
+/// Splits a range of indices into contiguous chunks and runs each chunk
+/// on its own thread (POSIX threads).
+
+#include "parallel.h"
+#include "instrumentation.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Upper limit on the number of chunks of one ParallelFor call.
+#define MAXTHREADS 64
+
+static int nthreadsCfg = 0;   // 0 = not yet set
+static _Thread_local int nthreadsLocal = 0;   // 0 = use nthreadsCfg
+
+/// Number of worker threads used by ParallelFor.
+int ParallelThreads(void) { ///
+  if (nthreadsLocal != 0) return nthreadsLocal;
+  if (nthreadsCfg == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreadsCfg = (n < 1) ? 1 : (n > MAXTHREADS ? MAXTHREADS : (int)n);
+  }
+  return nthreadsCfg;
+}
+
+/// Set the number of worker threads (nthreads >= 1).
+void ParallelSetThreads(int nthreads) { ///
+  assert (nthreads >= 1);
+  nthreadsCfg = (nthreads > MAXTHREADS) ? MAXTHREADS : nthreads;
+}
+
+/// Set the number of worker threads for the calling thread only
+/// (nthreads >= 1), or restore the global setting (nthreads == 0).
+void ParallelSetLocalThreads(int nthreads) { ///
+  assert (nthreads >= 0);
+  nthreadsLocal = (nthreads > MAXTHREADS) ? MAXTHREADS : nthreads;
+}
+
+// Arguments of one chunk
+typedef struct {
+  void (*fn)(void* arg, int begin, int end);
+  void* arg;
+  int begin;
+  int end;
+  unsigned long count[NUMCOUNTERS];   // contadores da thread que o correu
+} Chunk;
+
+static void* runChunk(void* p) {
+  Chunk* c = (Chunk*)p;
+  c->fn(c->arg, c->begin, c->end);
+  return NULL;
+}
+
+// Run a chunk in a new thread: its counters start at zero, and are kept
+// in the chunk for the caller to add.
+static void* runThread(void* p) {
+  Chunk* c = (Chunk*)p;
+  runChunk(c);
+  for (int i = 0; i < NUMCOUNTERS; i++) c->count[i] = InstrCount[i];
+  return NULL;
+}
+
+/// Run fn(arg, begin, end) over the index range [0, n), split in at most
+/// ParallelThreads() contiguous chunks of at least grain indices each.
+void ParallelFor(int n, int grain, void (*fn)(void* arg, int begin, int end), void* arg) { ///
+  assert (fn != NULL);
+  if (n <= 0) return;
+  if (grain < 1) grain = 1;
+  int nchunks = ParallelThreads();
+  if (nchunks > (n + grain - 1) / grain) nchunks = (n + grain - 1) / grain;
+  if (nchunks <= 1) {
+    fn(arg, 0, n);
+    return;
+  }
+
+  Chunk chunk[MAXTHREADS];
+  pthread_t tid[MAXTHREADS];
+  int started[MAXTHREADS];
+  for (int t = 0; t < nchunks; t++) {
+    chunk[t].fn = fn;
+    chunk[t].arg = arg;
+    chunk[t].begin = (int)((long)n * t / nchunks);
+    chunk[t].end = (int)((long)n * (t+1) / nchunks);
+  }
+  // The caller runs the first chunk itself
+  for (int t = 1; t < nchunks; t++) {
+    started[t] = pthread_create(&tid[t], NULL, runThread, &chunk[t]) == 0;
+  }
+  runChunk(&chunk[0]);
+  for (int t = 1; t < nchunks; t++) {
+    if (started[t]) {
+      pthread_join(tid[t], NULL);
+      for (int i = 0; i < NUMCOUNTERS; i++) InstrCount[i] += chunk[t].count[i];
+    } else {
+      runChunk(&chunk[t]);
+    }
+  }
+}
+
@@ -0,0 +1,40 @@
+/// A minimal parallel-for module.
+///
+/// Splits a range of indices into contiguous chunks and runs each chunk
+/// on its own thread (POSIX threads).
+///
+/// Use as follows:
+///
+/// static void work(void* arg, int begin, int end) {
+///   for (int i = begin; i < end; i++) { ... }
+/// }
+/// ...
+/// ParallelFor(n, 64, work, &args);  // chunks of >= 64 indices; returns
+///                                   // when all chunks are done
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/// Number of worker threads used by ParallelFor.
+/// Defaults to the number of online processors; may be changed by the
+/// caller with ParallelSetThreads.
+int ParallelThreads(void) ;
+
+/// Set the number of worker threads (nthreads >= 1).
+void ParallelSetThreads(int nthreads) ;
+
+/// Set the number of worker threads for ParallelFor calls made by the
+/// calling thread only (nthreads >= 1), or restore the global setting
+/// (nthreads == 0).  Threads that already run in parallel with others
+/// may use 1, so as not to oversubscribe the processors.
+void ParallelSetLocalThreads(int nthreads) ;
+
+/// Run fn(arg, begin, end) over the index range [0, n), split in at most
+/// ParallelThreads() contiguous chunks of at least grain indices each.
+/// The chunks run concurrently; fn must only write to data owned by its chunk.
+/// If threads cannot be created, the remaining chunks run in the caller.
+/// The instrumentation counts of all the chunks are added to the caller's.
+void ParallelFor(int n, int grain, void (*fn)(void* arg, int begin, int end), void* arg) ;
+
+#endif
+
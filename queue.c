@@ -0,0 +1,152 @@
+/// A lock-free bounded queue of pointers.
+///
+/// Multiple producers and multiple consumers may use the same queue
+/// concurrently (array-based, one sequence number per cell, after
+/// D. Vyukov's bounded MPMC queue).  SPSC use is just a special case.
+
+#include "queue.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Each cell holds an item and a sequence number that tells whether the
+// cell is ready to be written (seq == position) or read (seq == position+1)
+// at a given position of the queue.
+typedef struct {
+  atomic_size_t seq;
+  void* item;
+} Cell;
+
+// Producers and consumers update separate counters, kept in separate
+// cache lines so that they do not slow each other down.
+struct queue {
+  Cell* cell;
+  size_t mask;            // capacity-1
+  _Alignas(64) atomic_size_t tail;   // next position to write
+  _Alignas(64) atomic_size_t head;   // next position to read
+  _Alignas(64) atomic_long pushStalls;
+  atomic_long popStalls;
+};
+
+/// Create a queue with room for at least capacity items (capacity >= 1).
+Queue QueueCreate(int capacity) { ///
+  assert (capacity >= 1);
+  size_t size = 1;
+  while (size < (size_t)capacity) size <<= 1;
+  Queue q = (Queue)aligned_alloc(64, sizeof(struct queue));
+  if (q == NULL) return NULL;
+  q->cell = (Cell*)malloc(size * sizeof(Cell));
+  if (q->cell == NULL) {
+    free(q);
+    return NULL;
+  }
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&q->cell[i].seq, i);
+    q->cell[i].item = NULL;
+  }
+  q->mask = size - 1;
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->head, 0);
+  atomic_init(&q->pushStalls, 0);
+  atomic_init(&q->popStalls, 0);
+  return q;
+}
+
+/// Destroy the queue pointed to by (*pq) and set (*pq)=NULL.
+void QueueDestroy(Queue* pq) { ///
+  assert (pq != NULL);
+  if (*pq == NULL) return;
+  free((*pq)->cell);
+  free(*pq);
+  *pq = NULL;
+}
+
+/// Try to append item to the queue.
+int QueueTryPush(Queue q, void* item) { ///
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  for (;;) {
+    Cell* c = &q->cell[pos & q->mask];
+    size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    long diff = (long)(seq - pos);
+    if (diff == 0) {
+      // A célula está livre: reservá-la
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+            memory_order_relaxed, memory_order_relaxed)) {
+        c->item = item;
+        atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0;   // cheia
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+}
+
+/// Try to remove the oldest item from the queue into (*item).
+int QueueTryPop(Queue q, void** item) { ///
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  for (;;) {
+    Cell* c = &q->cell[pos & q->mask];
+    size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    long diff = (long)(seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+            memory_order_relaxed, memory_order_relaxed)) {
+        *item = c->item;
+        // Libertar a célula para a volta seguinte
+        atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0;   // vazia
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+}
+
+// Wait a little: yield the processor at first, then sleep, so that long
+// waits (a stage much slower than the other) do not burn a core.
+static void backoff(int* spins) {
+  if (++*spins < 64) {
+    sched_yield();
+  } else {
+    struct timespec t = { 0, 100000 };  // 0.1ms
+    nanosleep(&t, NULL);
+  }
+}
+
+/// Append item to the queue, waiting while it is full.
+void QueuePush(Queue q, void* item) { ///
+  if (QueueTryPush(q, item)) return;
+  atomic_fetch_add_explicit(&q->pushStalls, 1, memory_order_relaxed);
+  int spins = 0;
+  do {
+    backoff(&spins);
+  } while (!QueueTryPush(q, item));
+}
+
+/// Remove and return the oldest item of the queue, waiting while it is empty.
+void* QueuePop(Queue q) { ///
+  void* item;
+  if (QueueTryPop(q, &item)) return item;
+  atomic_fetch_add_explicit(&q->popStalls, 1, memory_order_relaxed);
+  int spins = 0;
+  do {
+    backoff(&spins);
+  } while (!QueueTryPop(q, &item));
+  return item;
+}
+
+/// Number of QueuePush calls that found the queue full and of QueuePop
+/// calls that found it empty.
+void QueueStalls(Queue q, long* pushStalls, long* popStalls) { ///
+  *pushStalls = atomic_load(&q->pushStalls);
+  *popStalls = atomic_load(&q->popStalls);
+}
+
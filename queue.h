@@ -0,0 +1,51 @@
+/// A lock-free bounded queue of pointers.
+///
+/// Multiple producers and multiple consumers may use the same queue
+/// concurrently (array-based, one sequence number per cell, after
+/// D. Vyukov's bounded MPMC queue).  SPSC use is just a special case.
+///
+/// Use as follows:
+///
+/// Queue q = QueueCreate(8);
+/// ...
+/// QueuePush(q, item);        // producer: waits while the queue is full
+/// ...
+/// void* item = QueuePop(q);  // consumer: waits while the queue is empty
+/// ...
+/// QueueDestroy(&q);
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/// Type Queue is a pointer to a bounded queue.
+typedef struct queue *Queue;
+
+/// Create a queue with room for at least capacity items (capacity >= 1).
+/// The capacity is rounded up to a power of 2.
+/// On failure (out of memory), returns NULL.
+Queue QueueCreate(int capacity) ;
+
+/// Destroy the queue pointed to by (*pq) and set (*pq)=NULL.
+/// The items still in the queue are not freed.
+void QueueDestroy(Queue* pq) ;
+
+/// Try to append item to the queue.
+/// Returns 0 if the queue is full.
+int QueueTryPush(Queue q, void* item) ;
+
+/// Try to remove the oldest item from the queue into (*item).
+/// Returns 0 if the queue is empty.
+int QueueTryPop(Queue q, void** item) ;
+
+/// Append item to the queue, waiting while it is full.
+void QueuePush(Queue q, void* item) ;
+
+/// Remove and return the oldest item of the queue, waiting while it is empty.
+void* QueuePop(Queue q) ;
+
+/// Number of QueuePush calls that found the queue full and of QueuePop
+/// calls that found it empty (that is, that had to wait).
+void QueueStalls(Queue q, long* pushStalls, long* popStalls) ;
+
+#endif
+